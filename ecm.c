@@ -19,7 +19,12 @@
 ////////////////////////////////////////////////////////////////////////////////
 
 #include "common.h"
+#ifndef ECM_NO_MAIN
 #include "banner.h"
+#endif
+#include "ecm.h"
+
+#include <math.h>
 
 ////////////////////////////////////////////////////////////////////////////////
 //
@@ -67,6 +72,19 @@
 
 ////////////////////////////////////////////////////////////////////////////////
 
+static uint16_t get16lsb(const uint8_t* src) {
+    return (uint16_t)(src[0] | (src[1] << 8));
+}
+
+#ifndef ECM_NO_MAIN
+
+static void put16lsb(uint8_t* dest, uint16_t value) {
+    dest[0] = (uint8_t)(value     );
+    dest[1] = (uint8_t)(value >> 8);
+}
+
+#endif
+
 static uint32_t get32lsb(const uint8_t* src) {
     return
         (((uint32_t)(src[0])) <<  0) |
@@ -82,25 +100,565 @@ static void put32lsb(uint8_t* dest, uint32_t value) {
     dest[3] = (uint8_t)(value >> 24);
 }
 
+#ifndef ECM_NO_MAIN
+
+static uint32_t get32msb(const uint8_t* src) {
+    return
+        (((uint32_t)(src[0])) << 24) |
+        (((uint32_t)(src[1])) << 16) |
+        (((uint32_t)(src[2])) <<  8) |
+        (((uint32_t)(src[3])) <<  0);
+}
+
+static void put32msb(uint8_t* dest, uint32_t value) {
+    dest[0] = (uint8_t)(value >> 24);
+    dest[1] = (uint8_t)(value >> 16);
+    dest[2] = (uint8_t)(value >>  8);
+    dest[3] = (uint8_t)(value      );
+}
+
+#endif
+
+//
+// 64-bit fields are read and written as off_t
+//
+#define OFF_MAX ((off_t)((((uint64_t)1) << (sizeof(off_t) * 8 - 1)) - 1))
+
+//
+// Returns -1 for a value too big for an off_t, which no valid field holds
+//
+static off_t get64lsb(const uint8_t* src) {
+    uint64_t value =
+        ((uint64_t)get32lsb(src)) |
+        (((uint64_t)get32lsb(src + 4)) << 32);
+    return value > (uint64_t)OFF_MAX ? -1 : (off_t)value;
+}
+
+static void put64lsb(uint8_t* dest, off_t value) {
+    put32lsb(dest, (uint32_t)value);
+    put32lsb(dest + 4, (uint32_t)((value >> 16) >> 16));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Worker threads
+//
+// POSIX threads are used where available; elsewhere, workers simply run one
+// after another on the calling thread
+//
+#if defined(_POSIX_THREADS) && (_POSIX_THREADS > 0)
+#include <pthread.h>
+#define ECM_THREADS 1
+#endif
+
+#ifndef ECM_NO_MAIN
+
+//
+// Number of worker threads to use; 0 means one per online processor
+//
+static unsigned thread_count = 0;
+
+static unsigned get_thread_count(void) {
+#if defined(ECM_THREADS) && defined(_SC_NPROCESSORS_ONLN)
+    if(thread_count == 0) {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        thread_count = (n < 1) ? 1 : (n > 64) ? 64 : (unsigned)n;
+    }
+#endif
+    if(thread_count == 0) { thread_count = 1; }
+    return thread_count;
+}
+
+typedef void (*worker_func)(void* context, unsigned index);
+
+#ifdef ECM_THREADS
+typedef struct {
+    worker_func func;
+    void* context;
+    unsigned index;
+    pthread_t thread;
+} worker;
+
+static void* worker_main(void* w) {
+    ((worker*)w)->func(((worker*)w)->context, ((worker*)w)->index);
+    return NULL;
+}
+#endif
+
+//
+// Call func(context, i) for each i in [0, count) and wait for all of them to
+// return
+//
+static void run_workers(worker_func func, void* context, unsigned count) {
+#ifdef ECM_THREADS
+    worker* workers = NULL;
+    unsigned started = 0;
+    unsigned i;
+    if(count > 1) {
+        workers = malloc(sizeof(worker) * count);
+    }
+    if(workers) {
+        for(i = 1; i < count; i++) {
+            workers[i].func    = func;
+            workers[i].context = context;
+            workers[i].index   = i;
+            if(pthread_create(&workers[i].thread, NULL, worker_main, workers + i)) {
+                break;
+            }
+            started = i;
+        }
+        //
+        // Anything we couldn't start runs here instead
+        //
+        func(context, 0);
+        for(i = started + 1; i < count; i++) {
+            func(context, i);
+        }
+        for(i = 1; i <= started; i++) {
+            pthread_join(workers[i].thread, NULL);
+        }
+        free(workers);
+        return;
+    }
+#endif
+    {   unsigned i;
+        for(i = 0; i < count; i++) {
+            func(context, i);
+        }
+    }
+}
+
+//
+// Same as run_workers, but returns immediately; call background_wait before
+// starting another or touching anything the workers use
+//
+typedef struct {
+    worker_func func;
+    void* context;
+    unsigned count;
+    int8_t running;
+#ifdef ECM_THREADS
+    pthread_t thread;
+#endif
+} background;
+
+#ifdef ECM_THREADS
+static void* background_main(void* b) {
+    run_workers(((background*)b)->func, ((background*)b)->context, ((background*)b)->count);
+    return NULL;
+}
+#endif
+
+static void background_start(background* b, worker_func func, void* context, unsigned count) {
+    b->func    = func;
+    b->context = context;
+    b->count   = count;
+    b->running = 0;
+#ifdef ECM_THREADS
+    if(!pthread_create(&b->thread, NULL, background_main, b)) {
+        b->running = 1;
+        return;
+    }
+#endif
+    run_workers(func, context, count);
+}
+
+static void background_wait(background* b) {
+#ifdef ECM_THREADS
+    if(b->running) {
+        pthread_join(b->thread, NULL);
+    }
+#endif
+    b->running = 0;
+}
+
+//
+// Shared job counter for workers; hands out job numbers [0, count) in order
+// and remembers the first error any worker reports
+//
+typedef struct {
+#ifdef ECM_THREADS
+    pthread_mutex_t mutex;
+#endif
+    size_t next;
+    size_t count;
+    int error; // errno value of the first failure, or -1 if it wasn't a file error
+    int8_t failed;
+} jobqueue;
+
+static void jobqueue_init(jobqueue* q, size_t count) {
+#ifdef ECM_THREADS
+    pthread_mutex_init(&q->mutex, NULL);
+#endif
+    q->next = 0;
+    q->count = count;
+    q->error = 0;
+    q->failed = 0;
+}
+
+static void jobqueue_destroy(jobqueue* q) {
+#ifdef ECM_THREADS
+    pthread_mutex_destroy(&q->mutex);
+#else
+    (void)q;
+#endif
+}
+
+//
+// Returns nonzero and sets *job if there's work left
+//
+static int8_t jobqueue_take(jobqueue* q, size_t* job) {
+    int8_t any;
+#ifdef ECM_THREADS
+    pthread_mutex_lock(&q->mutex);
+#endif
+    any = (q->next < q->count);
+    if(any) { *job = q->next++; }
+#ifdef ECM_THREADS
+    pthread_mutex_unlock(&q->mutex);
+#endif
+    return any;
+}
+
+//
+// Stop handing out jobs and record the reason
+//
+static void jobqueue_fail(jobqueue* q, int error) {
+#ifdef ECM_THREADS
+    pthread_mutex_lock(&q->mutex);
+#endif
+    if(!q->failed) {
+        q->failed = 1;
+        q->error = error;
+    }
+    q->next = q->count;
+#ifdef ECM_THREADS
+    pthread_mutex_unlock(&q->mutex);
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Timeline tracing (--trace=file.json)
+//
+// Spans are written as Chrome trace-event "complete" events, which Perfetto
+// and about:tracing can display.  While no trace file is open, trace_begin
+// doesn't read the clock and trace_end returns immediately.
+//
+// Thread ids are logical: 0 is the main thread, and worker n is n + 1.
+//
+static FILE* trace_file = NULL;
+static int8_t trace_first = 1;
+#ifdef ECM_THREADS
+static pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static double trace_now(void) {
+#if defined(_POSIX_TIMERS) && (_POSIX_TIMERS > 0) && defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+    if(clock_gettime(CLOCK_MONOTONIC, &ts) == 0) {
+        return ((double)ts.tv_sec) * 1e6 + ((double)ts.tv_nsec) / 1e3;
+    }
+#endif
+    return ((double)clock()) * 1e6 / CLOCKS_PER_SEC;
+}
+
+static double trace_begin(void) {
+    return trace_file ? trace_now() : 0;
+}
+
+static void trace_end(
+    const char* name,
+    double start,
+    unsigned tid,
+    off_t offset,
+    off_t bytes
+) {
+    double end;
+    if(!trace_file) { return; }
+    end = trace_now();
+#ifdef ECM_THREADS
+    pthread_mutex_lock(&trace_mutex);
+#endif
+    fprintf(trace_file,
+        "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,"
+        "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"offset\":",
+        trace_first ? "" : ",\n", name, tid, start, end - start
+    );
+    fprintdec(trace_file, offset);
+    fprintf(trace_file, ",\"bytes\":");
+    fprintdec(trace_file, bytes);
+    fprintf(trace_file, "}}");
+    trace_first = 0;
+#ifdef ECM_THREADS
+    pthread_mutex_unlock(&trace_mutex);
+#endif
+}
+
+//
+// Returns nonzero on error
+//
+static int8_t trace_open(const char* filename) {
+    trace_file = fopen(filename, "w");
+    if(!trace_file) {
+        printfileerror(NULL, filename);
+        return 1;
+    }
+    fprintf(trace_file, "[\n");
+    trace_first = 1;
+    return 0;
+}
+
+static void trace_close(void) {
+    if(!trace_file) { return; }
+    fprintf(trace_file, "\n]\n");
+    fclose(trace_file);
+    trace_file = NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Hardware performance counters per phase (--perf-counters)
+//
+// Uses perf_event_open on Linux.  Counts are charged to whichever phase the
+// main thread is in, exclusively: the ECC and EDC of a sector checked during
+// detection count toward ECC and EDC, not detection.  Every switch costs a
+// read() of the counters, so phases change at most once per sector (ECC and
+// EDC, and detection where something may start) and otherwise at coarse
+// points (a refill, a batch of detection, a block or wave of output).  The
+// counters are inherited by threads started after they're opened, and
+// whatever the workers do is charged to the phase the main thread is in
+// meanwhile.  Everywhere else, or if the kernel won't allow it, this does
+// nothing.
+//
+#define PHASE_OTHER  0
+#define PHASE_DETECT 1
+#define PHASE_ECC    2
+#define PHASE_EDC    3
+#define PHASE_ENCODE 4
+#define PHASE_DECODE 5
+#define PHASE_IO     6
+#define PHASE_COUNT  7
+
+#if defined(__linux__) && (defined(_DEFAULT_SOURCE) || defined(_GNU_SOURCE))
+
+static int8_t perf_enabled = 0;
+
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+
+#define PERF_EVENTS 5
+
+static const char* const perf_phase_names[PHASE_COUNT] = {
+    "other", "detect", "ecc", "edc", "encode", "decode", "io"
+};
+
+static const char* const perf_event_names[PERF_EVENTS] = {
+    "cycles", "instructions", "L1D-misses", "LLC-misses", "branch-misses"
+};
+
+static int      perf_fds[PERF_EVENTS];
+static int8_t   perf_slot[PERF_EVENTS]; // position in the group read, or -1
+static int      perf_members = 0;
+static uint64_t perf_last[PERF_EVENTS];
+static uint64_t perf_totals[PHASE_COUNT][PERF_EVENTS];
+static int      perf_phase = PHASE_OTHER;
+static off_t    perf_bytes = 0;
+#ifdef ECM_THREADS
+static pthread_t perf_thread;
+#endif
+
+static void perf_read(uint64_t* values) {
+    uint64_t buffer[1 + PERF_EVENTS];
+    int e;
+    if(read(perf_fds[0], buffer, sizeof(buffer)) < (ssize_t)(sizeof(uint64_t) * (1 + perf_members))) {
+        memcpy(values, perf_last, sizeof(perf_last));
+        return;
+    }
+    for(e = 0; e < PERF_EVENTS; e++) {
+        values[e] = (perf_slot[e] >= 0) ? buffer[1 + perf_slot[e]] : 0;
+    }
+}
+
+//
+// Charge everything since the last switch to the current phase, then move to
+// a new one; returns the phase we were in
+//
+static int perf_switch(int phase) {
+    uint64_t now[PERF_EVENTS];
+    int previous = perf_phase;
+    int e;
+#ifdef ECM_THREADS
+    if(!pthread_equal(pthread_self(), perf_thread)) { return phase; }
+#endif
+    perf_read(now);
+    for(e = 0; e < PERF_EVENTS; e++) {
+        perf_totals[previous][e] += now[e] - perf_last[e];
+        perf_last[e] = now[e];
+    }
+    perf_phase = phase;
+    return previous;
+}
+
+static int perf_open_one(uint32_t type, uint64_t config, int group) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = (group < 0);
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.inherit = 1;
+    attr.read_format = PERF_FORMAT_GROUP;
+    return (int)syscall(__NR_perf_event_open, &attr, 0, -1, group, 0);
+}
+
+//
+// Falls back to running without counters if they can't be opened
+//
+static void perf_open(void) {
+    static const uint32_t types[PERF_EVENTS] = {
+        PERF_TYPE_HARDWARE,
+        PERF_TYPE_HARDWARE,
+        PERF_TYPE_HW_CACHE,
+        PERF_TYPE_HARDWARE,
+        PERF_TYPE_HARDWARE
+    };
+    static const uint64_t configs[PERF_EVENTS] = {
+        PERF_COUNT_HW_CPU_CYCLES,
+        PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_CACHE_L1D |
+            (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+            (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+        PERF_COUNT_HW_CACHE_MISSES,
+        PERF_COUNT_HW_BRANCH_MISSES
+    };
+    int e;
+
+    perf_enabled = 0;
+    perf_members = 0;
+    for(e = 0; e < PERF_EVENTS; e++) {
+        perf_fds[e] = perf_open_one(types[e], configs[e], e ? perf_fds[0] : -1);
+        perf_slot[e] = -1;
+        if(perf_fds[e] >= 0) {
+            perf_slot[e] = perf_members++;
+        } else if(e == 0) {
+            printf("Performance counters unavailable (%s); continuing without them\n",
+                strerror(errno));
+            return;
+        }
+    }
+    memset(perf_totals, 0, sizeof(perf_totals));
+    memset(perf_last, 0, sizeof(perf_last));
+    perf_phase = PHASE_OTHER;
+    perf_bytes = 0;
+#ifdef ECM_THREADS
+    perf_thread = pthread_self();
+#endif
+    ioctl(perf_fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(perf_fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    perf_enabled = 1;
+}
+
+static void perf_report(void) {
+    double mb;
+    int p, e;
+    if(!perf_enabled) { return; }
+    perf_switch(PHASE_OTHER);
+    mb = ((double)perf_bytes) / 1048576.0;
+    printf("Performance counters (totals, then per MB of image data):\n");
+    printf("%-8s", "phase");
+    for(e = 0; e < PERF_EVENTS; e++) {
+        printf(" %16s", perf_event_names[e]);
+    }
+    printf(" %6s\n", "IPC");
+    for(p = 0; p < PHASE_COUNT; p++) {
+        printf("%-8s", perf_phase_names[p]);
+        for(e = 0; e < PERF_EVENTS; e++) {
+            if(perf_slot[e] < 0) {
+                printf(" %16s", "n/a");
+            } else {
+                printf(" %16.0f", (double)perf_totals[p][e]);
+            }
+        }
+        printf(" %6.2f\n", perf_totals[p][0] ?
+            ((double)perf_totals[p][1]) / ((double)perf_totals[p][0]) : 0.0);
+        if(mb > 0) {
+            printf("%-8s", "  /MB");
+            for(e = 0; e < PERF_EVENTS; e++) {
+                if(perf_slot[e] < 0) {
+                    printf(" %16s", "n/a");
+                } else {
+                    printf(" %16.0f", ((double)perf_totals[p][e]) / mb);
+                }
+            }
+            printf("\n");
+        }
+    }
+}
+
+static void perf_close(void) {
+    int e;
+    if(!perf_enabled) { return; }
+    for(e = 0; e < PERF_EVENTS; e++) {
+        if(perf_fds[e] >= 0) { close(perf_fds[e]); }
+    }
+    perf_enabled = 0;
+}
+
+#define PERF_ENTER(phase) int perf_saved_phase = perf_enabled ? perf_switch(phase) : 0
+#define PERF_LEAVE() do { if(perf_enabled) { perf_switch(perf_saved_phase); } } while(0)
+#define PERF_BYTES(n) do { perf_bytes = (n); } while(0)
+
+#else
+
+static void perf_open(void) {
+    printf("Performance counters unavailable on this platform; continuing without them\n");
+}
+static void perf_report(void) {}
+static void perf_close(void) {}
+
+#define PERF_ENTER(phase) int perf_saved_phase = (phase)
+#define PERF_LEAVE() do { (void)perf_saved_phase; } while(0)
+#define PERF_BYTES(n) do { } while(0)
+
+#endif
+
+#else
+
+//
+// The library has no --perf-counters
+//
+#define PERF_ENTER(phase) int perf_saved_phase = 0
+#define PERF_LEAVE() do { (void)perf_saved_phase; } while(0)
+
+#endif
+
 ////////////////////////////////////////////////////////////////////////////////
 //
-// LUTs used for computing ECC/EDC
+// LUTs used for computing ECC/EDC, and the CRC-32 of --hash
 //
 static uint8_t  ecc_f_lut[256];
 static uint8_t  ecc_b_lut[256];
 static uint32_t edc_lut  [256];
+static uint32_t crc32_lut[256];
 
 static void eccedc_init(void) {
     size_t i;
     for(i = 0; i < 256; i++) {
         uint32_t edc = i;
+        uint32_t crc = i;
         size_t j = (i << 1) ^ (i & 0x80 ? 0x11D : 0);
         ecc_f_lut[i] = j;
         ecc_b_lut[i ^ j] = i;
         for(j = 0; j < 8; j++) {
             edc = (edc >> 1) ^ (edc & 1 ? 0xD8018001 : 0);
+            crc = (crc >> 1) ^ (crc & 1 ? 0xEDB88320 : 0);
         }
         edc_lut[i] = edc;
+        crc32_lut[i] = crc;
     }
 }
 
@@ -119,6 +677,75 @@ static uint32_t edc_compute(
     return edc;
 }
 
+//
+// Compute the EDC of one sector, charged to the EDC phase
+//
+static uint32_t edc_sector(const uint8_t* src, size_t size) {
+    uint32_t edc;
+    PERF_ENTER(PHASE_EDC);
+    edc = edc_compute(0, src, size);
+    PERF_LEAVE();
+    return edc;
+}
+
+#ifndef ECM_NO_MAIN
+
+//
+// Given the EDC of A and the EDC of B (each started from 0), return the EDC
+// of A followed by B, without touching the data
+//
+static uint32_t gf2_matrix_times(const uint32_t* mat, uint32_t vec) {
+    uint32_t sum = 0;
+    for(; vec; vec >>= 1, mat++) {
+        if(vec & 1) { sum ^= *mat; }
+    }
+    return sum;
+}
+
+static void gf2_matrix_square(uint32_t* square, const uint32_t* mat) {
+    int n;
+    for(n = 0; n < 32; n++) {
+        square[n] = gf2_matrix_times(mat, mat[n]);
+    }
+}
+
+static uint32_t edc_combine(uint32_t edc_a, uint32_t edc_b, off_t size_b) {
+    uint32_t even[32];
+    uint32_t odd[32];
+    uint32_t row = 1;
+    int n;
+
+    if(size_b <= 0) { return edc_a ^ edc_b; }
+
+    //
+    // Operator for one zero bit
+    //
+    odd[0] = 0xD8018001;
+    for(n = 1; n < 32; n++) {
+        odd[n] = row;
+        row <<= 1;
+    }
+    gf2_matrix_square(even, odd); // two zero bits
+    gf2_matrix_square(odd, even); // four zero bits
+
+    //
+    // Apply one zero byte, two, four, ... as the bits of size_b call for
+    //
+    do {
+        gf2_matrix_square(even, odd);
+        if(size_b & 1) { edc_a = gf2_matrix_times(even, edc_a); }
+        size_b >>= 1;
+        if(!size_b) { break; }
+        gf2_matrix_square(odd, even);
+        if(size_b & 1) { edc_a = gf2_matrix_times(odd, edc_a); }
+        size_b >>= 1;
+    } while(size_b);
+
+    return edc_a ^ edc_b;
+}
+
+#endif
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Check ECC block (either P or Q)
@@ -211,9 +838,13 @@ static int8_t ecc_checksector(
     const uint8_t *data,
     const uint8_t *ecc
 ) {
-    return
+    int8_t match;
+    PERF_ENTER(PHASE_ECC);
+    match =
         ecc_checkpq(address, data, 86, 24,  2, 86, ecc) &&      // P
         ecc_checkpq(address, data, 52, 43, 86, 88, ecc + 0xAC); // Q
+    PERF_LEAVE();
+    return match;
 }
 
 //
@@ -224,8 +855,10 @@ static void ecc_writesector(
     const uint8_t *data,
     uint8_t *ecc
 ) {
+    PERF_ENTER(PHASE_ECC);
     ecc_writepq(address, data, 86, 24,  2, 86, ecc);        // P
     ecc_writepq(address, data, 52, 43, 86, 88, ecc + 0xAC); // Q
+    PERF_LEAVE();
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -234,108 +867,360 @@ static const uint8_t zeroaddress[4] = {0, 0, 0, 0};
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Check if this is a sector we can compress
+// Record types
 //
-// Sector types:
-//   0: Literal bytes (not a sector)
-//   1: 2352 mode 1         predict sync, mode, reserved, edc, ecc
-//   2: 2336 mode 2 form 1  predict redundant flags, edc, ecc
-//   3: 2336 mode 2 form 2  predict redundant flags, edc
+// 0-3 are the original types: literal bytes, mode 1, mode 2 form 1 and mode 2
+// form 2.  Version 2 files can also hold extended types, numbered from
+// TYPE_EXTENDED here (see write_type_count for how they're stored).  What each
+// type stores, and how it's detected and rebuilt, is in sector_types.
 //
-static int8_t detect_sector(const uint8_t* sector, size_t size_available) {
-    if(
-        size_available >= 2352 &&
-        sector[0x000] == 0x00 && // sync (12 bytes)
-        sector[0x001] == 0xFF &&
-        sector[0x002] == 0xFF &&
-        sector[0x003] == 0xFF &&
-        sector[0x004] == 0xFF &&
-        sector[0x005] == 0xFF &&
-        sector[0x006] == 0xFF &&
-        sector[0x007] == 0xFF &&
-        sector[0x008] == 0xFF &&
-        sector[0x009] == 0xFF &&
-        sector[0x00A] == 0xFF &&
-        sector[0x00B] == 0x00 &&
-        sector[0x00F] == 0x01 && // mode (1 byte)
-        sector[0x814] == 0x00 && // reserved (8 bytes)
-        sector[0x815] == 0x00 &&
-        sector[0x816] == 0x00 &&
-        sector[0x817] == 0x00 &&
-        sector[0x818] == 0x00 &&
-        sector[0x819] == 0x00 &&
-        sector[0x81A] == 0x00 &&
-        sector[0x81B] == 0x00
-    ) {
-        //
-        // Might be Mode 1
-        //
-        if(
-            ecc_checksector(
-                sector + 0xC,
-                sector + 0x10,
-                sector + 0x81C
-            ) &&
-            edc_compute(0, sector, 0x810) == get32lsb(sector + 0x810)
-        ) {
-            return 1; // Mode 1
-        }
+#define TYPE_EXTENDED          4
+#define TYPE_MODE1_SEQ         4 // mode 1, addresses counting up from the run's first
+#define TYPE_RAW_MODE2         5 // 2352-byte mode 2, any form, addresses counting up
+#define TYPE_MODE0             6 // 2352-byte mode 0, addresses counting up
+#define TYPE_MODE2_FORM2_NOEDC 7 // 2336-byte mode 2 form 2 without the optional EDC
+#define TYPE_COOKED            8 // 2048 bytes of user data, from an image without headers
+#define TYPE_PATCHED           9 // 2352-byte sector that rebuilds with a few bytes wrong
+#define TYPE_MODE2_PATCHED    10 // 2336-byte sector that rebuilds with a few bytes wrong
+#define TYPE_FILL             11 // 2352-byte sectors of one byte repeated, addresses counting up
+#define TYPE_MODE2_FILL       12 // 2336-byte sectors of one byte repeated
+#define TYPE_COOKED_FILL      13 // 2048 bytes of one byte repeated
+#define TYPE_REPEAT           14 // 2352-byte sectors already written, addresses counting up
+#define TYPE_MODE2_REPEAT     15 // 2336-byte sectors already written
+#define TYPE_COOKED_REPEAT    16 // 2048 bytes already written
+#define TYPE_STORED           17 // 2352-byte sectors in the shared store, addresses counting up
+#define TYPE_MODE2_STORED     18 // 2336-byte sectors in the shared store
+#define TYPE_COOKED_STORED    19 // 2048 bytes in the shared store
+#define TYPE_BASE             20 // 2352-byte sectors in the base image, addresses counting up
+#define TYPE_MODE2_BASE       21 // 2336-byte sectors in the base image
+#define TYPE_COOKED_BASE      22 // 2048 bytes in the base image
+#define TYPE_COUNT            23
 
-    } else if(
-        size_available >= 2336 &&
-        sector[0] == sector[4] && // flags (4 bytes)
-        sector[1] == sector[5] && //   versus redundant copy
-        sector[2] == sector[6] &&
-        sector[3] == sector[7]
-    ) {
-        //
-        // Might be Mode 2, Form 1 or 2
-        //
-        if(
-            ecc_checksector(
-                zeroaddress,
-                sector,
-                sector + 0x80C
-            ) &&
-            edc_compute(0, sector, 0x808) == get32lsb(sector + 0x808)
-        ) {
-            return 2; // Mode 2, Form 1
-        }
-        //
-        // Might be Mode 2, Form 2
-        //
-        if(
-            edc_compute(0, sector, 0x91C) == get32lsb(sector + 0x91C)
-        ) {
-            return 3; // Mode 2, Form 2
-        }
-    }
+//
+// TYPE_RAW_MODE2 runs store a 2-bit code per sector, low bits first, giving
+// the type of its 2336-byte body.  Form 1 bodies store 0x804 bytes and the
+// others RAW_MODE2_EXTRA more.
+//
+#define RAW_FORM_CODES 3
+#define RAW_MODE2_EXTRA (0x918 - 0x804)
 
-    //
-    // Nothing
-    //
-    return 0;
+static const int8_t raw_form_types[RAW_FORM_CODES] = { 2, 3, TYPE_MODE2_FORM2_NOEDC };
+
+static size_t form_map_size(uint32_t count) {
+    return ((size_t)count + 3) / 4;
+}
+
+static int8_t form_code(const uint8_t* map, uint32_t n) {
+    return (map[n >> 2] >> ((n & 3) * 2)) & 3;
+}
+
+//
+// Number of nonzero codes (long units) in one byte of the map
+//
+static unsigned long_units(uint8_t b) {
+    b = (uint8_t)((b | (b >> 1)) & 0x55);
+    b = (uint8_t)((b & 0x33) + ((b >> 2) & 0x33));
+    return (b + (b >> 4)) & 0x0F;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Reconstruct a sector based on type
+// Sector addresses are BCD minutes:seconds:frames, at 75 frames per second
 //
-static void reconstruct_sector(
-    uint8_t* sector, // must point to a full 2352-byte sector
-    int8_t type
-) {
-    //
-    // Sync
-    //
-    sector[0x000] = 0x00;
-    sector[0x001] = 0xFF;
-    sector[0x002] = 0xFF;
-    sector[0x003] = 0xFF;
-    sector[0x004] = 0xFF;
-    sector[0x005] = 0xFF;
-    sector[0x006] = 0xFF;
-    sector[0x007] = 0xFF;
+#define MSF_FRAMES (100L * 60 * 75)
+
+static int bcd_value(uint8_t b) {
+    if((b & 0x0F) > 9 || (b >> 4) > 9) { return -1; }
+    return (b >> 4) * 10 + (b & 0x0F);
+}
+
+//
+// Returns the address as a frame number, or -1 if it isn't valid
+//
+static long msf_to_frames(const uint8_t* msf) {
+    int m = bcd_value(msf[0]);
+    int s = bcd_value(msf[1]);
+    int f = bcd_value(msf[2]);
+    if(m < 0 || s < 0 || s >= 60 || f < 0 || f >= 75) { return -1; }
+    return (m * 60L + s) * 75 + f;
+}
+
+static void frames_to_msf(long frames, uint8_t* msf) {
+    int m = (int)(frames / (60 * 75));
+    int s = (int)((frames / 75) % 60);
+    int f = (int)(frames % 75);
+    msf[0] = (uint8_t)(((m / 10) << 4) | (m % 10));
+    msf[1] = (uint8_t)(((s / 10) << 4) | (s % 10));
+    msf[2] = (uint8_t)(((f / 10) << 4) | (f % 10));
+}
+
+//
+// Address n sectors after start, wrapping at 100 minutes; start must be valid
+//
+static void msf_add(const uint8_t* start, off_t n, uint8_t* msf) {
+    frames_to_msf((long)((msf_to_frames(start) + n) % MSF_FRAMES), msf);
+}
+
+#ifndef ECM_NO_MAIN
+
+//
+// Returns nonzero if next is the address right after prev
+//
+static int8_t msf_follows(const uint8_t* prev, const uint8_t* next) {
+    long frames = msf_to_frames(prev);
+    return frames >= 0 && msf_to_frames(next) == (frames + 1) % MSF_FRAMES;
+}
+
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Subchannel data
+//
+// Images dumped with subchannel data have 2448-byte sectors: the 2352 bytes of
+// the sector, then 96 bytes of the P-W channels.  Those are either interleaved
+// (bit 7 of each byte is P, bit 6 is Q, and so on) or packed one channel after
+// another, 12 bytes each.
+//
+// The Q channel normally gives the sector's position: control/ADR, track,
+// index, relative address, a zero byte, absolute address, and a CRC.  Given
+// one sector's subchannel, those of the sectors after it can be predicted.
+//
+#define SUBCHANNEL_SIZE        96
+#define SUBCHANNEL_INTERLEAVED 0
+#define SUBCHANNEL_PACKED      1
+
+static void subchannel_get_q(const uint8_t* sub, int8_t layout, uint8_t* q) {
+    unsigned i, b;
+    if(layout == SUBCHANNEL_PACKED) {
+        memcpy(q, sub + 12, 12);
+        return;
+    }
+    for(i = 0; i < 12; i++) {
+        uint8_t byte = 0;
+        for(b = 0; b < 8; b++) {
+            byte = (uint8_t)((byte << 1) | ((sub[i * 8 + b] >> 6) & 1));
+        }
+        q[i] = byte;
+    }
+}
+
+static void subchannel_put_q(uint8_t* sub, int8_t layout, const uint8_t* q) {
+    unsigned i, b;
+    if(layout == SUBCHANNEL_PACKED) {
+        memcpy(sub + 12, q, 12);
+        return;
+    }
+    for(i = 0; i < 12; i++) {
+        for(b = 0; b < 8; b++) {
+            sub[i * 8 + b] = (uint8_t)(
+                (sub[i * 8 + b] & ~0x40) | (((q[i] >> (7 - b)) & 1) << 6)
+            );
+        }
+    }
+}
+
+//
+// CRC-16-CCITT of the first 10 bytes of the Q channel, which is stored
+// inverted in the last 2
+//
+static uint16_t q_crc(const uint8_t* q) {
+    uint16_t crc = 0;
+    unsigned i, b;
+    for(i = 0; i < 10; i++) {
+        crc ^= (uint16_t)(q[i] << 8);
+        for(b = 0; b < 8; b++) {
+            crc = (uint16_t)((crc & 0x8000) ? ((crc << 1) ^ 0x1021) : (crc << 1));
+        }
+    }
+    return (uint16_t)~crc;
+}
+
+static int8_t q_valid(const uint8_t* q) {
+    uint16_t crc = q_crc(q);
+    return q[10] == (crc >> 8) && q[11] == (crc & 0xFF);
+}
+
+#ifndef ECM_NO_MAIN
+
+//
+// Returns the layout in which this subchannel has a valid Q channel, or -1
+//
+static int8_t subchannel_layout(const uint8_t* sub) {
+    uint8_t q[12];
+    subchannel_get_q(sub, SUBCHANNEL_INTERLEAVED, q);
+    if(q_valid(q)) { return SUBCHANNEL_INTERLEAVED; }
+    subchannel_get_q(sub, SUBCHANNEL_PACKED, q);
+    if(q_valid(q)) { return SUBCHANNEL_PACKED; }
+    return -1;
+}
+
+#endif
+
+//
+// Predict the subchannel of the sector n after base: the same P and R-W bits,
+// and the Q channel with both addresses moved on by n (the relative address
+// counts down in a pregap) and its CRC redone
+//
+// Returns nonzero if base has a valid position in its Q channel
+//
+static int8_t subchannel_predict(const uint8_t* base, off_t n, int8_t layout, uint8_t* sub) {
+    uint8_t q[12];
+    uint16_t crc;
+    long rel;
+
+    subchannel_get_q(base, layout, q);
+    if(!q_valid(q) || (q[0] & 0x0F) != 1) { return 0; }
+    rel = msf_to_frames(q + 3);
+    if(rel < 0 || msf_to_frames(q + 7) < 0) { return 0; }
+    if(q[2] == 0) {
+        if(n > rel) { return 0; }
+        rel -= (long)n;
+    } else {
+        rel = (long)((rel + n) % MSF_FRAMES);
+    }
+    frames_to_msf(rel, q + 3);
+    msf_add(q + 7, n, q + 7);
+    crc = q_crc(q);
+    q[10] = (uint8_t)(crc >> 8);
+    q[11] = (uint8_t)(crc & 0xFF);
+    memcpy(sub, base, SUBCHANNEL_SIZE);
+    subchannel_put_q(sub, layout, q);
+    return 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Sector detectors
+//
+// Each returns nonzero if the data is a unit of its type that rebuilds
+// exactly from the parts that type stores.
+//
+static int8_t has_sync(const uint8_t* sector) {
+    return
+        sector[0x000] == 0x00 &&
+        sector[0x001] == 0xFF &&
+        sector[0x002] == 0xFF &&
+        sector[0x003] == 0xFF &&
+        sector[0x004] == 0xFF &&
+        sector[0x005] == 0xFF &&
+        sector[0x006] == 0xFF &&
+        sector[0x007] == 0xFF &&
+        sector[0x008] == 0xFF &&
+        sector[0x009] == 0xFF &&
+        sector[0x00A] == 0xFF &&
+        sector[0x00B] == 0x00;
+}
+
+//
+// 2352 mode 1: predict sync, mode, reserved, edc, ecc
+//
+static int8_t detect_mode1(const uint8_t* sector, size_t size_available) {
+    return
+        size_available >= 2352 &&
+        has_sync(sector) &&
+        sector[0x00F] == 0x01 && // mode (1 byte)
+        sector[0x814] == 0x00 && // reserved (8 bytes)
+        sector[0x815] == 0x00 &&
+        sector[0x816] == 0x00 &&
+        sector[0x817] == 0x00 &&
+        sector[0x818] == 0x00 &&
+        sector[0x819] == 0x00 &&
+        sector[0x81A] == 0x00 &&
+        sector[0x81B] == 0x00 &&
+        ecc_checksector(
+            sector + 0xC,
+            sector + 0x10,
+            sector + 0x81C
+        ) &&
+        edc_sector(sector, 0x810) == get32lsb(sector + 0x810);
+}
+
+//
+// 2336 mode 2 bodies: the 4 flag bytes must match their redundant copy
+//
+static int8_t has_mode2_flags(const uint8_t* sector, size_t size_available) {
+    return
+        size_available >= 2336 &&
+        sector[0] == sector[4] &&
+        sector[1] == sector[5] &&
+        sector[2] == sector[6] &&
+        sector[3] == sector[7];
+}
+
+//
+// 2336 mode 2 form 1: predict redundant flags, edc, ecc
+//
+static int8_t detect_mode2_form1(const uint8_t* sector, size_t size_available) {
+    return
+        has_mode2_flags(sector, size_available) &&
+        ecc_checksector(
+            zeroaddress,
+            sector,
+            sector + 0x80C
+        ) &&
+        edc_sector(sector, 0x808) == get32lsb(sector + 0x808);
+}
+
+//
+// 2336 mode 2 form 2: predict redundant flags, edc
+//
+static int8_t detect_mode2_form2(const uint8_t* sector, size_t size_available) {
+    return
+        has_mode2_flags(sector, size_available) &&
+        edc_sector(sector, 0x91C) == get32lsb(sector + 0x91C);
+}
+
+//
+// 2336 mode 2 form 2 with the EDC left out (zero), as allowed for form 2:
+// predict redundant flags, zero edc
+//
+static int8_t detect_mode2_form2_noedc(const uint8_t* sector, size_t size_available) {
+    return
+        has_mode2_flags(sector, size_available) &&
+        (sector[2] & 0x20) && // form 2
+        get32lsb(sector + 0x91C) == 0;
+}
+
+//
+// 2352 mode 0: predict sync, mode, zero data; the address is predicted too,
+// so it must be valid
+//
+static int8_t detect_mode0(const uint8_t* sector, size_t size_available) {
+    size_t i;
+    if(
+        size_available < 2352 ||
+        !has_sync(sector) ||
+        sector[0x00F] != 0x00 ||
+        msf_to_frames(sector + 0x00C) < 0
+    ) {
+        return 0;
+    }
+    for(i = 0x010; i < 2352; i++) {
+        if(sector[i]) { return 0; }
+    }
+    return 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Reconstruct a sector based on type
+//
+static void reconstruct_sector(
+    uint8_t* sector, // must point to a full 2352-byte sector
+    int8_t type
+) {
+    //
+    // Sync
+    //
+    sector[0x000] = 0x00;
+    sector[0x001] = 0xFF;
+    sector[0x002] = 0xFF;
+    sector[0x003] = 0xFF;
+    sector[0x004] = 0xFF;
+    sector[0x005] = 0xFF;
+    sector[0x006] = 0xFF;
+    sector[0x007] = 0xFF;
     sector[0x008] = 0xFF;
     sector[0x009] = 0xFF;
     sector[0x00A] = 0xFF;
@@ -359,8 +1244,16 @@ static void reconstruct_sector(
         sector[0x81A] = 0x00;
         sector[0x81B] = 0x00;
         break;
+    case TYPE_MODE0:
+        //
+        // Mode, and nothing but zeros
+        //
+        sector[0x00F] = 0x00;
+        memset(sector + 0x010, 0, 2352 - 0x010);
+        break;
     case 2:
     case 3:
+    case TYPE_MODE2_FORM2_NOEDC:
         //
         // Mode
         //
@@ -379,9 +1272,10 @@ static void reconstruct_sector(
     // Compute EDC
     //
     switch(type) {
-    case 1: put32lsb(sector+0x810, edc_compute(0, sector     , 0x810)); break;
-    case 2: put32lsb(sector+0x818, edc_compute(0, sector+0x10, 0x808)); break;
-    case 3: put32lsb(sector+0x92C, edc_compute(0, sector+0x10, 0x91C)); break;
+    case 1: put32lsb(sector+0x810, edc_sector(sector     , 0x810)); break;
+    case 2: put32lsb(sector+0x818, edc_sector(sector+0x10, 0x808)); break;
+    case 3: put32lsb(sector+0x92C, edc_sector(sector+0x10, 0x91C)); break;
+    case TYPE_MODE2_FORM2_NOEDC: put32lsb(sector+0x92C, 0); break;
     }
 
     //
@@ -399,438 +1293,8972 @@ static void reconstruct_sector(
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Encode a type/count combo
+// The record types
 //
-// Returns nonzero on error
+// Units are handled in a 2352-byte sector buffer, with the unit at its end.
+// A record stores the parts listed in "stored" of each unit; the rest is
+// rebuilt by reconstruct_sector.  Types with no detector are found some other
+// way: TYPE_MODE1_SEQ is a run of mode 1 sectors, TYPE_RAW_MODE2 is checked
+// for by detect_raw_mode2 (its units store the parts of their body's type),
+// TYPE_COOKED is used for whole images that look like ISO 9660 files, the
+// patched types are tried by detect_patched when nothing else fits, and the
+// fill, repeat, stored and base types replace sectors of the other types
+// whose bulk (see bulk_type) is one byte repeated, was seen before, is in the
+// shared store, or is in the base image.
 //
-static int8_t write_type_count(
-    const char* outfilename,
-    FILE *out,
-    int8_t type,
-    uint32_t count
-) {
-    int8_t returncode = 0;
+typedef struct {
+    const char* name;        // as shown by --info
+    size_t      size;        // decoded size of one unit
+    size_t      payload;     // stored size of one unit (TYPE_RAW_MODE2 and
+                             // patched types: at least)
+    int8_t      version;     // first file format version with the type
+    int8_t      addressed;   // each record stores its first sector's address,
+                             // and the others count up from it
+    int8_t      rebuild;     // type to reconstruct_sector, or 0 for none
+    size_t      stored[2][2]; // offset and size of the stored parts
+    int8_t    (*detect)(const uint8_t* unit, size_t size_available);
+} sector_type;
 
-    count--;
-    if(fputc(((count >= 32) << 7) | ((count & 31) << 2) | type, out) == EOF) {
-        goto error_out;
+static const sector_type sector_types[TYPE_COUNT] = {
+    { "literal",            1,     1, 1, 0, 0,
+        { { 0, 0 }, { 0, 0 } }, NULL },
+    { "mode1",           2352, 0x803, 1, 0, 1,
+        { { 0x00C, 0x003 }, { 0x010, 0x800 } }, detect_mode1 },
+    { "mode2form1",      2336, 0x804, 1, 0, 2,
+        { { 0x014, 0x804 }, { 0, 0 } }, detect_mode2_form1 },
+    { "mode2form2",      2336, 0x918, 1, 0, 3,
+        { { 0x014, 0x918 }, { 0, 0 } }, detect_mode2_form2 },
+    { "mode1seq",        2352, 0x800, 2, 1, 1,
+        { { 0x010, 0x800 }, { 0, 0 } }, NULL },
+    { "mode2raw",        2352, 0x804, 2, 1, 0,
+        { { 0, 0 }, { 0, 0 } }, NULL },
+    { "mode0",           2352,     0, 2, 1, TYPE_MODE0,
+        { { 0, 0 }, { 0, 0 } }, detect_mode0 },
+    { "mode2form2noedc", 2336, 0x918, 2, 0, TYPE_MODE2_FORM2_NOEDC,
+        { { 0x014, 0x918 }, { 0, 0 } }, detect_mode2_form2_noedc },
+    { "cooked",          2048, 0x800, 2, 0, 0,
+        { { 0x130, 0x800 }, { 0, 0 } }, NULL },
+    { "patched",         2352, 0x806, 2, 0, 0,
+        { { 0, 0 }, { 0, 0 } }, NULL },
+    { "mode2patched",    2336, 0x807, 2, 0, 0,
+        { { 0, 0 }, { 0, 0 } }, NULL },
+    { "fill",            2352,     0, 2, 1, 0,
+        { { 0, 0 }, { 0, 0 } }, NULL },
+    { "mode2fill",       2336,     0, 2, 0, 0,
+        { { 0, 0 }, { 0, 0 } }, NULL },
+    { "cookedfill",      2048,     0, 2, 0, 0,
+        { { 0, 0 }, { 0, 0 } }, NULL },
+    { "repeat",          2352,     9, 2, 1, 0,
+        { { 0, 0 }, { 0, 0 } }, NULL },
+    { "mode2repeat",     2336,     9, 2, 0, 0,
+        { { 0, 0 }, { 0, 0 } }, NULL },
+    { "cookedrepeat",    2048,     9, 2, 0, 0,
+        { { 0, 0 }, { 0, 0 } }, NULL },
+    { "stored",          2352,     9, 2, 1, 0,
+        { { 0, 0 }, { 0, 0 } }, NULL },
+    { "mode2stored",     2336,     9, 2, 0, 0,
+        { { 0, 0 }, { 0, 0 } }, NULL },
+    { "cookedstored",    2048,     9, 2, 0, 0,
+        { { 0, 0 }, { 0, 0 } }, NULL },
+    { "base",            2352,     9, 2, 1, 0,
+        { { 0, 0 }, { 0, 0 } }, NULL },
+    { "mode2base",       2336,     9, 2, 0, 0,
+        { { 0, 0 }, { 0, 0 } }, NULL },
+    { "cookedbase",      2048,     9, 2, 0, 0,
+        { { 0, 0 }, { 0, 0 } }, NULL }
+};
+
+#ifndef ECM_NO_MAIN
+
+//
+// Quick check for what every sector starts with: a sync pattern, or for a
+// 2336-byte mode 2 body, flags that match their redundant copy
+//
+// Returns 0 if no type of sector can start here
+//
+static int8_t may_be_sector(const uint8_t* sector, size_t size_available) {
+    if(
+        size_available >= 2352 &&
+        sector[0x000] == 0x00 &&
+        sector[0x001] == 0xFF &&
+        sector[0x002] == 0xFF &&
+        sector[0x003] == 0xFF &&
+        sector[0x004] == 0xFF &&
+        sector[0x005] == 0xFF &&
+        sector[0x006] == 0xFF &&
+        sector[0x007] == 0xFF &&
+        sector[0x008] == 0xFF &&
+        sector[0x009] == 0xFF &&
+        sector[0x00A] == 0xFF &&
+        sector[0x00B] == 0x00
+    ) {
+        return 1;
     }
-    count >>= 5;
-    while(count) {
-        if(fputc(((count >= 128) << 7) | (count & 127), out) == EOF) {
-            goto error_out;
+    return
+        size_available >= 2336 &&
+        sector[0] == sector[4] &&
+        sector[1] == sector[5] &&
+        sector[2] == sector[6] &&
+        sector[3] == sector[7];
+}
+
+//
+// Check if this is a sector we can compress
+//
+// Returns the first type that a file of the given version can hold whose
+// detector accepts it, or 0 (literal)
+//
+static int8_t detect_sector(const uint8_t* sector, size_t size_available, int8_t version) {
+    int8_t type;
+    if(!may_be_sector(sector, size_available)) { return 0; }
+    for(type = 1; type < TYPE_COUNT; type++) {
+        const sector_type* t = sector_types + type;
+        if(t->detect && t->version <= version && t->detect(sector, size_available)) {
+            break;
         }
-        count >>= 7;
     }
-    //
-    // Success
-    //
-    returncode = 0;
-    goto done;
+    return type < TYPE_COUNT ? type : 0;
+}
 
-error_out:
-    printfileerror(out, outfilename);
-    goto error;
+#endif
 
-error:
-    returncode = 1;
-    goto done;
+////////////////////////////////////////////////////////////////////////////////
+//
+// Patched sectors
+//
+// A sector that fails detection only because a few bytes are off (a bad EDC
+// or ECC, from a damaged disc or on purpose for copy protection) is stored as
+// the sector it's closest to, plus the spans of bytes that differ from the
+// rebuilt one.  Each unit holds:
+//
+//   u8 base type, an index into patch_base_types
+//   TYPE_PATCHED only: 3-byte address
+//   the stored parts of the base type
+//   u16 number of spans, then for each: u16 offset in the unit, u16 length,
+//   and that many bytes of the original
+//
+#define PATCH_BASE_TYPES     3
+#define PATCH_MAX_SPAN_BYTES 0x200 // spans, headers included, beyond which it's literal
+#define PATCH_GAP            4     // matching bytes a span takes in rather than end
+#define PATCH_MAX_PAYLOAD    (1 + 3 + 0x918 + 2 + PATCH_MAX_SPAN_BYTES)
 
-done:
-    return returncode;
+//
+// Mode 1 is only a base for TYPE_PATCHED, and its address is stored
+// separately, so it uses the parts of TYPE_MODE1_SEQ
+//
+static const int8_t patch_base_types[PATCH_BASE_TYPES] = { TYPE_MODE1_SEQ, 2, 3 };
+
+static int8_t is_patched(int8_t type) {
+    return type == TYPE_PATCHED || type == TYPE_MODE2_PATCHED;
 }
 
-////////////////////////////////////////////////////////////////////////////////
+#ifndef ECM_NO_MAIN
 
-static uint8_t sector_buffer[2352];
+//
+// Encode a unit of a patched type into out, which must hold
+// PATCH_MAX_PAYLOAD bytes
+//
+// Returns the size of the payload, or 0 if the unit has no base type or the
+// spans would be too big
+//
+static size_t patch_encode(int8_t type, const uint8_t* unit, uint8_t* out) {
+    uint8_t sector[2352];
+    size_t size = sector_types[type].size;
+    const uint8_t* predicted = sector + 2352 - size;
+    const uint8_t* body = unit; // the 2336 bytes after the header
+    const sector_type* base;
+    uint8_t* p = out;
+    uint8_t* spans_at;
+    uint16_t spans = 0;
+    size_t i;
+    unsigned k;
 
-////////////////////////////////////////////////////////////////////////////////
+    if(type == TYPE_PATCHED) {
+        if(!has_sync(unit) || msf_to_frames(unit + 0x00C) < 0) { return 0; }
+        if(unit[0x00F] == 0x01) {
+            *p++ = 0;
+        } else if(unit[0x00F] == 0x02) {
+            body = unit + 0x010;
+        } else {
+            return 0;
+        }
+    }
+    if(p == out) {
+        //
+        // Mode 2: the form comes from the submode copy that's stored
+        //
+        *p++ = (body[6] & 0x20) ? 2 : 1;
+    }
+    base = sector_types + patch_base_types[out[0]];
 
-static off_t mycounter_analyze = (off_t)-1;
-static off_t mycounter_encode  = (off_t)-1;
-static off_t mycounter_decode  = (off_t)-1;
-static off_t mycounter_total   = 0;
+    memcpy(sector + 2352 - size, unit, size);
+    if(type == TYPE_PATCHED) {
+        memcpy(p, unit + 0x00C, 3);
+        p += 3;
+    }
+    for(k = 0; k < 2; k++) {
+        memcpy(p, sector + base->stored[k][0], base->stored[k][1]);
+        p += base->stored[k][1];
+    }
+    reconstruct_sector(sector, base->rebuild);
 
-static void resetcounter(off_t total) {
-    mycounter_analyze = (off_t)-1;
-    mycounter_encode  = (off_t)-1;
-    mycounter_decode  = (off_t)-1;
-    mycounter_total   = total;
+    spans_at = p;
+    p += 2;
+    for(i = 0; i < size; ) {
+        size_t start, end;
+        if(unit[i] == predicted[i]) { i++; continue; }
+        start = i;
+        end = i + 1;
+        for(i = end; i < size && i < end + PATCH_GAP; i++) {
+            if(unit[i] != predicted[i]) { end = i + 1; }
+        }
+        if((size_t)(p - spans_at) + 4 + (end - start) > 2 + PATCH_MAX_SPAN_BYTES) { return 0; }
+        put16lsb(p    , (uint16_t)start);
+        put16lsb(p + 2, (uint16_t)(end - start));
+        memcpy(p + 4, unit + start, end - start);
+        p += 4 + (end - start);
+        spans++;
+        i = end;
+    }
+    put16lsb(spans_at, spans);
+    return (size_t)(p - out);
 }
 
-static void encode_progress(void) {
-    off_t a = (mycounter_analyze + 64) / 128;
-    off_t e = (mycounter_encode  + 64) / 128;
-    off_t t = (mycounter_total   + 64) / 128;
-    if(!t) { t = 1; }
-    fprintf(stderr,
-        "Analyze(%02u%%) Encode(%02u%%)\r",
-        (unsigned)((((off_t)100) * a) / t),
-        (unsigned)((((off_t)100) * e) / t)
-    );
+#endif
+
+//
+// Rebuild a unit of a patched type from its payload, of which available
+// bytes are at hand; sector is a 2352-byte buffer with the unit at its end,
+// or NULL to only find the payload's size
+//
+// Returns 0 with *used set to the size of the payload, 1 if it runs past the
+// available bytes, or 2 if it's invalid
+//
+static int8_t patch_decode(int8_t type, const uint8_t* payload, size_t available, uint8_t* sector, size_t* used) {
+    size_t size = sector_types[type].size;
+    const sector_type* base;
+    size_t pos = 1;
+    unsigned spans;
+    unsigned k;
+
+    if(available < 1) { return 1; }
+    if(payload[0] >= PATCH_BASE_TYPES || (type != TYPE_PATCHED && payload[0] == 0)) { return 2; }
+    base = sector_types + patch_base_types[payload[0]];
+    if(type == TYPE_PATCHED) {
+        if(available - pos < 3) { return 1; }
+        if(sector) { memcpy(sector + 0x00C, payload + pos, 3); }
+        pos += 3;
+    }
+    for(k = 0; k < 2; k++) {
+        size_t n = base->stored[k][1];
+        if(available - pos < n) { return 1; }
+        if(sector) { memcpy(sector + base->stored[k][0], payload + pos, n); }
+        pos += n;
+    }
+    if(sector) { reconstruct_sector(sector, base->rebuild); }
+
+    if(available - pos < 2) { return 1; }
+    spans = get16lsb(payload + pos);
+    pos += 2;
+    while(spans--) {
+        size_t offset;
+        size_t length;
+        if(available - pos < 4) { return 1; }
+        offset = get16lsb(payload + pos);
+        length = get16lsb(payload + pos + 2);
+        pos += 4;
+        if(offset > size || length > size - offset) { return 2; }
+        if(available - pos < length) { return 1; }
+        if(sector) { memcpy(sector + 2352 - size + offset, payload + pos, length); }
+        pos += length;
+    }
+    *used = pos;
+    return 0;
 }
 
-static void decode_progress(void) {
-    off_t d = (mycounter_decode  + 64) / 128;
-    off_t t = (mycounter_total   + 64) / 128;
-    if(!t) { t = 1; }
-    fprintf(stderr,
-        "Decode(%02u%%)\r",
-        (unsigned)((((off_t)100) * d) / t)
-    );
+#ifndef ECM_NO_MAIN
+
+//
+// Check whether a sector that failed detection can be stored patched; prev
+// is the type before it, since 2336-byte sectors have no sync to go by and
+// are only tried right after others
+//
+// Returns TYPE_PATCHED, TYPE_MODE2_PATCHED, or 0
+//
+static int8_t detect_patched(const uint8_t* sector, size_t size_available, int8_t prev) {
+    uint8_t payload[PATCH_MAX_PAYLOAD];
+    int8_t type = 0;
+    if(size_available >= 2352 && has_sync(sector)) {
+        type = TYPE_PATCHED;
+    } else if(sector_types[prev].size == 2336 && has_mode2_flags(sector, size_available)) {
+        type = TYPE_MODE2_PATCHED;
+    }
+    if(type && !patch_encode(type, sector, payload)) { type = 0; }
+    return type;
 }
 
-static void setcounter_analyze(off_t n) {
-    int8_t p = ((n >> 20) != (mycounter_analyze >> 20));
-    mycounter_analyze = n;
-    if(p) { encode_progress(); }
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Fill and repeat records
+//
+// The bulk of a sector is everything it stores but its address: the one
+// stored part of its bulk type (see bulk_type).  A fill record is a run of
+// sectors whose bulk, past the subheader for mode 2, is one byte repeated;
+// after the address (for 2352-byte units) it holds a header:
+//
+//   u8 bulk type, u8 fill byte, 4-byte subheader (mode 2; otherwise zero)
+//
+// and nothing per sector.  A repeat record is a run of sectors each of whose
+// bulk was already written to the file; after the address, per sector:
+//
+//   u8 bulk type, u64 file offset of the earlier copy of the bulk
+//
+// A stored record is laid out the same way, with the content ID of the bulk
+// in the shared store (see store_put) in place of the file offset, and so is
+// a base record, with the offset of the bulk in the base image's ECM file.
+//
+#define FILL_HEADER_SIZE 6
+#define REPEAT_UNIT_SIZE 9
+
+static int8_t is_fill(int8_t type) {
+    return type >= TYPE_FILL && type <= TYPE_COOKED_FILL;
 }
 
-static void setcounter_encode(off_t n) {
-    int8_t p = ((n >> 20) != (mycounter_encode >> 20));
-    mycounter_encode = n;
-    if(p) { encode_progress(); }
+static int8_t is_repeat(int8_t type) {
+    return type >= TYPE_REPEAT && type <= TYPE_COOKED_REPEAT;
 }
 
-static void setcounter_decode(off_t n) {
-    int8_t p = ((n >> 20) != (mycounter_decode >> 20));
-    mycounter_decode = n;
-    if(p) { decode_progress(); }
+static int8_t is_stored(int8_t type) {
+    return type >= TYPE_STORED && type <= TYPE_COOKED_STORED;
+}
+
+static int8_t is_based(int8_t type) {
+    return type >= TYPE_BASE && type <= TYPE_COOKED_BASE;
 }
 
-////////////////////////////////////////////////////////////////////////////////
 //
-// Encode a run of sectors/literals of the same type
+// Whether units of the type are a bulk type and a reference to the bulk
 //
-// Returns nonzero on error
+static int8_t is_reference(int8_t type) {
+    return is_repeat(type) || is_stored(type) || is_based(type);
+}
+
+#ifndef ECM_NO_MAIN
+
 //
-static int8_t write_sectors(
-    int8_t type,
-    uint32_t count,
-    const char* infilename,
-    const char* outfilename,
-    FILE* in,
-    FILE* out
-) {
-    int8_t returncode = 0;
+// The fill, repeat, stored or base type (first is TYPE_FILL, TYPE_REPEAT,
+// TYPE_STORED or TYPE_BASE) for units of the given size
+//
+static int8_t sized_type(int8_t first, size_t size) {
+    return (int8_t)(first + (size == 2352 ? 0 : size == 2336 ? 1 : 2));
+}
 
-    if(write_type_count(outfilename, out, type, count)) { goto error; }
+#endif
 
-    if(type == 0) {
-        while(count) {
-            uint32_t b = count;
-            if(b > sizeof(sector_buffer)) { b = sizeof(sector_buffer); }
-            if(fread(sector_buffer, 1, b, in) != b) { goto error_in; }
-            if(fwrite(sector_buffer, 1, b, out) != b) { goto error_out; }
-            count -= b;
-            setcounter_encode(ftello(in));
-        }
-        return 0;
-    }
-    for(; count; count--) {
-        switch(type) {
-        case 1:
-            if(fread(sector_buffer, 1, 2352, in) != 2352) { goto error_in; }
-            if(fwrite(sector_buffer + 0x00C, 1, 0x003, out) != 0x003) { goto error_out; }
-            if(fwrite(sector_buffer + 0x010, 1, 0x800, out) != 0x800) { goto error_out; }
-            break;
-        case 2:
-            if(fread(sector_buffer, 1, 2336, in) != 2336) { goto error_in; }
-            if(fwrite(sector_buffer + 0x004, 1, 0x804, out) != 0x804) { goto error_out; }
-            break;
-        case 3:
-            if(fread(sector_buffer, 1, 2336, in) != 2336) { goto error_in; }
-            if(fwrite(sector_buffer + 0x004, 1, 0x918, out) != 0x918) { goto error_out; }
-            break;
-        }
-        setcounter_encode(ftello(in));
+static int8_t is_mode2_bulk(int8_t bulk) {
+    return bulk == 2 || bulk == 3 || bulk == TYPE_MODE2_FORM2_NOEDC;
+}
+
+static int8_t is_bulk(int bulk) {
+    return bulk == TYPE_MODE1_SEQ || bulk == TYPE_COOKED || is_mode2_bulk((int8_t)bulk);
+}
+
+//
+// Bulk type of a sector of the given type (the form code plus 1 for
+// TYPE_RAW_MODE2, as from detect_raw_mode2)
+//
+// Returns 0 if it has none
+//
+static int8_t bulk_type(int8_t type, int8_t rawform) {
+    switch(type) {
+    case 1:
+    case TYPE_MODE1_SEQ:
+        return TYPE_MODE1_SEQ;
+    case TYPE_RAW_MODE2:
+        return rawform > 0 ? raw_form_types[rawform - 1] : 0;
+    case 2:
+    case 3:
+    case TYPE_MODE2_FORM2_NOEDC:
+    case TYPE_COOKED:
+        return type;
     }
-    //
-    // Success
-    //
-    returncode = 0;
-    goto done;
+    return 0;
+}
 
-error_in:
-    printfileerror(in, infilename);
-    goto error;
+//
+// Whether a unit of a fill, repeat or stored type can have the given bulk type
+//
+static int8_t bulk_fits(int8_t type, int bulk) {
+    if(!is_bulk(bulk)) { return 0; }
+    if(sector_types[type].size == 2352) { return bulk != TYPE_COOKED; }
+    return sector_types[bulk].size == sector_types[type].size;
+}
 
-error_out:
-    printfileerror(out, outfilename);
-    goto error;
+#ifndef ECM_NO_MAIN
 
-error:
-    returncode = 1;
-    goto done;
+static const uint8_t* bulk_of(int8_t bulk, const uint8_t* unit, size_t size) {
+    return unit + sector_types[bulk].stored[0][0] - (2352 - size);
+}
 
-done:
-    return returncode;
+//
+// Check whether the bulk of a unit is one byte repeated, and fill in its fill
+// header
+//
+// Returns nonzero if so
+//
+static int8_t detect_fill(int8_t bulk, const uint8_t* unit, size_t size, uint8_t* header) {
+    const uint8_t* p = bulk_of(bulk, unit, size);
+    size_t n = sector_types[bulk].stored[0][1];
+    size_t i;
+    memset(header, 0, FILL_HEADER_SIZE);
+    header[0] = (uint8_t)bulk;
+    if(is_mode2_bulk(bulk)) {
+        memcpy(header + 2, p, 4);
+        p += 4;
+        n -= 4;
+    }
+    header[1] = p[0];
+    for(i = 1; i < n; i++) {
+        if(p[i] != p[0]) { return 0; }
+    }
+    return 1;
 }
 
-////////////////////////////////////////////////////////////////////////////////
+#endif
+
 //
-// Returns nonzero on error
+// Rebuild a sector of a fill record; for 2352-byte units, sector already
+// holds the address
 //
-static int8_t ecmify(
-    const char* infilename,
-    const char* outfilename
-) {
-    int8_t returncode = 0;
+static void fill_sector(const uint8_t* header, uint8_t* sector) {
+    const sector_type* b = sector_types + header[0];
+    size_t offset = b->stored[0][0];
+    size_t n = b->stored[0][1];
+    if(is_mode2_bulk(header[0])) {
+        memcpy(sector + offset, header + 2, 4);
+        offset += 4;
+        n -= 4;
+    }
+    memset(sector + offset, header[1], n);
+    if(b->rebuild) { reconstruct_sector(sector, b->rebuild); }
+}
 
-    FILE* in  = NULL;
-    FILE* out = NULL;
+#ifndef ECM_NO_MAIN
 
-    uint8_t* queue = NULL;
-    size_t queue_start_ofs = 0;
-    size_t queue_bytes_available = 0;
+//
+// Check for the sync and header of a whole 2352-byte mode 2 sector: mode 2,
+// and a valid address
+//
+static int8_t has_raw_mode2_header(const uint8_t* sector, size_t size_available) {
+    return
+        size_available >= 2352 &&
+        has_sync(sector) &&
+        sector[0x00F] == 0x02 &&
+        msf_to_frames(sector + 0x00C) >= 0;
+}
 
-    uint32_t input_edc = 0;
+//
+// Form code plus 1 of a whole mode 2 sector whose 2336-byte body is of the
+// given type, or 0 if it can't be stored as TYPE_RAW_MODE2
+//
+static int8_t raw_form_of(int8_t type) {
+    int8_t code;
+    for(code = 0; code < RAW_FORM_CODES; code++) {
+        if(raw_form_types[code] == type) { return code + 1; }
+    }
+    return 0;
+}
 
-    //
-    // Current sector type (run)
-    //
-    int8_t   curtype = -1; // not a valid type
-    uint32_t curtype_count = 0;
-    off_t    curtype_in_start = 0;
+//
+// Check for a whole 2352-byte mode 2 sector, with sync and a valid address
+//
+// Returns the form code of its 2336-byte body plus 1, or 0
+//
+static int8_t detect_raw_mode2(const uint8_t* sector, size_t size_available) {
+    if(!has_raw_mode2_header(sector, size_available)) { return 0; }
+    return raw_form_of(detect_sector(sector + 0x010, 2336, 2));
+}
 
-    uint32_t literal_skip = 0;
+////////////////////////////////////////////////////////////////////////////////
+//
+// Check a raw 2352-byte sector against whatever its header claims it is
+//
+// Unlike detect_sector, this reports sectors that fail their checks rather
+// than treating them as literal bytes.  The result packs the claimed type in
+// the low 3 bits, then the EDC status, then the ECC status.
+//
+#define CLAIM_NONE        0 // no sync; audio, or not a sector at all
+#define CLAIM_MODE0       1
+#define CLAIM_MODE1       2
+#define CLAIM_MODE2_FORM1 3
+#define CLAIM_MODE2_FORM2 4
+#define CLAIM_UNKNOWN     5 // sync present, but not a mode we know
 
-    off_t input_file_length;
-    off_t input_bytes_checked = 0;
-    off_t input_bytes_queued  = 0;
+#define CHECK_NA  0 // not present for this type
+#define CHECK_OK  1
+#define CHECK_BAD 2
+
+#define SCAN_RESULT(claim, edc, ecc) ((uint8_t)((claim) | ((edc) << 3) | ((ecc) << 5)))
+#define SCAN_CLAIM(r) ((r) & 7)
+#define SCAN_EDC(r)   (((r) >> 3) & 3)
+#define SCAN_ECC(r)   (((r) >> 5) & 3)
 
-    off_t typetally[4] = {0,0,0,0};
+static const char* const claim_names[6] = {
+    "none",
+    "mode0",
+    "mode1",
+    "mode2form1",
+    "mode2form2",
+    "unknown"
+};
 
-    static const size_t sectorsize[4] = {
-        1,
-        2352,
-        2336,
-        2336
+static const char* const check_names[3] = { "-", "ok", "bad" };
+
+static uint8_t scan_sector(const uint8_t* sector) {
+    static const uint8_t sync[12] = {
+        0x00, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x00
     };
+    uint32_t edc;
 
-    size_t queue_size = ((size_t)(-1)) - 4095;
-    if((unsigned long)queue_size > 0x40000lu) {
-        queue_size = (size_t)0x40000lu;
+    if(memcmp(sector, sync, sizeof(sync)) != 0) {
+        return SCAN_RESULT(CLAIM_NONE, CHECK_NA, CHECK_NA);
     }
-
-    //
-    // Allocate space for queue
-    //
-    queue = malloc(queue_size);
-    if(!queue) {
-        printf("Out of memory\n");
-        goto error;
+    switch(sector[0x00F]) {
+    case 0:
+        return SCAN_RESULT(CLAIM_MODE0, CHECK_NA, CHECK_NA);
+    case 1:
+        return SCAN_RESULT(
+            CLAIM_MODE1,
+            edc_sector(sector, 0x810) == get32lsb(sector + 0x810) ? CHECK_OK : CHECK_BAD,
+            ecc_checksector(sector + 0xC, sector + 0x10, sector + 0x81C) ? CHECK_OK : CHECK_BAD
+        );
+    case 2:
+        if(!(sector[0x012] & 0x20)) {
+            return SCAN_RESULT(
+                CLAIM_MODE2_FORM1,
+                edc_sector(sector + 0x10, 0x808) == get32lsb(sector + 0x818) ? CHECK_OK : CHECK_BAD,
+                ecc_checksector(zeroaddress, sector + 0x10, sector + 0x81C) ? CHECK_OK : CHECK_BAD
+            );
+        }
+        //
+        // The form 2 EDC is optional; zero means it wasn't computed
+        //
+        edc = get32lsb(sector + 0x92C);
+        return SCAN_RESULT(
+            CLAIM_MODE2_FORM2,
+            edc == 0 ? CHECK_NA : edc_sector(sector + 0x10, 0x91C) == edc ? CHECK_OK : CHECK_BAD,
+            CHECK_NA
+        );
     }
+    return SCAN_RESULT(CLAIM_UNKNOWN, CHECK_NA, CHECK_NA);
+}
 
-    //
-    // Ensure the output file doesn't already exist
-    //
-    out = fopen(outfilename, "rb");
-    if(out) {
-        printf("Error: %s exists; refusing to overwrite\n", outfilename);
-        goto error;
-    }
+#endif
 
-    //
-    // Open both files
-    //
-    in = fopen(infilename, "rb");
-    if(!in) { goto error_in; }
+////////////////////////////////////////////////////////////////////////////////
+//
+// ECM file layout
+//
+// Version 1 (magic "ECM" 0x00) is one stream of records, followed by an
+// end-of-records indicator and the EDC of the entire decoded output.
+//
+// Version 2 (magic "ECM" 0x02) groups the records into blocks of at most
+// ECM_BLOCK_SIZE decoded bytes, each of which can be checked and decoded on
+// its own:
+//
+//   "ECM" 0x02
+//   block...
+//     u32 size of the records in this block
+//     u32 size of the decoded data
+//     u32 EDC of the records
+//     u32 EDC of the decoded data
+//     records (encoded as in version 1, without the end-of-records indicator)
+//   section...
+//   directory
+//     u32 number of sections
+//     for each: 4-byte tag, u64 file offset, u64 size
+//   trailer
+//     u64 file offset of the directory
+//     u64 size of the decoded output
+//     u32 EDC of the decoded output
+//     "ECM" 0x02
+//
+// All integers are little-endian.  Sections:
+//
+//   "INDX": for each block, u64 file offset of its header and u64 offset of
+//           its data in the decoded output
+//   "META": facts about the image, so they can be had without decoding; a
+//           series of fields, each a 4-byte tag, a u32 size and that many
+//           bytes.  Readers skip fields they don't know.
+//           "SIZE": u64 size of the decoded output
+//           "RUNS": u64 number of records
+//           "TYPE": u64 per record type, in type order (extended types
+//                   after the original four): bytes for literals, sectors
+//                   for the rest
+//   "SUBC": subchannel data of a 2448-byte sector image, whose first 2352
+//           bytes per sector make up the decoded output
+//           u32 layout (SUBCHANNEL_INTERLEAVED or SUBCHANNEL_PACKED)
+//           u64 number of sectors
+//           u32 EDC of the subchannel data
+//           runs, each a u32 count, with the top bit set if the sectors are
+//           stored: 96 bytes each.  Other runs are predicted from the last
+//           stored sector (see subchannel_predict).
+//   "BASE": the base image that base records refer to, in files that have
+//           any: u64 size of its ECM file, u64 size of the image and u32 EDC
+//           of the image, as stored in that file
+//   "CUES": a cue sheet whose files, one after another, are the decoded
+//           output (bin2ecm foo.cue): the text of the sheet as read
+//   "TRKS": with "CUES", its files: u32 number of files, then for each, u64
+//           size, u32 length of its name and the name, as the sheet has it
+//
+// Records of the extended types hold, after the type and count:
+//
+//   TYPE_MODE1_SEQ: 3-byte address of the first sector, then 0x800 bytes of
+//                   data per sector
+//   TYPE_RAW_MODE2: 3-byte address of the first sector, a 2-bit code per
+//                   sector (low bits first: 0 form 1, 1 form 2, 2 form 2
+//                   with a zero EDC), then per sector the 4-byte subheader
+//                   and 0x800 (form 1) or 0x914 (form 2) bytes of data
+//   TYPE_MODE0:     3-byte address of the first sector; the sectors are
+//                   otherwise all zero
+//   TYPE_MODE2_FORM2_NOEDC: as mode 2 form 2, for sectors whose EDC field is
+//                   zero
+//   TYPE_COOKED:    0x800 bytes per 2048-byte sector of an image without
+//                   headers, stored as-is
+//   TYPE_PATCHED, TYPE_MODE2_PATCHED: one sector per record, stored as
+//                   described above patch_encode
+//   Fill types:     3-byte address of the first sector (TYPE_FILL only),
+//                   then a header giving the bulk type, the fill byte and
+//                   the mode 2 subheader; nothing per sector
+//   Repeat types:   3-byte address of the first sector (TYPE_REPEAT only),
+//                   then per sector the bulk type and the u64 file offset
+//                   of an earlier copy of its bulk
+//   Stored types:   as repeat types, with the content ID of the bulk in the
+//                   shared store instead of a file offset
+//   Base types:     as repeat types, with the offset of the bulk in the base
+//                   image's ECM file instead
+//
+// These are described above FILL_HEADER_SIZE.
+//
+#define ECM_BLOCK_SIZE         0x200000
+#define ECM_BLOCK_HEADER_SIZE  16
+#define ECM_TRAILER_SIZE       24
+#define ECM_DIRECTORY_ENTRY_SIZE 20
+#define ECM_INDEX_ENTRY_SIZE   16
+#define ECM_FIELD_HEADER_SIZE  8
+#define ECM_SUBC_HEADER_SIZE   16
+#define ECM_BASE_SIZE          20
 
-    out = fopen(outfilename, "wb");
-    if(!out) { goto error_out; }
+static const uint8_t ecm_magic_v2[4] = { 'E', 'C', 'M', 0x02 };
 
-    printf("Encoding %s to %s...\n", infilename, outfilename);
+#ifndef ECM_NO_MAIN
 
-    //
-    // Get the length of the input file
-    //
-    if(fseeko(in, 0, SEEK_END) != 0) { goto error_in; }
-    input_file_length = ftello(in);
-    if(input_file_length < 0) { goto error_in; }
+//
+// Format written by the encoder (--v1 selects the original)
+//
+static int8_t format_version = 2;
 
-    resetcounter(input_file_length);
+typedef struct {
+    FILE*       out;
+    const char* outfilename;
+    int8_t      version;
 
     //
-    // Magic identifier
+    // Version 2 only
     //
-    if(fputc('E' , out) == EOF) { goto error_out; }
-    if(fputc('C' , out) == EOF) { goto error_out; }
-    if(fputc('M' , out) == EOF) { goto error_out; }
-    if(fputc(0x00, out) == EOF) { goto error_out; }
+    uint8_t*    block;          // records of the block being built
+    size_t      block_used;
+    size_t      block_alloc;
+    uint32_t    block_decoded;  // decoded bytes in the block so far
+    uint32_t    block_edc;      // EDC of those bytes
+    uint32_t    block_records_edc; // EDC of the records so far
+    off_t       decoded_total;  // decoded bytes in earlier blocks
+    uint32_t    decoded_edc;    // EDC of those bytes
+    off_t       block_offset;   // file offset of the block's header
 
-    for(;;) {
-        int8_t detecttype;
+    uint8_t*    index;          // "INDX" section being built
+    size_t      index_used;
+    size_t      index_alloc;
 
-        //
-        // Refill queue if necessary
-        //
-        if(
-            (queue_bytes_available < 2352) &&
-            (((off_t)queue_bytes_available) < (input_file_length - input_bytes_queued))
-        ) {
-            //
-            // We need to read more data
-            //
-            off_t willread = input_file_length - input_bytes_queued;
-            off_t maxread = queue_size - queue_bytes_available;
-            if(willread > maxread) {
-                willread = maxread;
-            }
+    uint8_t*    directory;      // entries for the sections written so far
+    size_t      directory_used;
+    size_t      directory_alloc;
 
-            if(queue_start_ofs > 0) {
-                memmove(queue, queue + queue_start_ofs, queue_bytes_available);
-                queue_start_ofs = 0;
-            }
-            if(willread) {
-                setcounter_analyze(input_bytes_queued);
+    off_t       record_count;
+} ecm_writer;
 
-                if(fseeko(in, input_bytes_queued, SEEK_SET) != 0) {
-                    goto error_in;
-                }
-                if(fread(queue + queue_bytes_available, 1, willread, in) != (size_t)willread) {
-                    goto error_in;
-                }
+//
+// Grow a buffer to hold at least need bytes
+//
+// Returns nonzero on error
+//
+static int8_t grow_buffer(uint8_t** buffer, size_t* alloc, size_t need) {
+    size_t n = *alloc ? *alloc : 0x10000;
+    uint8_t* p;
+    if(need <= *alloc) { return 0; }
+    while(n < need) { n *= 2; }
+    p = realloc(*buffer, n);
+    if(!p) {
+        printf("Out of memory\n");
+        return 1;
+    }
+    *buffer = p;
+    *alloc = n;
+    return 0;
+}
 
-                input_edc = edc_compute(
-                    input_edc,
-                    queue + queue_bytes_available,
-                    willread
-                );
+//
+// Returns nonzero on error
+//
+static int8_t writer_open(ecm_writer* w, FILE* out, const char* outfilename, int8_t version) {
+    memset(w, 0, sizeof(*w));
+    w->out = out;
+    w->outfilename = outfilename;
+    w->version = version;
+    w->block_offset = 4;
+    if(fputc('E' , out) == EOF ||
+       fputc('C' , out) == EOF ||
+       fputc('M' , out) == EOF ||
+       fputc(version == 2 ? 0x02 : 0x00, out) == EOF
+    ) {
+        printfileerror(out, outfilename);
+        return 1;
+    }
+    return 0;
+}
 
-                input_bytes_queued    += willread;
-                queue_bytes_available += willread;
-            }
+static void writer_free(ecm_writer* w) {
+    if(w->block) { free(w->block); w->block = NULL; }
+    if(w->index) { free(w->index); w->index = NULL; }
+    if(w->directory) { free(w->directory); w->directory = NULL; }
+}
+
+//
+// Append encoded bytes
+//
+// Returns nonzero on error
+//
+static int8_t writer_put(ecm_writer* w, const uint8_t* data, size_t size) {
+    if(w->version != 2) {
+        if(fwrite(data, 1, size, w->out) != size) {
+            printfileerror(w->out, w->outfilename);
+            return 1;
         }
+        return 0;
+    }
+    if(grow_buffer(&w->block, &w->block_alloc, w->block_used + size)) { return 1; }
+    memcpy(w->block + w->block_used, data, size);
+    w->block_used += size;
+    w->block_records_edc = edc_compute(w->block_records_edc, data, size);
+    return 0;
+}
 
-        if(queue_bytes_available == 0) {
-            //
-            // No data left to read -> quit
-            //
+//
+// Append literal bytes, which decode to themselves: one pass over them
+// updates the EDCs of both the records and the decoded bytes
+//
+// Returns nonzero on error
+//
+static int8_t writer_literal(ecm_writer* w, const uint8_t* data, size_t size) {
+    uint32_t records_edc;
+    uint32_t decoded_edc;
+    const uint8_t* p;
+    if(w->version != 2) { return writer_put(w, data, size); }
+    if(grow_buffer(&w->block, &w->block_alloc, w->block_used + size)) { return 1; }
+    memcpy(w->block + w->block_used, data, size);
+    w->block_used += size;
+    w->block_decoded += size;
+    records_edc = w->block_records_edc;
+    decoded_edc = w->block_edc;
+    for(p = data; size; size--, p++) {
+        records_edc = (records_edc >> 8) ^ edc_lut[(records_edc ^ *p) & 0xFF];
+        decoded_edc = (decoded_edc >> 8) ^ edc_lut[(decoded_edc ^ *p) & 0xFF];
+    }
+    w->block_records_edc = records_edc;
+    w->block_edc = decoded_edc;
+    return 0;
+}
+
+//
+// File offset the next encoded byte will be written at (version 2)
+//
+static off_t writer_tell(const ecm_writer* w) {
+    return w->block_offset + ECM_BLOCK_HEADER_SIZE + (off_t)w->block_used;
+}
+
+//
+// Account for bytes the records written so far will decode to
+//
+static void writer_decoded(ecm_writer* w, const uint8_t* data, size_t size) {
+    if(w->version != 2) { return; }
+    w->block_edc = edc_compute(w->block_edc, data, size);
+    w->block_decoded += size;
+}
+
+//
+// Write out the current block, if it has anything in it
+//
+// Returns nonzero on error
+//
+static int8_t writer_end_block(ecm_writer* w) {
+    uint8_t header[ECM_BLOCK_HEADER_SIZE];
+    uint8_t entry[ECM_INDEX_ENTRY_SIZE];
+    int8_t failed;
+    if(w->version != 2 || w->block_used == 0) { return 0; }
+
+    put64lsb(entry, ftello(w->out));
+    put64lsb(entry + 8, w->decoded_total);
+    if(grow_buffer(&w->index, &w->index_alloc, w->index_used + sizeof(entry))) { return 1; }
+    memcpy(w->index + w->index_used, entry, sizeof(entry));
+    w->index_used += sizeof(entry);
+
+    put32lsb(header     , (uint32_t)w->block_used);
+    put32lsb(header +  4, w->block_decoded);
+    put32lsb(header +  8, w->block_records_edc);
+    put32lsb(header + 12, w->block_edc);
+    {   PERF_ENTER(PHASE_IO);
+        failed =
+            fwrite(header, 1, sizeof(header), w->out) != sizeof(header) ||
+            fwrite(w->block, 1, w->block_used, w->out) != w->block_used;
+        PERF_LEAVE();
+    }
+    if(failed) {
+        printfileerror(w->out, w->outfilename);
+        return 1;
+    }
+
+    w->decoded_edc = edc_combine(w->decoded_edc, w->block_edc, (off_t)w->block_decoded);
+    w->decoded_total += w->block_decoded;
+    w->block_offset += ECM_BLOCK_HEADER_SIZE + w->block_used;
+    w->block_used = 0;
+    w->block_decoded = 0;
+    w->block_edc = 0;
+    w->block_records_edc = 0;
+    return 0;
+}
+
+//
+// EDC of everything the records written so far decode to (version 2)
+//
+static uint32_t writer_decoded_edc(const ecm_writer* w) {
+    return edc_combine(w->decoded_edc, w->block_edc, (off_t)w->block_decoded);
+}
+
+//
+// How many units of the given decoded size can go in the current record
+// before it has to be split; starts a new block if the current one is full
+//
+// Returns nonzero on error
+//
+static int8_t writer_room(ecm_writer* w, size_t unit, uint32_t* room) {
+    size_t left;
+    if(w->version != 2) {
+        *room = 0xFFFFFFFF;
+        return 0;
+    }
+    left = ECM_BLOCK_SIZE - w->block_decoded;
+    if(left < unit) {
+        if(writer_end_block(w)) { return 1; }
+        left = ECM_BLOCK_SIZE;
+    }
+    *room = (uint32_t)(left / unit);
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Encode a type/count combo
+//
+// Types 0-3 take one byte: continuation bit, the low 5 bits of count-1 and the
+// type, followed by the rest of count-1 7 bits at a time, low bits first, with
+// the top bit set on every byte but the last.
+//
+// Extended types (version 2 only) are escaped with a zero continuation byte,
+// which a version 1 encoder never writes: the first byte is 0x80 plus the
+// extended type number, the second is 0x00, and then count-1 follows 7 bits at
+// a time as above.
+//
+// Returns nonzero on error
+//
+static int8_t write_type_count(
+    ecm_writer* w,
+    int8_t type,
+    uint32_t count
+) {
+    uint8_t buffer[7];
+    size_t n = 0;
+
+    if(count) { w->record_count++; }
+    count--;
+    if(type >= TYPE_EXTENDED) {
+        buffer[n++] = 0x80 | (type - TYPE_EXTENDED);
+        buffer[n++] = 0x00;
+        do {
+            buffer[n++] = ((count >= 128) << 7) | (count & 127);
+            count >>= 7;
+        } while(count);
+        return writer_put(w, buffer, n);
+    }
+    buffer[n++] = ((count >= 32) << 7) | ((count & 31) << 2) | type;
+    count >>= 5;
+    while(count) {
+        buffer[n++] = ((count >= 128) << 7) | (count & 127);
+        count >>= 7;
+    }
+    return writer_put(w, buffer, n);
+}
+
+//
+// Write a version 2 section after the blocks so far; call only once all the
+// records are written
+//
+// Returns nonzero on error
+//
+static int8_t writer_section(ecm_writer* w, const char* tag, const uint8_t* data, size_t size) {
+    uint8_t entry[ECM_DIRECTORY_ENTRY_SIZE];
+
+    if(writer_end_block(w)) { return 1; }
+
+    memcpy(entry, tag, 4);
+    put64lsb(entry + 4, ftello(w->out));
+    put64lsb(entry + 12, (off_t)size);
+    if(grow_buffer(&w->directory, &w->directory_alloc, w->directory_used + sizeof(entry))) { return 1; }
+    memcpy(w->directory + w->directory_used, entry, sizeof(entry));
+    w->directory_used += sizeof(entry);
+
+    if(size && fwrite(data, 1, size, w->out) != size) {
+        printfileerror(w->out, w->outfilename);
+        return 1;
+    }
+    return 0;
+}
+
+//
+// Finish the file: end-of-records indicator and EDC for version 1; the last
+// block, index, directory and trailer for version 2
+//
+// Returns nonzero on error
+//
+static int8_t writer_finish(ecm_writer* w, uint32_t output_edc) {
+    uint8_t buffer[ECM_TRAILER_SIZE];
+    off_t directory_offset;
+
+    if(w->version != 2) {
+        if(write_type_count(w, 0, 0)) { return 1; }
+        put32lsb(buffer, output_edc);
+        return writer_put(w, buffer, 4);
+    }
+
+    if(writer_section(w, "INDX", w->index, w->index_used)) { return 1; }
+
+    //
+    // Directory
+    //
+    directory_offset = ftello(w->out);
+    put32lsb(buffer, (uint32_t)(w->directory_used / ECM_DIRECTORY_ENTRY_SIZE));
+    if(
+        fwrite(buffer, 1, 4, w->out) != 4 ||
+        fwrite(w->directory, 1, w->directory_used, w->out) != w->directory_used
+    ) {
+        goto error_out;
+    }
+
+    //
+    // Trailer
+    //
+    put64lsb(buffer, directory_offset);
+    put64lsb(buffer + 8, w->decoded_total);
+    put32lsb(buffer + 16, output_edc);
+    memcpy(buffer + 20, ecm_magic_v2, 4);
+    if(fwrite(buffer, 1, ECM_TRAILER_SIZE, w->out) != ECM_TRAILER_SIZE) {
+        goto error_out;
+    }
+    return 0;
+
+error_out:
+    printfileerror(w->out, w->outfilename);
+    return 1;
+}
+
+//
+// Start a "META" field; returns where its data goes
+//
+static uint8_t* meta_field(uint8_t* p, const char* tag, uint32_t size) {
+    memcpy(p, tag, 4);
+    put32lsb(p + 4, size);
+    return p + ECM_FIELD_HEADER_SIZE;
+}
+
+//
+// Write the "META" section (version 2 only)
+//
+// Returns nonzero on error
+//
+static int8_t writer_metadata(ecm_writer* w, const off_t* typetally) {
+    uint8_t meta[3 * ECM_FIELD_HEADER_SIZE + 2 * 8 + TYPE_COUNT * 8];
+    uint8_t* p = meta;
+    int i;
+
+    if(w->version != 2) { return 0; }
+
+    p = meta_field(p, "SIZE", 8);
+    put64lsb(p, w->decoded_total + w->block_decoded);
+    p += 8;
+    p = meta_field(p, "RUNS", 8);
+    put64lsb(p, w->record_count);
+    p += 8;
+    p = meta_field(p, "TYPE", TYPE_COUNT * 8);
+    for(i = 0; i < TYPE_COUNT; i++) {
+        put64lsb(p, typetally[i]);
+        p += 8;
+    }
+    return writer_section(w, "META", meta, (size_t)(p - meta));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static uint8_t sector_buffer[2352];
+
+////////////////////////////////////////////////////////////////////////////////
+
+static off_t mycounter_analyze = (off_t)-1;
+static off_t mycounter_encode  = (off_t)-1;
+static off_t mycounter_decode  = (off_t)-1;
+static off_t mycounter_total   = 0;
+
+static void resetcounter(off_t total) {
+    mycounter_analyze = (off_t)-1;
+    mycounter_encode  = (off_t)-1;
+    mycounter_decode  = (off_t)-1;
+    mycounter_total   = total;
+}
+
+static void encode_progress(void) {
+    off_t a = (mycounter_analyze + 64) / 128;
+    off_t e = (mycounter_encode  + 64) / 128;
+    off_t t = (mycounter_total   + 64) / 128;
+    if(!t) { t = 1; }
+    fprintf(stderr,
+        "Analyze(%02u%%) Encode(%02u%%)\r",
+        (unsigned)((((off_t)100) * a) / t),
+        (unsigned)((((off_t)100) * e) / t)
+    );
+}
+
+static void decode_progress(void) {
+    off_t d = (mycounter_decode  + 64) / 128;
+    off_t t = (mycounter_total   + 64) / 128;
+    if(!t) { t = 1; }
+    fprintf(stderr,
+        "Decode(%02u%%)\r",
+        (unsigned)((((off_t)100) * d) / t)
+    );
+}
+
+static void setcounter_analyze(off_t n) {
+    int8_t p = ((n >> 20) != (mycounter_analyze >> 20));
+    mycounter_analyze = n;
+    if(p) { encode_progress(); }
+}
+
+static void setcounter_encode(off_t n) {
+    int8_t p = ((n >> 20) != (mycounter_encode >> 20));
+    mycounter_encode = n;
+    if(p) { encode_progress(); }
+}
+
+static void setcounter_decode(off_t n) {
+    int8_t p = ((n >> 20) != (mycounter_decode >> 20));
+    mycounter_decode = n;
+    if(p) { decode_progress(); }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Round-trip verification of encoded sectors (--verify)
+//
+// write_sectors copies each sector it encodes into a batch.  When the batch is
+// full, worker threads rebuild every sector in it from only the bytes that
+// went into the record, the same way the decoder does, and compare the result
+// to the original input.  The encoder meanwhile fills the other batch.
+//
+#define VERIFY_BATCH_SECTORS 256
+
+typedef struct {
+    uint8_t  sectors[VERIFY_BATCH_SECTORS][2352];
+    off_t    offsets[VERIFY_BATCH_SECTORS];
+    int8_t   types  [VERIFY_BATCH_SECTORS];
+    uint8_t  addresses[VERIFY_BATCH_SECTORS][3]; // for types that predict it
+    int8_t   forms  [VERIFY_BATCH_SECTORS]; // type whose parts were stored
+    int8_t   bad    [VERIFY_BATCH_SECTORS];
+    size_t   count;
+    unsigned workers;
+} verify_batch;
+
+static int8_t        verify_enabled = 0;
+static verify_batch* verify_batches[2] = { NULL, NULL };
+static unsigned      verify_current = 0;
+static background    verify_task;
+static off_t         verify_checked = 0;
+
+//
+// Returns true if the unit rebuilds to exactly the original; address is the
+// predicted address, for types that don't store it, and form the type whose
+// parts are stored (the body's type for TYPE_RAW_MODE2, the bulk type for
+// fill, repeat and stored types, otherwise type).  A repeat or stored sector
+// is checked against its own bulk, which matched the earlier copy's when it
+// was found.
+//
+static int8_t verify_sector(int8_t type, const uint8_t* original, const uint8_t* address, int8_t form) {
+    uint8_t sector[2352];
+    size_t size = sector_types[type].size;
+    const sector_type* t = sector_types + form;
+    unsigned k;
+    if(type == 0) { return 1; }
+    if(is_patched(type)) {
+        uint8_t payload[PATCH_MAX_PAYLOAD];
+        size_t length = patch_encode(type, original, payload);
+        size_t used;
+        return
+            length &&
+            patch_decode(type, payload, length, sector, &used) == 0 &&
+            used == length &&
+            memcmp(sector + 2352 - size, original, size) == 0;
+    }
+    if(sector_types[type].addressed) {
+        memcpy(sector + 0x00C, address, 0x003);
+    }
+    if(is_fill(type)) {
+        uint8_t header[FILL_HEADER_SIZE];
+        if(!detect_fill(form, original, size, header)) { return 0; }
+        fill_sector(header, sector);
+        return memcmp(sector + 2352 - size, original, size) == 0;
+    }
+    for(k = 0; k < 2; k++) {
+        size_t offset = t->stored[k][0];
+        memcpy(sector + offset, original + (offset - (2352 - size)), t->stored[k][1]);
+    }
+    if(t->rebuild) { reconstruct_sector(sector, t->rebuild); }
+    return memcmp(sector + 2352 - size, original, size) == 0;
+}
+
+static void verify_worker(void* context, unsigned index) {
+    verify_batch* batch = (verify_batch*)context;
+    double span = trace_begin();
+    off_t bytes = 0;
+    size_t i;
+    for(i = index; i < batch->count; i += batch->workers) {
+        batch->bad[i] = !verify_sector(batch->types[i], batch->sectors[i], batch->addresses[i], batch->forms[i]);
+        bytes += sector_types[batch->types[i]].size;
+    }
+    trace_end("verify", span, index + 1, batch->offsets[0], bytes);
+}
+
+static int8_t verify_init(void) {
+    verify_current = 0;
+    verify_checked = 0;
+    verify_task.running = 0;
+    verify_batches[0] = malloc(sizeof(verify_batch));
+    verify_batches[1] = malloc(sizeof(verify_batch));
+    if(!verify_batches[0] || !verify_batches[1]) {
+        printf("Out of memory\n");
+        return 1;
+    }
+    verify_batches[0]->count = 0;
+    verify_batches[1]->count = 0;
+    return 0;
+}
+
+static void verify_free(void) {
+    background_wait(&verify_task);
+    if(verify_batches[0]) { free(verify_batches[0]); verify_batches[0] = NULL; }
+    if(verify_batches[1]) { free(verify_batches[1]); verify_batches[1] = NULL; }
+}
+
+//
+// Wait for the batch being checked in the background, if any, and report the
+// first mismatch in it
+//
+// Returns nonzero on error
+//
+static int8_t verify_collect(void) {
+    verify_batch* batch = verify_batches[verify_current ^ 1];
+    size_t i;
+    background_wait(&verify_task);
+    for(i = 0; i < batch->count; i++) {
+        if(batch->bad[i]) {
+            printf("Verify error: sector at input offset ");
+            fprintdec(stdout, batch->offsets[i]);
+            printf(" does not decode back to the original\n");
+            return 1;
+        }
+    }
+    verify_checked += batch->count;
+    batch->count = 0;
+    return 0;
+}
+
+//
+// Hand the current batch to the workers and switch to the other one
+//
+// Returns nonzero on error
+//
+static int8_t verify_flush(void) {
+    verify_batch* batch = verify_batches[verify_current];
+    if(verify_collect()) { return 1; }
+    if(batch->count == 0) { return 0; }
+    batch->workers = get_thread_count();
+    if(batch->workers > batch->count) { batch->workers = (unsigned)batch->count; }
+    background_start(&verify_task, verify_worker, batch, batch->workers);
+    verify_current ^= 1;
+    return 0;
+}
+
+//
+// Queue one encoded sector for checking; address is NULL unless the type
+// predicts it
+//
+// Returns nonzero on error
+//
+static int8_t verify_add(int8_t type, const uint8_t* sector, size_t size, off_t offset, const uint8_t* address, int8_t form) {
+    verify_batch* batch = verify_batches[verify_current];
+    memcpy(batch->sectors[batch->count], sector, size);
+    if(address) { memcpy(batch->addresses[batch->count], address, 3); }
+    batch->forms  [batch->count] = form;
+    batch->offsets[batch->count] = offset;
+    batch->types  [batch->count] = type;
+    batch->count++;
+    if(batch->count == VERIFY_BATCH_SECTORS) {
+        return verify_flush();
+    }
+    return 0;
+}
+
+//
+// Check everything still queued
+//
+// Returns nonzero on error
+//
+static int8_t verify_finish(void) {
+    if(verify_flush()) { return 1; }
+    return verify_collect();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Building the "SUBC" section
+//
+typedef struct {
+    int8_t   layout;     // -1 until a sector with a valid Q channel turns up
+    uint8_t* data;       // the section, header filled in at the end
+    size_t   used;
+    size_t   alloc;
+    size_t   run_start;  // where the current run's count is
+    uint32_t run_count;
+    int8_t   run_stored;
+    uint8_t  base[SUBCHANNEL_SIZE]; // last stored sector
+    off_t    since_base; // sectors after it
+    off_t    sectors;
+    off_t    stored;
+    uint32_t edc;
+} subchannel_encoder;
+
+static void subchannel_encoder_init(subchannel_encoder* s) {
+    memset(s, 0, sizeof(*s));
+    s->layout = -1;
+    s->used = ECM_SUBC_HEADER_SIZE;
+}
+
+//
+// Returns nonzero on error
+//
+static int8_t subchannel_add(subchannel_encoder* s, const uint8_t* sub) {
+    uint8_t predicted[SUBCHANNEL_SIZE];
+    int8_t stored = !(
+        s->sectors > 0 && s->layout >= 0 &&
+        subchannel_predict(s->base, s->since_base + 1, s->layout, predicted) &&
+        !memcmp(predicted, sub, SUBCHANNEL_SIZE)
+    );
+
+    s->edc = edc_compute(s->edc, sub, SUBCHANNEL_SIZE);
+    s->sectors++;
+
+    if(s->run_count == 0 || stored != s->run_stored || s->run_count == 0x7FFFFFFF) {
+        if(grow_buffer(&s->data, &s->alloc, s->used + 4)) { return 1; }
+        s->run_start = s->used;
+        s->used += 4;
+        s->run_count = 0;
+        s->run_stored = stored;
+    }
+    s->run_count++;
+    put32lsb(s->data + s->run_start, s->run_count | (stored ? 0x80000000LU : 0));
+
+    if(stored) {
+        if(grow_buffer(&s->data, &s->alloc, s->used + SUBCHANNEL_SIZE)) { return 1; }
+        memcpy(s->data + s->used, sub, SUBCHANNEL_SIZE);
+        s->used += SUBCHANNEL_SIZE;
+        s->stored++;
+        memcpy(s->base, sub, SUBCHANNEL_SIZE);
+        s->since_base = 0;
+        if(s->layout < 0) { s->layout = subchannel_layout(sub); }
+    } else {
+        s->since_base++;
+    }
+    return 0;
+}
+
+//
+// Returns nonzero on error
+//
+static int8_t subchannel_finish(subchannel_encoder* s, ecm_writer* w) {
+    if(grow_buffer(&s->data, &s->alloc, s->used)) { return 1; }
+    put32lsb(s->data, s->layout < 0 ? SUBCHANNEL_INTERLEAVED : s->layout);
+    put64lsb(s->data + 4, s->sectors);
+    put32lsb(s->data + 12, s->edc);
+    return writer_section(w, "SUBC", s->data, s->used);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Image digests (--hash)
+//
+// CRC-32, MD5, SHA-1 and SHA-256 of a whole image, as DAT files list them,
+// worked out while the image streams through the encoder or decoder.  Data is
+// copied into a batch; while one batch is hashed in the background, one
+// worker per digest, the next is filled.
+//
+enum {
+    DIGEST_CRC32,
+    DIGEST_MD5,
+    DIGEST_SHA1,
+    DIGEST_SHA256,
+    DIGEST_COUNT
+};
+
+#define DIGEST_MAX_SIZE   32
+#define DIGEST_BATCH_SIZE 0x100000
+
+typedef void (*digest_block_func)(uint32_t* h, const uint8_t* block);
+
+typedef struct {
+    const char* name;      // for --hash=
+    const char* attribute; // in the DAT line
+    size_t size;
+    int8_t big_endian;
+    digest_block_func block;
+    uint32_t initial[8];
+} digest_type;
+
+//
+// Digests chosen with --hash, a bit per DIGEST_* type
+//
+static unsigned digest_selected = 0;
+
+#define ROTL32(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+#define ROTR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static const uint32_t md5_k[64] = {
+    0xD76AA478, 0xE8C7B756, 0x242070DB, 0xC1BDCEEE, 0xF57C0FAF, 0x4787C62A, 0xA8304613, 0xFD469501,
+    0x698098D8, 0x8B44F7AF, 0xFFFF5BB1, 0x895CD7BE, 0x6B901122, 0xFD987193, 0xA679438E, 0x49B40821,
+    0xF61E2562, 0xC040B340, 0x265E5A51, 0xE9B6C7AA, 0xD62F105D, 0x02441453, 0xD8A1E681, 0xE7D3FBC8,
+    0x21E1CDE6, 0xC33707D6, 0xF4D50D87, 0x455A14ED, 0xA9E3E905, 0xFCEFA3F8, 0x676F02D9, 0x8D2A4C8A,
+    0xFFFA3942, 0x8771F681, 0x6D9D6122, 0xFDE5380C, 0xA4BEEA44, 0x4BDECFA9, 0xF6BB4B60, 0xBEBFBC70,
+    0x289B7EC6, 0xEAA127FA, 0xD4EF3085, 0x04881D05, 0xD9D4D039, 0xE6DB99E5, 0x1FA27CF8, 0xC4AC5665,
+    0xF4292244, 0x432AFF97, 0xAB9423A7, 0xFC93A039, 0x655B59C3, 0x8F0CCC92, 0xFFEFF47D, 0x85845DD1,
+    0x6FA87E4F, 0xFE2CE6E0, 0xA3014314, 0x4E0811A1, 0xF7537E82, 0xBD3AF235, 0x2AD7D2BB, 0xEB86D391
+};
+
+static const uint8_t md5_shift[16] = { 7, 12, 17, 22, 5, 9, 14, 20, 4, 11, 16, 23, 6, 10, 15, 21 };
+
+static void md5_block(uint32_t* h, const uint8_t* block) {
+    uint32_t x[16];
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3];
+    unsigned i;
+    for(i = 0; i < 16; i++) { x[i] = get32lsb(block + 4 * i); }
+    for(i = 0; i < 64; i++) {
+        uint32_t f;
+        unsigned g;
+        uint32_t t;
+        switch(i >> 4) {
+        case 0:  f = (b & c) | (~b & d); g = i;                break;
+        case 1:  f = (d & b) | (~d & c); g = (5 * i + 1) & 15; break;
+        case 2:  f = b ^ c ^ d;          g = (3 * i + 5) & 15; break;
+        default: f = c ^ (b | ~d);       g = (7 * i) & 15;     break;
+        }
+        t = a + f + md5_k[i] + x[g];
+        a = d;
+        d = c;
+        c = b;
+        b += ROTL32(t, md5_shift[(i >> 4) * 4 + (i & 3)]);
+    }
+    h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+}
+
+static void sha1_block(uint32_t* h, const uint8_t* block) {
+    uint32_t w[80];
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+    unsigned i;
+    for(i = 0; i < 16; i++) { w[i] = get32msb(block + 4 * i); }
+    for(; i < 80; i++) {
+        uint32_t t = w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16];
+        w[i] = ROTL32(t, 1);
+    }
+    for(i = 0; i < 80; i++) {
+        uint32_t f;
+        uint32_t t;
+        if(i < 20) {
+            f = ((b & c) | (~b & d)) + 0x5A827999;
+        } else if(i < 40) {
+            f = (b ^ c ^ d) + 0x6ED9EBA1;
+        } else if(i < 60) {
+            f = ((b & c) | (b & d) | (c & d)) + 0x8F1BBCDC;
+        } else {
+            f = (b ^ c ^ d) + 0xCA62C1D6;
+        }
+        t = ROTL32(a, 5) + f + e + w[i];
+        e = d;
+        d = c;
+        c = ROTL32(b, 30);
+        b = a;
+        a = t;
+    }
+    h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e;
+}
+
+static const uint32_t sha256_k[64] = {
+    0x428A2F98, 0x71374491, 0xB5C0FBCF, 0xE9B5DBA5, 0x3956C25B, 0x59F111F1, 0x923F82A4, 0xAB1C5ED5,
+    0xD807AA98, 0x12835B01, 0x243185BE, 0x550C7DC3, 0x72BE5D74, 0x80DEB1FE, 0x9BDC06A7, 0xC19BF174,
+    0xE49B69C1, 0xEFBE4786, 0x0FC19DC6, 0x240CA1CC, 0x2DE92C6F, 0x4A7484AA, 0x5CB0A9DC, 0x76F988DA,
+    0x983E5152, 0xA831C66D, 0xB00327C8, 0xBF597FC7, 0xC6E00BF3, 0xD5A79147, 0x06CA6351, 0x14292967,
+    0x27B70A85, 0x2E1B2138, 0x4D2C6DFC, 0x53380D13, 0x650A7354, 0x766A0ABB, 0x81C2C92E, 0x92722C85,
+    0xA2BFE8A1, 0xA81A664B, 0xC24B8B70, 0xC76C51A3, 0xD192E819, 0xD6990624, 0xF40E3585, 0x106AA070,
+    0x19A4C116, 0x1E376C08, 0x2748774C, 0x34B0BCB5, 0x391C0CB3, 0x4ED8AA4A, 0x5B9CCA4F, 0x682E6FF3,
+    0x748F82EE, 0x78A5636F, 0x84C87814, 0x8CC70208, 0x90BEFFFA, 0xA4506CEB, 0xBEF9A3F7, 0xC67178F2
+};
+
+static void sha256_block(uint32_t* h, const uint8_t* block) {
+    uint32_t w[64];
+    uint32_t v[8];
+    unsigned i;
+    for(i = 0; i < 16; i++) { w[i] = get32msb(block + 4 * i); }
+    for(; i < 64; i++) {
+        uint32_t s0 = ROTR32(w[i - 15],  7) ^ ROTR32(w[i - 15], 18) ^ (w[i - 15] >>  3);
+        uint32_t s1 = ROTR32(w[i -  2], 17) ^ ROTR32(w[i -  2], 19) ^ (w[i -  2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    for(i = 0; i < 8; i++) { v[i] = h[i]; }
+    for(i = 0; i < 64; i++) {
+        uint32_t s1 = ROTR32(v[4], 6) ^ ROTR32(v[4], 11) ^ ROTR32(v[4], 25);
+        uint32_t ch = (v[4] & v[5]) ^ (~v[4] & v[6]);
+        uint32_t t1 = v[7] + s1 + ch + sha256_k[i] + w[i];
+        uint32_t s0 = ROTR32(v[0], 2) ^ ROTR32(v[0], 13) ^ ROTR32(v[0], 22);
+        uint32_t maj = (v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]);
+        v[7] = v[6];
+        v[6] = v[5];
+        v[5] = v[4];
+        v[4] = v[3] + t1;
+        v[3] = v[2];
+        v[2] = v[1];
+        v[1] = v[0];
+        v[0] = t1 + s0 + maj;
+    }
+    for(i = 0; i < 8; i++) { h[i] += v[i]; }
+}
+
+static const digest_type digest_types[DIGEST_COUNT] = {
+    { "crc32",  "crc",     4, 1, NULL,
+        { 0xFFFFFFFF } },
+    { "md5",    "md5",    16, 0, md5_block,
+        { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476 } },
+    { "sha1",   "sha1",   20, 1, sha1_block,
+        { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 } },
+    { "sha256", "sha256", 32, 1, sha256_block,
+        { 0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A, 0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19 } }
+};
+
+typedef struct {
+    uint32_t h[8];     // state; the CRC-32 is h[0]
+    uint64_t length;   // bytes so far
+    uint8_t  block[64];
+} digest_context;
+
+static void digest_update(int8_t type, digest_context* ctx, const uint8_t* data, size_t size) {
+    const digest_type* t = digest_types + type;
+    size_t used = (size_t)(ctx->length % 64);
+    ctx->length += size;
+    if(!t->block) {
+        uint32_t crc = ctx->h[0];
+        for(; size; size--) {
+            crc = (crc >> 8) ^ crc32_lut[(crc ^ (*data++)) & 0xFF];
+        }
+        ctx->h[0] = crc;
+        return;
+    }
+    if(used) {
+        size_t n = 64 - used;
+        if(n > size) { n = size; }
+        memcpy(ctx->block + used, data, n);
+        data += n;
+        size -= n;
+        if(used + n < 64) { return; }
+        t->block(ctx->h, ctx->block);
+    }
+    for(; size >= 64; data += 64, size -= 64) {
+        t->block(ctx->h, data);
+    }
+    memcpy(ctx->block, data, size);
+}
+
+//
+// Pad out the last block with the length and write the digest to out
+//
+static void digest_final(int8_t type, digest_context* ctx, uint8_t* out) {
+    const digest_type* t = digest_types + type;
+    size_t i;
+    if(t->block) {
+        uint8_t pad[72];
+        uint64_t bits = ctx->length * 8;
+        size_t used = (size_t)(ctx->length % 64);
+        size_t n = (used < 56 ? 56 : 120) - used;
+        memset(pad, 0, sizeof(pad));
+        pad[0] = 0x80;
+        for(i = 0; i < 8; i++) {
+            pad[n + i] = (uint8_t)(bits >> (t->big_endian ? 56 - 8 * i : 8 * i));
+        }
+        digest_update(type, ctx, pad, n + 8);
+    } else {
+        ctx->h[0] = ~ctx->h[0];
+    }
+    for(i = 0; i < t->size / 4; i++) {
+        if(t->big_endian) {
+            put32msb(out + 4 * i, ctx->h[i]);
+        } else {
+            put32lsb(out + 4 * i, ctx->h[i]);
+        }
+    }
+}
+
+typedef struct {
+    unsigned       types;   // a bit per DIGEST_* type
+    int8_t         order[DIGEST_COUNT]; // worker index -> type
+    unsigned       count;
+    digest_context context[DIGEST_COUNT];
+    uint8_t*       batch[2];
+    int8_t         current; // batch being filled
+    size_t         used;
+    size_t         hashing; // bytes of the other batch being hashed, or 0
+    background     task;
+    off_t          size;
+    uint8_t        value[DIGEST_COUNT][DIGEST_MAX_SIZE];
+} image_digest;
+
+static void digest_worker(void* context, unsigned index) {
+    image_digest* d = (image_digest*)context;
+    int8_t type = d->order[index];
+    digest_update(type, d->context + type, d->batch[d->current ^ 1], d->hashing);
+}
+
+//
+// Start on the given digests; with types 0, this does nothing and the rest
+// of the digest_ functions ignore d
+//
+// Returns nonzero on error
+//
+static int8_t digest_init(image_digest* d, unsigned types) {
+    int8_t i;
+    memset(d, 0, sizeof(*d));
+    if(!types) { return 0; }
+    d->batch[0] = malloc(DIGEST_BATCH_SIZE);
+    d->batch[1] = malloc(DIGEST_BATCH_SIZE);
+    if(!d->batch[0] || !d->batch[1]) { return 1; }
+    d->types = types;
+    for(i = 0; i < DIGEST_COUNT; i++) {
+        if(!(types & (1u << i))) { continue; }
+        d->order[d->count++] = i;
+        memcpy(d->context[i].h, digest_types[i].initial, sizeof(d->context[i].h));
+    }
+    return 0;
+}
+
+//
+// Hand the current batch to the workers, once they're done with the other
+//
+static void digest_flush(image_digest* d) {
+    if(d->hashing) {
+        background_wait(&d->task);
+        d->hashing = 0;
+    }
+    if(!d->used) { return; }
+    d->hashing = d->used;
+    d->used = 0;
+    d->current ^= 1;
+    background_start(&d->task, digest_worker, d, d->count);
+}
+
+static void digest_put(image_digest* d, const uint8_t* data, size_t size) {
+    if(!d || !d->types) { return; }
+    d->size += size;
+    while(size) {
+        size_t n = DIGEST_BATCH_SIZE - d->used;
+        if(n > size) { n = size; }
+        memcpy(d->batch[d->current] + d->used, data, n);
+        d->used += n;
+        data += n;
+        size -= n;
+        if(d->used == DIGEST_BATCH_SIZE) { digest_flush(d); }
+    }
+}
+
+static void digest_finish(image_digest* d) {
+    int8_t i;
+    if(!d->types) { return; }
+    digest_flush(d);
+    digest_flush(d);
+    for(i = 0; i < DIGEST_COUNT; i++) {
+        if(d->types & (1u << i)) { digest_final(i, d->context + i, d->value[i]); }
+    }
+}
+
+static void digest_free(image_digest* d) {
+    if(d->hashing) {
+        background_wait(&d->task);
+        d->hashing = 0;
+    }
+    if(d->batch[0]) { free(d->batch[0]); d->batch[0] = NULL; }
+    if(d->batch[1]) { free(d->batch[1]); d->batch[1] = NULL; }
+}
+
+//
+// Write the finished digests as a DAT file "rom" line, under the file part
+// of filename, leaving out suffix if it ends with it
+//
+static void digest_print(const image_digest* d, const char* filename, const char* suffix) {
+    const char* name = filename;
+    const char* p;
+    size_t length;
+    size_t i;
+    int8_t t;
+
+    if(!d->types) { return; }
+    for(p = filename; *p; p++) {
+        if(*p == '/' || *p == '\\' || *p == ':') { name = p + 1; }
+    }
+    length = strlen(name);
+    if(suffix) {
+        size_t l = strlen(suffix);
+        if(length > l) {
+            for(i = 0; i < l && tolower((unsigned char)name[length - l + i]) == suffix[i]; i++) {}
+            if(i == l) { length -= l; }
+        }
+    }
+
+    printf("<rom name=\"");
+    for(i = 0; i < length; i++) {
+        switch(name[i]) {
+        case '&': printf("&amp;");  break;
+        case '<': printf("&lt;");   break;
+        case '>': printf("&gt;");   break;
+        case '"': printf("&quot;"); break;
+        default:  putchar(name[i]); break;
+        }
+    }
+    printf("\" size=\"");
+    fprintdec(stdout, d->size);
+    printf("\"");
+    for(t = 0; t < DIGEST_COUNT; t++) {
+        if(!(d->types & (1u << t))) { continue; }
+        printf(" %s=\"", digest_types[t].attribute);
+        for(i = 0; i < digest_types[t].size; i++) {
+            printf("%02x", d->value[t][i]);
+        }
+        printf("\"");
+    }
+    printf("/>\n");
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Encoder input
+//
+// For 2448-byte sector images, only the first 2352 bytes of each sector are
+// passed on; the subchannel data after them goes to sub, if set.  With ecm
+// set (bin2ecm --recode), the image is decoded from that ECM file as it's
+// read, instead of read from f; with set (bin2ecm foo.cue), it's the files of
+// the set, one after another.
+//
+typedef struct {
+    FILE**   files;
+    off_t*   starts;  // image offset of each file; starts[count] is the size
+    size_t   count;
+    size_t   current; // file the last read was from
+    off_t    next;    // image offset the current file is positioned at
+} input_set;
+
+typedef struct {
+    FILE*               f;
+    ecm_file*           ecm;
+    input_set*          set;
+    int8_t              subchannel;
+    off_t               pos;      // position not counting subchannel data
+    off_t               physical; // position in the image
+    subchannel_encoder* sub;
+    image_digest*       digest; // if set, takes every byte read, subchannel data included
+    int8_t              nomem;
+} ecm_input;
+
+static int8_t input_seek(ecm_input* in, off_t pos) {
+    off_t physical = pos;
+    if(in->subchannel) {
+        physical = (pos / 2352) * 2448 + pos % 2352;
+    }
+    in->pos = pos;
+    in->physical = physical;
+    return in->ecm || in->set || fseeko(in->f, physical, SEEK_SET) == 0;
+}
+
+//
+// Read size bytes at the given offset of the image a set of files makes up,
+// seeking only when that isn't where the last read left off
+//
+// Returns nonzero if all size bytes were read
+//
+static int8_t input_set_get(input_set* s, off_t offset, uint8_t* dest, size_t size) {
+    while(size) {
+        size_t k = s->current;
+        size_t n = size;
+        if(offset < s->starts[k] || offset >= s->starts[k + 1]) {
+            for(k = 0; k < s->count && offset >= s->starts[k + 1]; k++) {}
+            if(k == s->count) { return 0; }
+        }
+        if(k != s->current || offset != s->next) {
+            if(fseeko(s->files[k], offset - s->starts[k], SEEK_SET) != 0) { return 0; }
+        }
+        if((off_t)n > s->starts[k + 1] - offset) { n = (size_t)(s->starts[k + 1] - offset); }
+        if(fread(dest, 1, n, s->files[k]) != n) { return 0; }
+        dest += n;
+        size -= n;
+        offset += n;
+        s->current = k;
+        s->next = offset;
+    }
+    return 1;
+}
+
+//
+// Read size bytes of the image, subchannel data and all, from the current
+// position
+//
+// Returns nonzero if all size bytes were read
+//
+static int8_t input_get(ecm_input* in, uint8_t* dest, size_t size) {
+    if(in->ecm) {
+        if(ecm_read(in->ecm, in->physical, dest, size)) { return 0; }
+    } else if(in->set) {
+        if(!input_set_get(in->set, in->physical, dest, size)) { return 0; }
+    } else if(fread(dest, 1, size, in->f) != size) {
+        return 0;
+    }
+    in->physical += size;
+    return 1;
+}
+
+//
+// Read size bytes of the image at the given offset, for a look before
+// encoding starts
+//
+// Returns nonzero if all size bytes were read
+//
+static int8_t input_peek(ecm_input* in, off_t offset, uint8_t* dest, size_t size) {
+    in->physical = offset;
+    return (in->ecm || in->set || fseeko(in->f, offset, SEEK_SET) == 0) && input_get(in, dest, size);
+}
+
+//
+// Returns nonzero if all size bytes were read
+//
+static int8_t input_read(ecm_input* in, uint8_t* dest, size_t size) {
+    while(size) {
+        size_t n = size;
+        if(in->subchannel && n > 2352 - (size_t)(in->pos % 2352)) {
+            n = 2352 - (size_t)(in->pos % 2352);
+        }
+        if(!input_get(in, dest, n)) { return 0; }
+        digest_put(in->digest, dest, n);
+        dest += n;
+        size -= n;
+        in->pos += n;
+        if(in->subchannel && in->pos % 2352 == 0) {
+            uint8_t sub[SUBCHANNEL_SIZE];
+            if(!input_get(in, sub, SUBCHANNEL_SIZE)) { return 0; }
+            digest_put(in->digest, sub, SUBCHANNEL_SIZE);
+            if(in->sub && subchannel_add(in->sub, sub)) {
+                in->nomem = 1;
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Finding sectors whose bulk was already written
+//
+// A fixed-size table, indexed by a hash of the bulk, remembers where the most
+// recent sector with each hash was read from, and once it's written, where
+// it went.  A match is only taken once it's been compared with the earlier
+// sector in the input.  Sectors go in the table as they're found, so a
+// repeat can refer to one in the run before it; that run is always written
+// out first, since the repeat ends it.
+//
+typedef struct {
+    uint32_t hash;
+    int8_t   bulk;         // bulk type, or 0 if the slot is unused
+    off_t    input_offset; // of the bulk, not counting subchannel data
+    off_t    file_offset;  // where it was written, or -1 if it isn't yet
+} dedupe_entry;
+
+#define DEDUPE_SLOTS 0x10000
+
+static dedupe_entry* dedupe_table = NULL;
+
+#endif
+
+static uint64_t bulk_hash64(uint64_t seed, const uint8_t* data, size_t size) {
+    uint64_t h = UINT64_C(0x9E3779B97F4A7C15) ^ seed;
+    size_t i;
+    for(i = 0; i + 8 <= size; i += 8) {
+        uint64_t v;
+        memcpy(&v, data + i, 8);
+        h = (h ^ v) * UINT64_C(0xFF51AFD7ED558CCD);
+        h ^= h >> 32;
+    }
+    for(; i < size; i++) {
+        h = (h ^ data[i]) * UINT64_C(0x100000001B3);
+    }
+    h ^= h >> 29;
+    h *= UINT64_C(0xBF58476D1CE4E5B9);
+    return h ^ (h >> 32);
+}
+
+#ifndef ECM_NO_MAIN
+
+static uint32_t bulk_hash(const uint8_t* data, size_t size) {
+    return (uint32_t)bulk_hash64(0, data, size);
+}
+
+//
+// Look for an earlier sector with the same bulk; if there's none, this one
+// takes its slot
+//
+// Returns nonzero on error
+//
+static int8_t dedupe_check(
+    ecm_input* in,
+    int8_t bulk,
+    const uint8_t* data,
+    off_t input_offset,
+    dedupe_entry** match
+) {
+    uint8_t earlier[0x918];
+    size_t size = sector_types[bulk].stored[0][1];
+    uint32_t hash = bulk_hash(data, size);
+    dedupe_entry* e = dedupe_table + (hash & (DEDUPE_SLOTS - 1));
+    *match = NULL;
+    if(e->bulk == bulk && e->hash == hash) {
+        if(!input_seek(in, e->input_offset) || !input_read(in, earlier, size)) { return 1; }
+        if(!memcmp(earlier, data, size)) {
+            *match = e;
+            return 0;
+        }
+    }
+    e->hash = hash;
+    e->bulk = bulk;
+    e->input_offset = input_offset;
+    e->file_offset = -1;
+    return 0;
+}
+
+//
+// Note where a sector's bulk was written, if it's still in the table
+//
+static void dedupe_written(int8_t bulk, const uint8_t* data, off_t input_offset, off_t file_offset) {
+    uint32_t hash = bulk_hash(data, sector_types[bulk].stored[0][1]);
+    dedupe_entry* e = dedupe_table + (hash & (DEDUPE_SLOTS - 1));
+    if(e->bulk == bulk && e->input_offset == input_offset) {
+        e->file_offset = file_offset;
+    }
+}
+
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Shared sector store
+//
+// With --store=DIR, the bulk of each sector goes into a store that any number
+// of ECM files share, and the files refer to it by content ID: the discs of a
+// set, or revisions of one disc, then keep each distinct sector only once
+// between them.  The directory holds two files:
+//
+//   "pack":  "ECMP" u32 version, then entries, each a u8 bulk type and the
+//            bulk; entries are only ever appended
+//   "index": "ECMI" u32 version, u64 number of entries, u64 size of the pack
+//            that they cover, then per entry the u64 content ID and the u64
+//            pack offset, sorted by ID
+//
+// Readers map both into memory and find IDs by binary search, so the pages
+// of the pack that the system keeps in memory act as the read cache.  An
+// encoder locks the pack while it appends, then replaces the index with one
+// that takes in the new entries, so readers see either the old entries or
+// all of them.  Pack bytes past those the index covers are left over from an
+// encoder that didn't finish, and the next one cuts them off.
+//
+// This needs memory-mapped files; elsewhere --store is refused.
+//
+#if defined(_POSIX_MAPPED_FILES) && (_POSIX_MAPPED_FILES > 0)
+#include <sys/mman.h>
+#include <fcntl.h>
+#define ECM_STORE 1
+#endif
+
+#define STORE_VERSION           1
+#define STORE_PACK_HEADER_SIZE  8
+#define STORE_INDEX_HEADER_SIZE 24
+#define STORE_ENTRY_SIZE        16
+
+static const uint8_t store_pack_magic[4]  = { 'E', 'C', 'M', 'P' };
+static const uint8_t store_index_magic[4] = { 'E', 'C', 'M', 'I' };
+
+typedef struct {
+    off_t id;
+    off_t offset; // in the pack, or 0 if the slot is unused
+} store_slot;
+
+typedef struct {
+    char*          pack_name;
+    char*          index_name;
+    int            pack_fd;
+    const uint8_t* index;      // the index file, mapped; NULL if there's none
+    size_t         index_size;
+    size_t         entries;
+    const uint8_t* pack;       // the pack, mapped
+    off_t          mapped;     // bytes of the pack mapped
+    off_t          covered;    // size of the pack the index covers
+
+    //
+    // Encoding: the pack is locked, and the entries added to it are kept in
+    // a hash table until they go in the index
+    //
+    FILE*          append;     // NULL when only reading
+    off_t          pack_size;
+    store_slot*    added;
+    size_t         added_count;
+    size_t         added_slots; // a power of 2, or 0
+} ecm_store;
+
+static ecm_store* shared_store = NULL;
+
+//
+// Content ID of a bulk: 63 bits of its hash, so that it fits an off_t
+//
+static off_t bulk_id(int8_t bulk, const uint8_t* data) {
+    return (off_t)(bulk_hash64((uint64_t)bulk, data, sector_types[bulk].stored[0][1]) >> 1);
+}
+
+static char* store_filename(const char* directory, const char* name) {
+    char* s = malloc(strlen(directory) + strlen(name) + 2);
+    if(s) {
+        strcpy(s, directory);
+        strcat(s, "/");
+        strcat(s, name);
+    }
+    return s;
+}
+
+static void store_close(ecm_store* s) {
+    if(!s) { return; }
+#ifdef ECM_STORE
+    //
+    // Entries that never made it into the index are cut off
+    //
+    if(s->append && s->pack_size > s->covered) {
+        fflush(s->append);
+        if(ftruncate(s->pack_fd, s->covered) != 0) {}
+    }
+    if(s->index) { munmap((void*)s->index, s->index_size); }
+    if(s->pack) { munmap((void*)s->pack, (size_t)s->mapped); }
+    if(s->append) {
+        fclose(s->append);
+    } else if(s->pack_fd >= 0) {
+        close(s->pack_fd);
+    }
+#endif
+    if(s->pack_name) { free(s->pack_name); }
+    if(s->index_name) { free(s->index_name); }
+    if(s->added) { free(s->added); }
+    free(s);
+}
+
+//
+// Open the store in the given directory; for writing, the directory and
+// files are created if they don't exist yet, and the pack is locked against
+// other writers (waiting for one that has it)
+//
+// Returns NULL on error, with errno set (EINVAL if a file isn't part of a
+// store) and *part naming the file at fault
+//
+static ecm_store* store_open(const char* directory, int8_t writing, const char** part) {
+#ifdef ECM_STORE
+    ecm_store* s = calloc(1, sizeof(ecm_store));
+    struct stat st;
+    off_t pack_size;
+    int index_fd = -1;
+    int error;
+
+    *part = "pack";
+    if(!s) { errno = ENOMEM; return NULL; }
+    s->pack_fd = -1;
+    s->pack_name = store_filename(directory, "pack");
+    s->index_name = store_filename(directory, "index");
+    if(!s->pack_name || !s->index_name) { errno = ENOMEM; goto error; }
+
+    if(writing && stat(directory, &st) != 0) {
+        // Any error shows up opening the pack
+        mkdir(directory);
+    }
+    s->pack_fd = open(s->pack_name, writing ? (O_RDWR | O_CREAT | O_APPEND) : O_RDONLY, 0666);
+    if(s->pack_fd < 0) { goto error; }
+    if(writing) {
+        struct flock lock;
+        memset(&lock, 0, sizeof(lock));
+        lock.l_type = F_WRLCK;
+        lock.l_whence = SEEK_SET;
+        if(fcntl(s->pack_fd, F_SETLKW, &lock) != 0) { goto error; }
+    }
+    if(fstat(s->pack_fd, &st) != 0) { goto error; }
+    pack_size = st.st_size;
+
+    *part = "index";
+    index_fd = open(s->index_name, O_RDONLY);
+    if(index_fd < 0) {
+        //
+        // A new store
+        //
+        uint8_t header[STORE_PACK_HEADER_SIZE];
+        if(errno != ENOENT || !writing) { goto error; }
+        *part = "pack";
+        memcpy(header, store_pack_magic, 4);
+        put32lsb(header + 4, STORE_VERSION);
+        if(
+            ftruncate(s->pack_fd, 0) != 0 ||
+            write(s->pack_fd, header, sizeof(header)) != (ssize_t)sizeof(header)
+        ) {
+            goto error;
+        }
+        pack_size = s->covered = STORE_PACK_HEADER_SIZE;
+    } else {
+        if(fstat(index_fd, &st) != 0) { goto error; }
+        if(st.st_size < STORE_INDEX_HEADER_SIZE || (off_t)(size_t)st.st_size != st.st_size) {
+            errno = EINVAL;
+            goto error;
+        }
+        s->index_size = (size_t)st.st_size;
+        s->index = mmap(NULL, s->index_size, PROT_READ, MAP_SHARED, index_fd, 0);
+        if(s->index == MAP_FAILED) {
+            s->index = NULL;
+            goto error;
+        }
+        s->entries = (size_t)get64lsb(s->index + 8);
+        s->covered = get64lsb(s->index + 16);
+        if(
+            memcmp(s->index, store_index_magic, 4) ||
+            get32lsb(s->index + 4) != STORE_VERSION ||
+            s->entries != (s->index_size - STORE_INDEX_HEADER_SIZE) / STORE_ENTRY_SIZE ||
+            s->index_size != STORE_INDEX_HEADER_SIZE + s->entries * STORE_ENTRY_SIZE ||
+            s->covered < STORE_PACK_HEADER_SIZE ||
+            (off_t)(size_t)s->covered != s->covered
+        ) {
+            errno = EINVAL;
+            goto error;
+        }
+        close(index_fd);
+        index_fd = -1;
+
+        *part = "pack";
+        if(s->covered > pack_size) {
+            errno = EINVAL;
+            goto error;
+        }
+        if(writing && pack_size > s->covered) {
+            if(ftruncate(s->pack_fd, s->covered) != 0) { goto error; }
+        }
+        pack_size = s->covered;
+    }
+
+    s->pack = mmap(NULL, (size_t)s->covered, PROT_READ, MAP_SHARED, s->pack_fd, 0);
+    if(s->pack == MAP_FAILED) {
+        s->pack = NULL;
+        goto error;
+    }
+    s->mapped = s->covered;
+    if(memcmp(s->pack, store_pack_magic, 4) || get32lsb(s->pack + 4) != STORE_VERSION) {
+        errno = EINVAL;
+        goto error;
+    }
+    s->pack_size = pack_size;
+
+    if(writing) {
+        s->append = fdopen(s->pack_fd, "ab");
+        if(!s->append) { goto error; }
+    }
+    return s;
+
+error:
+    error = errno;
+    if(index_fd >= 0) { close(index_fd); }
+    store_close(s);
+    errno = error;
+    return NULL;
+#else
+    (void)directory;
+    (void)writing;
+    *part = "pack";
+    errno = ENOSYS;
+    return NULL;
+#endif
+}
+
+//
+// Look up an ID, among the entries in the index and those added since
+//
+// Returns nonzero if it was found
+//
+static int8_t store_find(const ecm_store* s, off_t id, off_t* offset) {
+    size_t low = 0;
+    size_t high = s->entries;
+    while(low < high) {
+        size_t middle = low + (high - low) / 2;
+        const uint8_t* e = s->index + STORE_INDEX_HEADER_SIZE + middle * STORE_ENTRY_SIZE;
+        off_t at = get64lsb(e);
+        if(at == id) {
+            *offset = get64lsb(e + 8);
+            return 1;
+        }
+        if(at < id) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    if(s->added_slots) {
+        size_t mask = s->added_slots - 1;
+        size_t i;
+        for(i = (size_t)id & mask; s->added[i].offset; i = (i + 1) & mask) {
+            if(s->added[i].id == id) {
+                *offset = s->added[i].offset;
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+//
+// Read size bytes of the pack at the given offset
+//
+// Returns nonzero on error
+//
+static int8_t store_fetch(ecm_store* s, off_t offset, uint8_t* dest, size_t size) {
+    if(offset < STORE_PACK_HEADER_SIZE || offset > s->pack_size - (off_t)size) {
+        errno = EINVAL;
+        return 1;
+    }
+    if(offset + (off_t)size <= s->mapped) {
+        memcpy(dest, s->pack + offset, size);
+        return 0;
+    }
+#ifdef ECM_STORE
+    //
+    // Added while encoding, past what's mapped
+    //
+    if(s->append && fflush(s->append) == 0 && pread(s->pack_fd, dest, size, offset) == (ssize_t)size) {
+        return 0;
+    }
+#endif
+    return 1;
+}
+
+//
+// Read the bulk with the given ID and type into sector, checking it against
+// the ID
+//
+// Returns nonzero if the store doesn't have it
+//
+static int8_t store_read(ecm_store* s, int8_t bulk, off_t id, uint8_t* sector) {
+    uint8_t entry[1 + 0x918];
+    size_t size = sector_types[bulk].stored[0][1];
+    off_t offset;
+    if(
+        !s ||
+        !store_find(s, id, &offset) ||
+        store_fetch(s, offset, entry, 1 + size) ||
+        entry[0] != bulk ||
+        bulk_id(bulk, entry + 1) != id
+    ) {
+        return 1;
+    }
+    memcpy(sector + sector_types[bulk].stored[0][0], entry + 1, size);
+    return 0;
+}
+
+#ifndef ECM_NO_MAIN
+
+static int8_t store_grow(ecm_store* s) {
+    size_t slots = s->added_slots ? s->added_slots * 2 : 0x1000;
+    store_slot* added = calloc(slots, sizeof(store_slot));
+    size_t i;
+    if(!added) { return 1; }
+    for(i = 0; i < s->added_slots; i++) {
+        store_slot* from = s->added + i;
+        size_t k;
+        if(!from->offset) { continue; }
+        for(k = (size_t)from->id & (slots - 1); added[k].offset; k = (k + 1) & (slots - 1)) {}
+        added[k] = *from;
+    }
+    if(s->added) { free(s->added); }
+    s->added = added;
+    s->added_slots = slots;
+    return 0;
+}
+
+//
+// Find the bulk in the store, appending it if it isn't there yet, and get its
+// ID
+//
+// *stored is set to zero if the ID is taken by a different bulk, in which
+// case the sector has to be kept in the file instead.
+//
+// Returns nonzero on error
+//
+static int8_t store_put(ecm_store* s, int8_t bulk, const uint8_t* data, off_t* id, int8_t* stored) {
+    uint8_t entry[1 + 0x918];
+    size_t size = sector_types[bulk].stored[0][1];
+    off_t offset;
+    size_t k;
+
+    *id = bulk_id(bulk, data);
+    if(store_find(s, *id, &offset)) {
+        if(store_fetch(s, offset, entry, 1 + size)) { goto error; }
+        *stored = (entry[0] == bulk && !memcmp(entry + 1, data, size));
+        return 0;
+    }
+    if(s->added_count >= s->added_slots / 2 && store_grow(s)) {
+        printf("Out of memory\n");
+        return 1;
+    }
+    if(fputc(bulk, s->append) == EOF || fwrite(data, 1, size, s->append) != size) { goto error; }
+    for(k = (size_t)*id & (s->added_slots - 1); s->added[k].offset; k = (k + 1) & (s->added_slots - 1)) {}
+    s->added[k].id = *id;
+    s->added[k].offset = s->pack_size;
+    s->added_count++;
+    s->pack_size += (off_t)(1 + size);
+    *stored = 1;
+    return 0;
+
+error:
+    printfileerror(NULL, s->pack_name);
+    return 1;
+}
+
+static int store_slot_compare(const void* a, const void* b) {
+    off_t x = ((const store_slot*)a)->id;
+    off_t y = ((const store_slot*)b)->id;
+    return x < y ? -1 : x > y;
+}
+
+//
+// Make the entries added to the pack part of the store: write the index with
+// them merged in next to the old one, then put it in the old one's place
+//
+// Returns nonzero on error
+//
+static int8_t store_commit(ecm_store* s) {
+    int8_t returncode = 0;
+    store_slot* added = NULL; // sorted by ID
+    char* tempname = NULL;
+    FILE* f = NULL;
+    uint8_t buffer[STORE_INDEX_HEADER_SIZE];
+    size_t i;
+    size_t j;
+    size_t n = 0;
+
+    if(!s->added_count) { return 0; }
+
+#ifdef ECM_STORE
+    if(fflush(s->append) != 0 || fsync(s->pack_fd) != 0) {
+        printfileerror(NULL, s->pack_name);
+        goto error;
+    }
+#endif
+
+    added = malloc(s->added_count * sizeof(store_slot));
+    tempname = malloc(strlen(s->index_name) + 5);
+    if(!added || !tempname) {
+        printf("Out of memory\n");
+        goto error;
+    }
+    for(i = 0; i < s->added_slots; i++) {
+        if(s->added[i].offset) { added[n++] = s->added[i]; }
+    }
+    qsort(added, n, sizeof(store_slot), store_slot_compare);
+
+    strcpy(tempname, s->index_name);
+    strcat(tempname, ".new");
+    f = fopen(tempname, "wb");
+    if(!f) { goto error_index; }
+
+    memcpy(buffer, store_index_magic, 4);
+    put32lsb(buffer + 4, STORE_VERSION);
+    put64lsb(buffer + 8, (off_t)(s->entries + n));
+    put64lsb(buffer + 16, s->pack_size);
+    if(fwrite(buffer, 1, STORE_INDEX_HEADER_SIZE, f) != STORE_INDEX_HEADER_SIZE) { goto error_index; }
+
+    for(i = 0, j = 0; i < s->entries || j < n; ) {
+        const uint8_t* old = s->index + STORE_INDEX_HEADER_SIZE + i * STORE_ENTRY_SIZE;
+        if(i < s->entries && (j == n || get64lsb(old) < added[j].id)) {
+            if(fwrite(old, 1, STORE_ENTRY_SIZE, f) != STORE_ENTRY_SIZE) { goto error_index; }
+            i++;
+        } else {
+            put64lsb(buffer, added[j].id);
+            put64lsb(buffer + 8, added[j].offset);
+            if(fwrite(buffer, 1, STORE_ENTRY_SIZE, f) != STORE_ENTRY_SIZE) { goto error_index; }
+            j++;
+        }
+    }
+    if(fflush(f) != 0) { goto error_index; }
+#ifdef ECM_STORE
+    if(fsync(fileno(f)) != 0) { goto error_index; }
+#endif
+    if(fclose(f) != 0) {
+        f = NULL;
+        goto error_index;
+    }
+    f = NULL;
+    if(rename(tempname, s->index_name) != 0) { goto error_index; }
+
+    //
+    // The new entries are safe now
+    //
+    s->covered = s->pack_size;
+    s->added_count = 0;
+
+    returncode = 0;
+    goto done;
+
+error_index:
+    printfileerror(NULL, tempname);
+    goto error;
+
+error:
+    returncode = 1;
+    goto done;
+
+done:
+    if(f) {
+        fclose(f);
+        remove(tempname);
+    }
+    if(added) { free(added); }
+    if(tempname) { free(tempname); }
+    return returncode;
+}
+
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Base image
+//
+// With --base=FILE, an image is encoded as a delta against another one,
+// already encoded: a sector whose bulk the base image's ECM file holds as-is
+// becomes a reference to where it is in that file, so revisions of a disc
+// take about as much space as the sectors that changed.  The file names the
+// base by the size of its ECM file and the size and EDC of its image (the
+// "BASE" section), and decoding needs that same file.
+//
+// The encoder finds bulks in the base through an index of their hashes,
+// sorted by hash, taking the one at the same place in the image if there are
+// several; as with repeats, a match is only taken once it's been compared.
+//
+static FILE*    base_file = NULL;
+static off_t    base_file_size;
+static off_t    base_size;  // of the image
+static uint32_t base_edc;   // of the image
+#ifdef ECM_THREADS
+static pthread_mutex_t base_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+typedef struct {
+    uint64_t hash;
+    off_t    offset;   // of the bulk in the base's ECM file
+    off_t    position; // of the bulk in the image, not counting subchannel data
+    int8_t   bulk;
+} base_entry;
+
+static base_entry* base_index = NULL;
+static size_t      base_entries = 0;
+
+//
+// Read a bulk of the given type from the base's ECM file into sector
+//
+// Returns nonzero on error
+//
+static int8_t base_read(int8_t bulk, off_t offset, uint8_t* sector) {
+    const sector_type* b = sector_types + bulk;
+    int8_t ok;
+    if(!base_file || offset < 4 || offset > base_file_size - (off_t)b->stored[0][1]) { return 1; }
+#ifdef ECM_THREADS
+    pthread_mutex_lock(&base_mutex);
+#endif
+    ok =
+        fseeko(base_file, offset, SEEK_SET) == 0 &&
+        fread(sector + b->stored[0][0], 1, b->stored[0][1], base_file) == b->stored[0][1];
+#ifdef ECM_THREADS
+    pthread_mutex_unlock(&base_mutex);
+#endif
+    return !ok;
+}
+
+static int base_entry_compare(const void* a, const void* b) {
+    const base_entry* x = (const base_entry*)a;
+    const base_entry* y = (const base_entry*)b;
+    if(x->hash != y->hash) { return x->hash < y->hash ? -1 : 1; }
+    return (x->offset > y->offset) - (x->offset < y->offset);
+}
+
+#ifndef ECM_NO_MAIN
+
+//
+// What's wrong, for DECODE_BASE
+//
+static const char* base_problem(void) {
+    return base_file ?
+        "the base image given isn't the one it was encoded against" :
+        "encoded against a base image; give it with --base=FILE";
+}
+
+//
+// Look for the bulk of a sector, from the given position in the image, in the
+// base
+//
+// Returns nonzero if it's there, with its offset in the base's ECM file
+//
+static int8_t base_find(int8_t bulk, const uint8_t* data, off_t position, off_t* offset) {
+    uint8_t sector[2352];
+    size_t size = sector_types[bulk].stored[0][1];
+    uint64_t hash = bulk_hash64((uint64_t)bulk, data, size);
+    size_t low = 0;
+    size_t high = base_entries;
+    size_t first;
+    size_t i;
+    int pass;
+
+    while(low < high) {
+        size_t middle = low + (high - low) / 2;
+        if(base_index[middle].hash < hash) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    first = low;
+
+    //
+    // The one at the same place first, then any other
+    //
+    for(pass = 0; pass < 2; pass++) {
+        for(i = first; i < base_entries && base_index[i].hash == hash; i++) {
+            const base_entry* e = base_index + i;
+            if(e->bulk != bulk || (e->position == position) != (pass == 0)) { continue; }
+            if(
+                !base_read(bulk, e->offset, sector) &&
+                !memcmp(sector + sector_types[bulk].stored[0][0], data, size)
+            ) {
+                *offset = e->offset;
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+//
+// Write the "BASE" section naming the base image
+//
+// Returns nonzero on error
+//
+static int8_t writer_base(ecm_writer* w) {
+    uint8_t data[ECM_BASE_SIZE];
+    put64lsb(data, base_file_size);
+    put64lsb(data + 8, base_size);
+    put32lsb(data + 16, base_edc);
+    return writer_section(w, "BASE", data, sizeof(data));
+}
+
+//
+// Check whether this looks like an image of 2448-byte sectors: more of the
+// first few have a sync pattern or a valid Q channel at that spacing than
+// have a sync pattern at 2352 bytes
+//
+// Returns nonzero if so
+//
+static int8_t detect_subchannel_image(ecm_input* in, off_t length) {
+    static const uint8_t sync[12] = {
+        0x00, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x00
+    };
+    uint8_t sector[2448];
+    off_t sample = length / 2448;
+    off_t k;
+    int votes_2448 = 0;
+    int votes_2352 = 0;
+
+    if(length == 0 || length % 2448 != 0) { return 0; }
+    if(sample > 16) { sample = 16; }
+    for(k = 0; k < sample; k++) {
+        if(!input_peek(in, k * 2448, sector, 2448)) { return 0; }
+        if(!memcmp(sector, sync, 12) || subchannel_layout(sector + 2352) >= 0) {
+            votes_2448++;
+        }
+        if(!input_peek(in, k * 2352, sector, 12)) { return 0; }
+        if(!memcmp(sector, sync, 12)) {
+            votes_2352++;
+        }
+    }
+    return votes_2448 * 2 >= sample && votes_2448 > votes_2352;
+}
+
+//
+// Check whether this looks like an image of 2048-byte sectors, with no
+// headers: an ISO 9660 volume descriptor at sector 16, and no sync pattern at
+// the start
+//
+// Returns nonzero if so
+//
+static int8_t detect_cooked_image(ecm_input* in, off_t length) {
+    uint8_t buffer[12];
+    if(length < 17 * 2048 || length % 2048 != 0) { return 0; }
+    if(!input_peek(in, 0, buffer, 12)) { return 0; }
+    if(has_sync(buffer)) { return 0; }
+    if(!input_peek(in, 16 * 2048, buffer, 6)) { return 0; }
+    return buffer[0] == 0x01 && !memcmp(buffer + 1, "CD001", 5);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Write count codes of a run's form map, starting at code first, as the map
+// of a record
+//
+// Returns nonzero on error
+//
+static int8_t write_form_map(ecm_writer* w, const uint8_t* forms, uint32_t first, uint32_t count) {
+    uint8_t buffer[64];
+    size_t n = 0;
+    uint32_t i;
+    memset(buffer, 0, sizeof(buffer));
+    for(i = 0; i < count; i++) {
+        buffer[n] |= (uint8_t)(form_code(forms, first + i) << ((i & 3) * 2));
+        if((i & 3) == 3 || i == count - 1) {
+            n++;
+            if(n == sizeof(buffer) || i == count - 1) {
+                if(writer_put(w, buffer, n)) { return 1; }
+                memset(buffer, 0, n);
+                n = 0;
+            }
+        }
+    }
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Encode a run of sectors/literals of the same type
+//
+// run_data is the run's form map for TYPE_RAW_MODE2, its fill header for fill
+// types, and its references for repeat types
+//
+// Returns nonzero on error
+//
+static int8_t write_sectors(
+    int8_t type,
+    uint32_t count,
+    const uint8_t* run_data,
+    const char* infilename,
+    ecm_writer* w,
+    ecm_input* in
+) {
+    int8_t returncode = 0;
+    const sector_type* t = sector_types + type;
+    uint8_t* unit = sector_buffer + sizeof(sector_buffer) - t->size;
+    uint8_t address[3]; // address of the current sector, for addressed types
+    uint32_t done = 0;  // sectors of the run written in earlier records
+    uint32_t i;
+    double span = trace_begin();
+    off_t span_offset = trace_file ? in->pos : 0;
+
+    while(count) {
+        //
+        // Split the run where it crosses into a new block
+        //
+        uint32_t n;
+        if(writer_room(w, t->size, &n)) { goto error; }
+        if(n > count) { n = count; }
+        if(write_type_count(w, type, n)) { goto error; }
+        count -= n;
+        done += n;
+
+        if(type == 0) {
+            while(n) {
+                uint32_t b = n;
+                if(b > sizeof(sector_buffer)) { b = sizeof(sector_buffer); }
+                if(!input_read(in, sector_buffer, b)) { goto error_in; }
+                if(writer_literal(w, sector_buffer, b)) { goto error; }
+                n -= b;
+                setcounter_encode(in->pos);
+            }
+            continue;
+        }
+        for(i = 0; i < n; i++) {
+            int8_t form = type; // type whose parts are stored
+            unsigned k;
+            if(!input_read(in, unit, t->size)) { goto error_in; }
+            if(is_patched(type)) {
+                uint8_t payload[PATCH_MAX_PAYLOAD];
+                size_t length = patch_encode(type, unit, payload);
+                if(!length) {
+                    printf("%s: changed while being encoded\n", infilename);
+                    goto error;
+                }
+                if(writer_put(w, payload, length)) { goto error; }
+                writer_decoded(w, unit, t->size);
+                if(verify_enabled) {
+                    if(verify_add(type, unit, t->size, in->pos - t->size, NULL, type)) { goto error; }
+                }
+                setcounter_encode(in->pos);
+                continue;
+            }
+            if(t->addressed) {
+                if(i == 0) {
+                    //
+                    // Only the first address of each record is stored
+                    //
+                    memcpy(address, sector_buffer + 0x00C, 3);
+                    if(writer_put(w, address, 3)) { goto error; }
+                    if(type == TYPE_RAW_MODE2 && write_form_map(w, run_data, done - n, n)) { goto error; }
+                } else {
+                    msf_add(address, 1, address);
+                }
+            }
+            if(type == TYPE_RAW_MODE2) {
+                form = raw_form_types[form_code(run_data, done - n + i)];
+            }
+            if(is_fill(type)) {
+                form = (int8_t)run_data[0];
+                if(i == 0 && writer_put(w, run_data, FILL_HEADER_SIZE)) { goto error; }
+            } else if(is_reference(type)) {
+                const uint8_t* reference = run_data + (size_t)(done - n + i) * REPEAT_UNIT_SIZE;
+                form = (int8_t)reference[0];
+                if(writer_put(w, reference, REPEAT_UNIT_SIZE)) { goto error; }
+            } else {
+                int8_t bulk = bulk_type(form, 0);
+                for(k = 0; k < 2; k++) {
+                    const size_t* part = sector_types[form].stored[k];
+                    if(part[1] && writer_put(w, sector_buffer + part[0], part[1])) { goto error; }
+                }
+                if(dedupe_table && bulk) {
+                    //
+                    // The bulk is always the last part stored
+                    //
+                    const uint8_t* data = bulk_of(bulk, unit, t->size);
+                    dedupe_written(bulk, data,
+                        in->pos - t->size + (data - unit),
+                        writer_tell(w) - (off_t)sector_types[bulk].stored[0][1]
+                    );
+                }
+            }
+            writer_decoded(w, unit, t->size);
+            if(verify_enabled) {
+                if(verify_add(type, unit, t->size, in->pos - t->size,
+                    t->addressed ? address : NULL, form
+                )) { goto error; }
+            }
+            setcounter_encode(in->pos);
+        }
+    }
+    trace_end("write_sectors", span, 0, span_offset, in->pos - span_offset);
+    //
+    // Success
+    //
+    returncode = 0;
+    goto done;
+
+error_in:
+    printfileerror(in->f, infilename);
+    goto error;
+
+error:
+    returncode = 1;
+    goto done;
+
+done:
+    return returncode;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Cue sheets (bin2ecm --cue=FILE)
+//
+// A cue sheet says where each track of an image starts and what mode it is.
+// With one, the encoder sends AUDIO tracks straight through as literal bytes,
+// and checks data tracks only where their sectors start (and 16 bytes in, for
+// mode 2 sectors kept as header plus body), instead of at every byte.  Each
+// sector found is still checked like any other, so a wrong cue sheet costs
+// only compression.  Only the FILE, TRACK and INDEX commands matter here.
+//
+// A track's sectors in its file start at its first INDEX; for an AUDIO track,
+// only those from INDEX 01 on are taken as audio, since a pregap before it is
+// often data.
+//
+// Given a cue sheet to encode (bin2ecm foo.cue), the encoder takes its files
+// one after another as the image, and keeps the sheet and the names and sizes
+// of the files in the ECM file, the "CUES" and "TRKS" sections; decoding it
+// gives back the sheet and its files.  File names must then be plain names,
+// without directories, and the files are next to the sheet.
+//
+#define CUE_TOKEN_SIZE 1024
+
+typedef struct {
+    uint8_t  number;
+    uint16_t sector_size; // bytes per sector in its file
+    int8_t   audio;
+    size_t   file;        // which FILE it's in
+    int32_t  start;       // frame of its first index in its file
+    int32_t  index1;      // frame of INDEX 01
+} cue_track;
+
+typedef struct {
+    char*      text;      // the whole sheet, as read
+    size_t     text_size;
+    char**     files;     // FILE names, as given
+    size_t     file_count;
+    off_t*     sizes;     // from a "TRKS" section: size of each FILE
+    cue_track* tracks;
+    size_t     track_count;
+} cue_sheet;
+
+#define CUE_AUDIO 1 // literal bytes
+#define CUE_DATA  2 // sectors from the start, one after another
+
+typedef struct {
+    off_t    start;
+    off_t    end;
+    int8_t   kind;
+} cue_region;
+
+typedef struct {
+    cue_region* regions; // in order, not overlapping
+    size_t   count;
+    size_t   cursor;     // region of the last lookup
+} cue_layout;
+
+static void cue_free(cue_sheet* c) {
+    size_t i;
+    for(i = 0; i < c->file_count; i++) { free(c->files[i]); }
+    if(c->files) { free(c->files); }
+    if(c->sizes) { free(c->sizes); }
+    if(c->tracks) { free(c->tracks); }
+    if(c->text) { free(c->text); }
+    memset(c, 0, sizeof(*c));
+}
+
+//
+// Get the next word of a line, or a quoted string
+//
+// Returns nonzero if there was one
+//
+static int8_t cue_token(const char** p, char* token) {
+    const char* s = *p;
+    size_t n = 0;
+    while(*s == ' ' || *s == '\t') { s++; }
+    if(!*s) { return 0; }
+    if(*s == '"') {
+        for(s++; *s && *s != '"'; s++) {
+            if(n < CUE_TOKEN_SIZE - 1) { token[n++] = *s; }
+        }
+        if(*s) { s++; }
+    } else {
+        for(; *s && *s != ' ' && *s != '\t'; s++) {
+            if(n < CUE_TOKEN_SIZE - 1) { token[n++] = *s; }
+        }
+    }
+    token[n] = 0;
+    *p = s;
+    return 1;
+}
+
+//
+// Parse "MM:SS:FF" into frames
+//
+// Returns nonzero on error
+//
+static int8_t cue_time(const char* s, int32_t* frames) {
+    unsigned m, sec, f;
+    char extra;
+    if(sscanf(s, "%u:%u:%u%c", &m, &sec, &f, &extra) != 3 || sec >= 60 || f >= 75 || m > 9999) {
+        return 1;
+    }
+    *frames = (int32_t)((m * 60 + sec) * 75 + f);
+    return 0;
+}
+
+//
+// Parse the text of a cue sheet, c->text; filename is for messages, which
+// are left out if it's NULL.  If the files are known already (c->sizes is
+// set), the FILE commands must name them in order.
+//
+// Returns nonzero on error
+//
+static int8_t cue_parse(cue_sheet* c, const char* filename) {
+    char* line = NULL;
+    char* token = NULL;
+    const char* p;
+    size_t line_number = 0;
+    size_t file_number = 0;
+    cue_track* track = NULL;
+
+    line = malloc(c->text_size + 1);
+    token = malloc(CUE_TOKEN_SIZE);
+    if(!line || !token) {
+        printf("Out of memory\n");
+        goto error;
+    }
+
+    for(p = c->text; *p; ) {
+        size_t length = strcspn(p, "\r\n");
+        const char* s = line;
+        memcpy(line, p, length);
+        line[length] = 0;
+        p += length;
+        if(*p == '\r') { p++; }
+        if(*p == '\n') { p++; }
+        line_number++;
+
+        if(!cue_token(&s, token)) { continue; }
+        if(!strcmp(token, "FILE")) {
+            char** files;
+            if(!cue_token(&s, token)) { goto error_syntax; }
+            file_number++;
+            track = NULL;
+            if(c->sizes) {
+                if(file_number > c->file_count || strcmp(c->files[file_number - 1], token)) {
+                    goto error_syntax;
+                }
+                continue;
+            }
+            files = realloc(c->files, (c->file_count + 1) * sizeof(char*));
+            if(!files) {
+                printf("Out of memory\n");
+                goto error;
+            }
+            c->files = files;
+            c->files[c->file_count] = malloc(strlen(token) + 1);
+            if(!c->files[c->file_count]) {
+                printf("Out of memory\n");
+                goto error;
+            }
+            strcpy(c->files[c->file_count++], token);
+
+        } else if(!strcmp(token, "TRACK")) {
+            cue_track* tracks;
+            unsigned number;
+            char extra;
+            if(
+                !file_number ||
+                !cue_token(&s, token) || sscanf(token, "%u%c", &number, &extra) != 1 ||
+                number < 1 || number > 99
+            ) { goto error_syntax; }
+            tracks = realloc(c->tracks, (c->track_count + 1) * sizeof(cue_track));
+            if(!tracks) {
+                printf("Out of memory\n");
+                goto error;
+            }
+            c->tracks = tracks;
+            track = c->tracks + c->track_count++;
+            memset(track, 0, sizeof(*track));
+            track->number = (uint8_t)number;
+            track->file = file_number - 1;
+            track->start = -1;
+            track->index1 = -1;
+            if(!cue_token(&s, token)) { goto error_syntax; }
+            if(!strcmp(token, "AUDIO")) {
+                track->audio = 1;
+                track->sector_size = 2352;
+            } else if(!strcmp(token, "CDG")) {
+                track->sector_size = 2448;
+            } else {
+                const char* slash = strchr(token, '/');
+                unsigned size;
+                if(!slash || sscanf(slash + 1, "%u%c", &size, &extra) != 1 || size < 2048 || size > 2448) {
+                    goto error_syntax;
+                }
+                track->sector_size = (uint16_t)size;
+            }
+
+        } else if(!strcmp(token, "INDEX")) {
+            unsigned number;
+            int32_t frames;
+            char extra;
+            if(
+                !track ||
+                !cue_token(&s, token) || sscanf(token, "%u%c", &number, &extra) != 1 ||
+                !cue_token(&s, token) || cue_time(token, &frames)
+            ) { goto error_syntax; }
+            if(track->start < 0) { track->start = frames; }
+            if(number == 1) { track->index1 = frames; }
+        }
+    }
+
+    if(!c->track_count || file_number != c->file_count) {
+        if(filename) { printf("Error: %s: no tracks\n", filename); }
+        goto error;
+    }
+    for(line_number = 0; line_number < c->track_count; line_number++) {
+        track = c->tracks + line_number;
+        if(track->index1 < 0) {
+            if(filename) { printf("Error: %s: track %u has no INDEX 01\n", filename, (unsigned)track->number); }
+            goto error;
+        }
+    }
+
+    free(line);
+    free(token);
+    return 0;
+
+error_syntax:
+    if(filename) { printf("Error: %s: line %lu: can't make sense of it\n", filename, (unsigned long)line_number); }
+
+error:
+    if(line) { free(line); }
+    if(token) { free(token); }
+    return 1;
+}
+
+//
+// Read and parse a cue sheet
+//
+// Returns nonzero on error, with a message
+//
+static int8_t cue_load(cue_sheet* c, const char* filename) {
+    FILE* f;
+    size_t alloc = 0;
+
+    memset(c, 0, sizeof(*c));
+    f = fopen(filename, "rb");
+    if(!f) { goto error_in; }
+    for(;;) {
+        size_t got;
+        if(grow_buffer((uint8_t**)&c->text, &alloc, c->text_size + 0x1000 + 1)) { goto error; }
+        got = fread(c->text + c->text_size, 1, alloc - c->text_size - 1, f);
+        c->text_size += got;
+        if(got == 0) { break; }
+    }
+    if(ferror(f)) { goto error_in; }
+    c->text[c->text_size] = 0;
+    fclose(f);
+    f = NULL;
+
+    if(cue_parse(c, filename)) { goto error; }
+    return 0;
+
+error_in:
+    printfileerror(f, filename);
+
+error:
+    if(f) { fclose(f); }
+    cue_free(c);
+    return 1;
+}
+
+//
+// Whether a FILE name is fit to go in a container: a plain name, so decoding
+// only ever writes next to the sheet
+//
+static int8_t cue_plain_name(const char* name) {
+    return
+        name[0] && strcmp(name, ".") && strcmp(name, "..") &&
+        !strchr(name, '/') && !strchr(name, '\\') && !strchr(name, ':');
+}
+
+//
+// Path of a file named in a cue sheet: next to the sheet
+//
+// Returns a string to free, or NULL if out of memory
+//
+static char* cue_path(const char* cuefilename, const char* name) {
+    size_t directory = 0;
+    size_t i;
+    char* path;
+    for(i = 0; cuefilename[i]; i++) {
+        if(cuefilename[i] == '/' || cuefilename[i] == '\\') { directory = i + 1; }
+    }
+    path = malloc(directory + strlen(name) + 1);
+    if(!path) { return NULL; }
+    memcpy(path, cuefilename, directory);
+    strcpy(path + directory, name);
+    return path;
+}
+
+//
+// Open the files of a cue sheet to read them as one image
+//
+// Returns nonzero on error, with a message
+//
+static int8_t input_set_open(input_set* set, const cue_sheet* c, const char* cuefilename) {
+    size_t i;
+    memset(set, 0, sizeof(*set));
+    set->files  = calloc(c->file_count, sizeof(FILE*));
+    set->starts = calloc(c->file_count + 1, sizeof(off_t));
+    if(!set->files || !set->starts) {
+        printf("Out of memory\n");
+        return 1;
+    }
+    set->count = c->file_count;
+    for(i = 0; i < c->file_count; i++) {
+        char* path = cue_path(cuefilename, c->files[i]);
+        off_t size;
+        if(!path) {
+            printf("Out of memory\n");
+            return 1;
+        }
+        set->files[i] = fopen(path, "rb");
+        if(
+            !set->files[i] ||
+            fseeko(set->files[i], 0, SEEK_END) != 0 ||
+            (size = ftello(set->files[i])) < 0 ||
+            fseeko(set->files[i], 0, SEEK_SET) != 0
+        ) {
+            printfileerror(NULL, path);
+            free(path);
+            return 1;
+        }
+        free(path);
+        set->starts[i + 1] = set->starts[i] + size;
+    }
+    return 0;
+}
+
+static void input_set_close(input_set* set) {
+    size_t i;
+    for(i = 0; set->files && i < set->count; i++) {
+        if(set->files[i]) { fclose(set->files[i]); }
+    }
+    if(set->files) { free(set->files); }
+    if(set->starts) { free(set->starts); }
+    memset(set, 0, sizeof(*set));
+}
+
+//
+// Write the "CUES" and "TRKS" sections, for files of the given sizes
+//
+// Returns nonzero on error
+//
+static int8_t writer_cue(ecm_writer* w, const cue_sheet* c, const off_t* starts) {
+    uint8_t* table = NULL;
+    size_t alloc = 0;
+    size_t used = 4;
+    size_t i;
+    int8_t failed;
+    if(writer_section(w, "CUES", (const uint8_t*)c->text, c->text_size)) { return 1; }
+    if(grow_buffer(&table, &alloc, used)) { return 1; }
+    put32lsb(table, (uint32_t)c->file_count);
+    for(i = 0; i < c->file_count; i++) {
+        size_t length = strlen(c->files[i]);
+        if(grow_buffer(&table, &alloc, used + 12 + length)) {
+            free(table);
+            return 1;
+        }
+        put64lsb(table + used, starts[i + 1] - starts[i]);
+        put32lsb(table + used + 8, (uint32_t)length);
+        memcpy(table + used + 12, c->files[i], length);
+        used += 12 + length;
+    }
+    failed = writer_section(w, "TRKS", table, used);
+    free(table);
+    return failed;
+}
+
+//
+// Which FILE of the sheet an image is: the only one, or else the one with the
+// same name, leaving out directories
+//
+// Returns the number of the FILE, or -1 if none matches
+//
+static int cue_find_file(const cue_sheet* c, const char* imagename) {
+    const char* name = imagename;
+    const char* s;
+    size_t i;
+    if(c->file_count == 1) { return 0; }
+    for(s = imagename; *s; s++) {
+        if(*s == '/' || *s == '\\') { name = s + 1; }
+    }
+    for(i = 0; i < c->file_count; i++) {
+        const char* file = c->files[i];
+        for(s = c->files[i]; *s; s++) {
+            if(*s == '/' || *s == '\\') { file = s + 1; }
+        }
+        if(!strcmp(file, name)) { return (int)i; }
+    }
+    return -1;
+}
+
+static void cue_layout_free(cue_layout* l) {
+    if(l->regions) { free(l->regions); }
+    memset(l, 0, sizeof(*l));
+}
+
+//
+// Work out the regions of one FILE of a cue sheet, length bytes long (not
+// counting subchannel data); or with file negative, of all of them one after
+// another, each starting where starts says (and the last ending at length)
+//
+// Returns nonzero if the sheet has tracks this can't handle (not of 2352-byte
+// sectors) or doesn't fit the file, with a message
+//
+static int8_t cue_layout_build(cue_layout* l, const cue_sheet* c, int file, const off_t* starts, off_t length) {
+    size_t i;
+    memset(l, 0, sizeof(*l));
+    l->regions = malloc((2 * c->track_count + 1) * sizeof(cue_region));
+    if(!l->regions) {
+        printf("Out of memory\n");
+        return 1;
+    }
+    for(i = 0; i < c->track_count; i++) {
+        const cue_track* t = c->tracks + i;
+        off_t base = 0;
+        off_t start;
+        off_t index1;
+        off_t end = length;
+        size_t k;
+        if(file >= 0 && t->file != (size_t)file) { continue; }
+        if(t->sector_size != 2352) {
+            printf("Not using the cue sheet: track %u isn't of 2352-byte sectors\n", (unsigned)t->number);
+            goto error;
+        }
+        if(file < 0) {
+            base = starts[t->file];
+            end = (t->file + 1 < c->file_count) ? starts[t->file + 1] : length;
+        }
+        for(k = i + 1; k < c->track_count; k++) {
+            if(c->tracks[k].file == t->file) {
+                end = base + ((off_t)c->tracks[k].start) * 2352;
+                break;
+            }
+        }
+        start  = base + ((off_t)t->start) * 2352;
+        index1 = base + ((off_t)t->index1) * 2352;
+        if(
+            index1 < start || end < index1 || end > length ||
+            (l->count && l->regions[l->count - 1].end > start)
+        ) {
+            printf("Not using the cue sheet: it doesn't fit the image\n");
+            goto error;
+        }
+        if(start < index1) {
+            l->regions[l->count].start = start;
+            l->regions[l->count].end   = index1;
+            l->regions[l->count].kind  = CUE_DATA;
+            l->count++;
+        }
+        l->regions[l->count].start = index1;
+        l->regions[l->count].end   = end;
+        l->regions[l->count].kind  = t->audio ? CUE_AUDIO : CUE_DATA;
+        l->count++;
+    }
+    if(!l->count) {
+        printf("Not using the cue sheet: it has no tracks for this file\n");
+        goto error;
+    }
+    return 0;
+
+error:
+    cue_layout_free(l);
+    return 1;
+}
+
+//
+// What the cue sheet says about the given position; offsets must not go down
+// from one call to the next
+//
+// Returns nonzero if the byte there is literal, with *skip set to how many
+// bytes after it are too
+//
+static int8_t cue_literal(cue_layout* l, off_t offset, uint32_t* skip) {
+    const cue_region* r;
+    off_t next;
+    if(!l) { return 0; }
+    while(l->cursor < l->count && l->regions[l->cursor].end <= offset) { l->cursor++; }
+    if(l->cursor == l->count) { return 0; }
+    r = l->regions + l->cursor;
+    if(offset < r->start) { return 0; }
+    if(r->kind == CUE_AUDIO) {
+        next = r->end;
+    } else {
+        off_t at = (offset - r->start) % 2352;
+        if(at == 0 || at == 0x10) { return 0; }
+        next = offset - at + (at < 0x10 ? 0x10 : 2352);
+        if(next > r->end) { next = r->end; }
+    }
+    next -= offset + 1;
+    *skip = (next > 0x7FFFFFFF) ? 0x7FFFFFFF : (uint32_t)next;
+    return 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Sharded encoding (bin2ecm --range=START:LEN, bin2ecm --merge)
+//
+// Nearly all the work of encoding is checking positions of the input for
+// sectors that rebuild from their parts.  A shard does only that, for one
+// slice of the input, and saves what it found as a partial.  The merge then
+// encodes the whole input with the partials standing in for those checks, so
+// its output is the same as a single encode; runs, blocks, fills, repeats and
+// the shared store depend on everything before them, so they're left to it.
+//
+// Each position checked gets a code: PROBE_RAW plus the form code plus 1 for
+// a whole mode 2 sector, or else what detect_sector returned.  A partial is:
+//
+//   "ECMS", u32 format version, u64 input file size, u64 start, u64 end,
+//   u32 EDC of the input from start to end
+//
+// followed, to the end of the file, by segments of u64 offset, u32 count and
+// u8 code.  A segment with code 0 means each of count bytes from offset was
+// checked and is no sector; any other, that count units of the code's size
+// were found one after another from offset.  Offsets leave out subchannel
+// data, as the encoder sees the input.  A shard checks from start until it
+// reaches end, so the last unit it finds can run past end.
+//
+// A shard starts out without knowing what came before start, so its path
+// through the data can be out of step with the merge's for a while; the merge
+// checks any position the partials don't cover itself.  The merge checks each
+// slice of the input it reads against the EDC of the partial for it, and if
+// the partials cover the input end to end, the input's EDC against theirs
+// combined, so partials of another image of the same size are refused.
+//
+#define PROBE_RAW            0x80
+#define PARTIAL_HEADER_SIZE  36
+#define PARTIAL_SEGMENT_SIZE 13
+
+typedef struct {
+    off_t    offset;
+    uint32_t count;
+    uint8_t  code;
+} probe_segment;
+
+typedef struct {
+    off_t    start;
+    off_t    end;
+    uint32_t edc;
+    probe_segment* segments;
+    size_t   count;
+    size_t   cursor; // first segment that may still be looked up
+    const char* filename;  // partials only
+    uint32_t input_edc;    // EDC of the input read so far from start to end
+    off_t    input_seen;
+} probe_map;
+
+typedef struct {
+    probe_map* maps; // sorted by start
+    size_t   count;
+    size_t   last;   // map of the last hit
+    int8_t   tiled;  // the maps cover the input end to end
+    int8_t   expected; // from an ECM file's records: edc is what the input's
+                       // must come to
+    uint32_t edc;    // tiled: EDC of the input
+} probe_cache;
+
+static off_t probe_unit_size(uint8_t code) {
+    if(code & PROBE_RAW) { return 2352; }
+    return code ? (off_t)sector_types[code].size : 1;
+}
+
+//
+// Look up what checking the given position found; offsets must not go down
+// from one call to the next
+//
+// Returns nonzero if a partial has it
+//
+static int8_t probe_lookup(probe_cache* c, off_t offset, uint8_t* code) {
+    size_t i;
+    if(!c) { return 0; }
+    for(i = 0; i < c->count; i++) {
+        size_t k = (c->last + i) % c->count;
+        probe_map* m = c->maps + k;
+        const probe_segment* s;
+        off_t size;
+        while(m->cursor < m->count) {
+            s = m->segments + m->cursor;
+            if(s->offset + (off_t)s->count * probe_unit_size(s->code) > offset) { break; }
+            m->cursor++;
+        }
+        if(m->cursor == m->count) { continue; }
+        s = m->segments + m->cursor;
+        size = probe_unit_size(s->code);
+        if(offset < s->offset || (offset - s->offset) % size) { continue; }
+        //
+        // A partial's EDC covers only its slice, so a unit that runs past the
+        // end of it is checked again
+        //
+        if(m->filename && offset + size > m->end) { continue; }
+        *code = s->code;
+        c->last = k;
+        return 1;
+    }
+    return 0;
+}
+
+//
+// detect_raw_mode2, taking the type of the body from the cache if it has
+// that, and the header checks out
+//
+static int8_t probe_raw_mode2(probe_cache* c, off_t offset, const uint8_t* sector, size_t size_available) {
+    uint8_t code;
+    if(
+        probe_lookup(c, offset + 0x010, &code) &&
+        !(code & PROBE_RAW) && (!code || sector_types[code].size == 2336)
+    ) {
+        return has_raw_mode2_header(sector, size_available) ? raw_form_of((int8_t)code) : 0;
+    }
+    return detect_raw_mode2(sector, size_available);
+}
+
+static void probe_cache_free(probe_cache* c) {
+    size_t i;
+    for(i = 0; i < c->count; i++) {
+        if(c->maps[i].segments) { free(c->maps[i].segments); }
+    }
+    if(c->maps) { free(c->maps); }
+    memset(c, 0, sizeof(*c));
+}
+
+//
+// Add count units of the given probe code at offset to a map, joining them to
+// the last segment if they follow on from it
+//
+// Returns nonzero on error, with a message
+//
+static int8_t probe_map_add(probe_map* m, size_t* alloc, off_t offset, uint32_t count, uint8_t code) {
+    probe_segment* s = m->count ? m->segments + m->count - 1 : NULL;
+    if(
+        s && s->code == code && s->count <= 0xFFFFFFFFu - count &&
+        s->offset + (off_t)s->count * probe_unit_size(code) == offset
+    ) {
+        s->count += count;
+        return 0;
+    }
+    if(m->count == *alloc) {
+        size_t n = *alloc ? *alloc * 2 : 256;
+        probe_segment* p = realloc(m->segments, n * sizeof(probe_segment));
+        if(!p) {
+            printf("Out of memory\n");
+            return 1;
+        }
+        m->segments = p;
+        *alloc = n;
+    }
+    s = m->segments + m->count++;
+    s->offset = offset;
+    s->count = count;
+    s->code = code;
+    return 0;
+}
+
+static int probe_map_compare(const void* a, const void* b) {
+    off_t x = ((const probe_map*)a)->start;
+    off_t y = ((const probe_map*)b)->start;
+    return (x > y) - (x < y);
+}
+
+//
+// Load one partial, checking that it was made from a file of the given size
+// for the current format, and that its segments make sense
+//
+// Returns nonzero on error, with a message
+//
+static int8_t probe_map_load(probe_map* m, const char* filename, off_t image_size, off_t length) {
+    uint8_t header[PARTIAL_HEADER_SIZE];
+    uint8_t* segments = NULL;
+    size_t segments_alloc = 0;
+    size_t size = 0;
+    off_t next = 0;
+    size_t i;
+    FILE* f = fopen(filename, "rb");
+
+    if(!f) {
+        printfileerror(NULL, filename);
+        return 1;
+    }
+    if(
+        fread(header, 1, sizeof(header), f) != sizeof(header) ||
+        memcmp(header, "ECMS", 4)
+    ) {
+        printf("Error: %s: not a partial\n", filename);
+        goto error;
+    }
+    if(get32lsb(header + 4) != (uint32_t)format_version || get64lsb(header + 8) != image_size) {
+        printf("Error: %s: made from a different file or for another format\n", filename);
+        goto error;
+    }
+    m->filename = filename;
+    m->start = get64lsb(header + 16);
+    m->end   = get64lsb(header + 24);
+    m->edc   = get32lsb(header + 32);
+
+    for(;;) {
+        size_t got;
+        if(grow_buffer(&segments, &segments_alloc, size + 0x10000)) { goto error; }
+        got = fread(segments + size, 1, segments_alloc - size, f);
+        size += got;
+        if(got == 0) { break; }
+    }
+    if(ferror(f)) {
+        printfileerror(f, filename);
+        goto error;
+    }
+
+    m->count = size / PARTIAL_SEGMENT_SIZE;
+    m->segments = malloc((m->count ? m->count : 1) * sizeof(probe_segment));
+    if(!m->segments) {
+        printf("Out of memory\n");
+        goto error;
+    }
+    for(i = 0; i < m->count; i++) {
+        const uint8_t* p = segments + i * PARTIAL_SEGMENT_SIZE;
+        probe_segment* s = m->segments + i;
+        uint8_t form = (uint8_t)(p[12] & ~PROBE_RAW);
+        s->offset = get64lsb(p);
+        s->count  = get32lsb(p + 8);
+        s->code   = p[12];
+        if(
+            ((s->code & PROBE_RAW) ? (format_version != 2 || form < 1 || form > RAW_FORM_CODES) :
+                (form >= TYPE_COUNT || (form && !sector_types[form].detect))) ||
+            s->count == 0 ||
+            s->offset < next ||
+            s->offset < m->start ||
+            s->offset + (off_t)(s->count - 1) * probe_unit_size(s->code) >= m->end ||
+            s->offset + (off_t)s->count * probe_unit_size(s->code) > length
+        ) { break; }
+        next = s->offset + (off_t)s->count * probe_unit_size(s->code);
+    }
+    if(
+        i < m->count || size % PARTIAL_SEGMENT_SIZE ||
+        m->start < 0 || m->start > m->end || m->end > length
+    ) {
+        printf("Error: %s: damaged partial\n", filename);
+        goto error;
+    }
+
+    free(segments);
+    fclose(f);
+    return 0;
+
+error:
+    if(segments) { free(segments); }
+    fclose(f);
+    return 1;
+}
+
+//
+// Load the partials for an encode of an input file of the given size, length
+// bytes of it not counting subchannel data
+//
+// Returns nonzero on error, with a message
+//
+static int8_t probe_cache_load(probe_cache* c, char** filenames, size_t count, off_t image_size, off_t length) {
+    size_t i;
+    memset(c, 0, sizeof(*c));
+    c->maps = calloc(count, sizeof(probe_map));
+    if(!c->maps) {
+        printf("Out of memory\n");
+        return 1;
+    }
+    c->count = count;
+    for(i = 0; i < count; i++) {
+        if(probe_map_load(c->maps + i, filenames[i], image_size, length)) { return 1; }
+    }
+    qsort(c->maps, count, sizeof(probe_map), probe_map_compare);
+
+    c->tiled = 1;
+    for(i = 0; i < count; i++) {
+        const probe_map* m = c->maps + i;
+        if(m->start != (i ? c->maps[i - 1].end : 0)) { c->tiled = 0; }
+        c->edc = edc_combine(c->edc, m->edc, m->end - m->start);
+    }
+    if(!count || c->maps[count - 1].end != length) { c->tiled = 0; }
+    return 0;
+}
+
+//
+// Take size bytes of the input read at offset into the EDC of each partial's
+// slice they fall in, and check a slice once all of it has been read
+//
+// Returns nonzero on error, with a message
+//
+static int8_t probe_cache_check(probe_cache* c, const uint8_t* data, off_t offset, size_t size) {
+    size_t i;
+    for(i = 0; i < c->count; i++) {
+        probe_map* m = c->maps + i;
+        off_t from = (offset > m->start) ? offset : m->start;
+        off_t to = (offset + (off_t)size < m->end) ? offset + (off_t)size : m->end;
+        if(from >= to) { continue; }
+        m->input_edc = edc_compute(m->input_edc, data + (size_t)(from - offset), (size_t)(to - from));
+        m->input_seen += to - from;
+        if(m->input_seen == m->end - m->start && m->input_edc != m->edc) {
+            printf("Error: %s: made from a different file\n", m->filename);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+//
+// What the records of an ECM file say about its sectors; defined with the
+// random-access reader, below
+//
+static int8_t probe_cache_from_records(probe_cache* c, ecm_file* f, int8_t subchannel);
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Aligned images
+//
+// Most raw images are 2352-byte sectors end to end.  For those, each batch of
+// input the encoder reads is checked at every 2352 bytes on worker threads
+// before the encoder goes through it, and what's found goes in a probe map,
+// the way a partial's would.  Only where that finds no sector (audio, or
+// sectors that don't line up) does the encoder check byte by byte.
+//
+#define ALIGNED_SAMPLE     16         // leading sectors that must have a sync pattern
+#define ALIGNED_QUEUE_SIZE 0x800000   // bytes read at a time
+
+typedef struct {
+    const uint8_t* data;
+    off_t    offset;    // of data in the input
+    size_t   count;     // sectors
+    size_t   available; // bytes read from data on
+    int8_t   complete;  // that's the rest of the input
+    int8_t   raw_mode2;
+    uint8_t* codes;     // per sector: the code at it, and the type of its
+                        // body, if it has no code of its own
+    unsigned workers;
+} aligned_batch;
+
+//
+// Check whether an image of sectors of the given size (2352, or 2448 with
+// subchannel data) is all whole sectors, and the first few have a sync
+// pattern
+//
+// Returns nonzero if so
+//
+static int8_t detect_aligned_image(ecm_input* in, off_t length, off_t sector_size) {
+    uint8_t buffer[12];
+    off_t k;
+    if(length < ALIGNED_SAMPLE * sector_size || length % sector_size != 0) { return 0; }
+    for(k = 0; k < ALIGNED_SAMPLE; k++) {
+        if(!input_peek(in, k * sector_size, buffer, 12)) { return 0; }
+        if(!has_sync(buffer)) { return 0; }
+    }
+    return 1;
+}
+
+static void aligned_worker(void* context, unsigned index) {
+    aligned_batch* b = (aligned_batch*)context;
+    size_t first = b->count * index / b->workers;
+    size_t last = b->count * (index + 1) / b->workers;
+    double span = trace_begin();
+    size_t i;
+
+    for(i = first; i < last; i++) {
+        const uint8_t* sector = b->data + i * 2352;
+        size_t available = b->available - i * 2352;
+        int8_t form = b->raw_mode2 ? detect_raw_mode2(sector, available) : 0;
+        uint8_t code = form ? (uint8_t)(PROBE_RAW | form) :
+            (uint8_t)detect_sector(sector, available, format_version);
+        uint8_t body = 0;
+        //
+        // A mode 2 body is found 0x10 bytes in; it's only checked here with
+        // as much after it as the encoder will have
+        //
+        if(!code && (b->complete || available >= 0x010 + 2352)) {
+            body = (uint8_t)detect_sector(sector + 0x010, available - 0x010, format_version);
+            if(body && sector_types[body].size != 2336) { body = 0; }
+        }
+        b->codes[i * 2 + 0] = code;
+        b->codes[i * 2 + 1] = body;
+    }
+    trace_end("classify", span, index + 1, b->offset + (off_t)first * 2352, (off_t)(last - first) * 2352);
+}
+
+//
+// Check the whole sectors of available bytes of the input at offset, and add
+// what was found to the cache's one map, dropping what's been looked past
+//
+// Returns nonzero on error, with a message
+//
+static int8_t aligned_classify(
+    probe_cache* c,
+    size_t* alloc,
+    const uint8_t* data,
+    off_t offset,
+    size_t available,
+    int8_t complete,
+    int8_t raw_mode2
+) {
+    probe_map* m = c->maps;
+    aligned_batch b;
+    size_t i;
+
+    if(m->cursor) {
+        memmove(m->segments, m->segments + m->cursor, (m->count - m->cursor) * sizeof(probe_segment));
+        m->count -= m->cursor;
+        m->cursor = 0;
+    }
+
+    b.data      = data;
+    b.offset    = offset;
+    b.count     = available / 2352;
+    b.available = available;
+    b.complete  = complete;
+    b.raw_mode2 = raw_mode2;
+    b.workers   = get_thread_count();
+    if(!b.count) { return 0; }
+    if(b.workers > b.count) { b.workers = (unsigned)b.count; }
+    b.codes = malloc(b.count * 2);
+    if(!b.codes) {
+        printf("Out of memory\n");
+        return 1;
+    }
+    {   PERF_ENTER(PHASE_DETECT);
+        run_workers(aligned_worker, &b, b.workers);
+        PERF_LEAVE();
+    }
+
+    for(i = 0; i < b.count; i++) {
+        off_t sector = offset + (off_t)i * 2352;
+        if(probe_map_add(m, alloc, sector, 1, b.codes[i * 2 + 0])) { goto error; }
+        if(b.codes[i * 2 + 1] && probe_map_add(m, alloc, sector + 0x010, 1, b.codes[i * 2 + 1])) { goto error; }
+    }
+    m->end = offset + (off_t)b.count * 2352;
+    free(b.codes);
+    return 0;
+
+error:
+    free(b.codes);
+    return 1;
+}
+
+//
+// Shard of an encode: check the slice of the input from start for length
+// bytes (to the end, if length is negative) and write what was found
+//
+// Returns nonzero on error
+//
+static int8_t encode_partial(
+    const char* infilename,
+    const char* outfilename,
+    off_t start,
+    off_t length
+) {
+    int8_t returncode = 0;
+
+    ecm_input in;
+    FILE* out = NULL;
+
+    uint8_t* queue = NULL;
+    size_t queue_start_ofs = 0;
+    size_t queue_bytes_available = 0;
+    size_t queue_size = 0x40000;
+
+    off_t image_size;
+    off_t input_file_length; // not counting subchannel data
+    off_t input_bytes_queued;
+    off_t pos;
+    off_t end;
+    off_t segments = 0;
+    uint32_t edc = 0;
+    int8_t cooked = 0;
+
+    //
+    // What the shard last found, standing in for the run ecmify would be in
+    //
+    int8_t prev = 0;
+
+    //
+    // Segment being built
+    //
+    off_t    seg_offset = 0;
+    uint32_t seg_count = 0;
+    uint8_t  seg_code = 0;
+
+    uint8_t header[PARTIAL_HEADER_SIZE];
+    uint8_t segment[PARTIAL_SEGMENT_SIZE];
+
+    memset(&in, 0, sizeof(in));
+
+    queue = malloc(queue_size);
+    if(!queue) {
+        printf("Out of memory\n");
+        goto error;
+    }
+
+    //
+    // Ensure the output file doesn't already exist
+    //
+    out = fopen(outfilename, "rb");
+    if(out) {
+        printf("Error: %s exists; refusing to overwrite\n", outfilename);
+        fclose(out);
+        out = NULL;
+        goto error;
+    }
+
+    in.f = fopen(infilename, "rb");
+    if(!in.f) { goto error_in; }
+
+    if(fseeko(in.f, 0, SEEK_END) != 0) { goto error_in; }
+    image_size = ftello(in.f);
+    if(image_size < 0) { goto error_in; }
+    input_file_length = image_size;
+
+    //
+    // The same choices ecmify makes about the whole file
+    //
+    if(format_version == 2 && detect_subchannel_image(&in, image_size)) {
+        in.subchannel = 1;
+        input_file_length = (image_size / 2448) * 2352;
+    } else if(format_version == 2 && detect_cooked_image(&in, image_size)) {
+        cooked = 1;
+    }
+
+    //
+    // The range is in the file; convert it to positions without subchannel
+    // data
+    //
+    if(start > image_size) { start = image_size; }
+    end = (length < 0 || length > image_size - start) ? image_size : start + length;
+    if(in.subchannel) {
+        start = (start / 2448) * 2352 + (start % 2448 < 2352 ? start % 2448 : 2352);
+        end   = (end   / 2448) * 2352 + (end   % 2448 < 2352 ? end   % 2448 : 2352);
+    }
+
+    out = fopen(outfilename, "wb");
+    if(!out) { goto error_out; }
+
+    printf("Checking ");
+    fprintdec(stdout, start);
+    printf(" to ");
+    fprintdec(stdout, end);
+    printf(" of %s for %s...\n", infilename, outfilename);
+
+    //
+    // Header, filled in at the end
+    //
+    memset(header, 0, sizeof(header));
+    if(fwrite(header, 1, sizeof(header), out) != sizeof(header)) { goto error_out; }
+
+    resetcounter(end - start);
+
+    pos = start;
+    input_bytes_queued = start;
+    while(pos < end) {
+        uint8_t code = 0;
+        int8_t  probed = 1;
+        off_t   advance;
+
+        //
+        // Refill queue if necessary
+        //
+        if(queue_bytes_available < 2352 && input_bytes_queued < input_file_length) {
+            off_t willread = input_file_length - input_bytes_queued;
+            off_t maxread = queue_size - queue_bytes_available;
+            if(willread > maxread) { willread = maxread; }
+            if(queue_start_ofs > 0) {
+                memmove(queue, queue + queue_start_ofs, queue_bytes_available);
+                queue_start_ofs = 0;
+            }
+            setcounter_analyze(input_bytes_queued - start);
+            if(!input_seek(&in, input_bytes_queued)) { goto error_in; }
+            if(!input_read(&in, queue + queue_bytes_available, (size_t)willread)) { goto error_in; }
+            if(input_bytes_queued < end) {
+                off_t n = end - input_bytes_queued;
+                if(n > willread) { n = willread; }
+                edc = edc_compute(edc, queue + queue_bytes_available, (size_t)n);
+            }
+            input_bytes_queued    += willread;
+            queue_bytes_available += willread;
+        }
+        if(queue_bytes_available == 0) { break; }
+
+        //
+        // Check this position the way ecmify would
+        //
+        if(cooked) {
+            probed = 0;
+            advance = end - pos;
+        } else {
+            const uint8_t* p = queue + queue_start_ofs;
+            int8_t candidate = queue_bytes_available < 2352 || may_be_sector(p, queue_bytes_available);
+            int8_t rawform = 0;
+            if(candidate && format_version == 2) {
+                rawform = detect_raw_mode2(p, queue_bytes_available);
+            }
+            if(rawform) {
+                code = (uint8_t)(PROBE_RAW | rawform);
+                prev = TYPE_RAW_MODE2;
+            } else if(
+                (prev == 2 || prev == 3 || prev == TYPE_MODE2_FORM2_NOEDC) &&
+                queue_bytes_available >= 0x10 && has_sync(p) && p[0xF] == 0x02
+            ) {
+                //
+                // ecmify takes the sync and header as literal bytes without
+                // checking them
+                //
+                probed = 0;
+                prev = 0;
+            } else if(!candidate) {
+                //
+                // No sector starts here
+                //
+                prev = 0;
+            } else {
+                int8_t patched = 0;
+                code = (uint8_t)detect_sector(p, queue_bytes_available, format_version);
+                if(!code && format_version == 2) {
+                    patched = detect_patched(p, queue_bytes_available, prev);
+                }
+                prev = code ? (int8_t)code : patched;
+            }
+            advance = !probed ? 0x10 : (prev && !code) ? (off_t)sector_types[prev].size : probe_unit_size(code);
+        }
+
+        if(probed) {
+            //
+            // Extend the current segment, or start a new one
+            //
+            if(
+                !seg_count || seg_code != code || seg_count == 0xFFFFFFFF ||
+                seg_offset + (off_t)seg_count * probe_unit_size(seg_code) != pos
+            ) {
+                if(seg_count) {
+                    put64lsb(segment, seg_offset);
+                    put32lsb(segment + 8, seg_count);
+                    segment[12] = seg_code;
+                    if(fwrite(segment, 1, sizeof(segment), out) != sizeof(segment)) { goto error_out; }
+                    segments++;
+                }
+                seg_offset = pos;
+                seg_count = 0;
+                seg_code = code;
+            }
+            seg_count++;
+        }
+
+        if((off_t)queue_bytes_available < advance) { advance = queue_bytes_available; }
+        pos                   += advance;
+        queue_start_ofs       += (size_t)advance;
+        queue_bytes_available -= (size_t)advance;
+    }
+    if(seg_count) {
+        put64lsb(segment, seg_offset);
+        put32lsb(segment + 8, seg_count);
+        segment[12] = seg_code;
+        if(fwrite(segment, 1, sizeof(segment), out) != sizeof(segment)) { goto error_out; }
+        segments++;
+    }
+
+    memcpy(header, "ECMS", 4);
+    put32lsb(header + 4, (uint32_t)format_version);
+    put64lsb(header + 8, image_size);
+    put64lsb(header + 16, start);
+    put64lsb(header + 24, end);
+    put32lsb(header + 32, edc);
+    if(
+        fseeko(out, 0, SEEK_SET) != 0 ||
+        fwrite(header, 1, sizeof(header), out) != sizeof(header) ||
+        fflush(out) != 0
+    ) { goto error_out; }
+
+    printf("Wrote ");
+    fprintdec(stdout, segments);
+    printf(" segments\n");
+
+    //
+    // Success
+    //
+    printf("Done\n");
+    returncode = 0;
+    goto done;
+
+error_in:
+    printfileerror(in.f, infilename);
+    goto error;
+
+error_out:
+    printfileerror(out, outfilename);
+    goto error;
+
+error:
+    returncode = 1;
+    goto done;
+
+done:
+    if(queue != NULL) { free(queue); }
+    if(in.f != NULL) { fclose(in.f); }
+    if(out  != NULL) { fclose(out); }
+
+    return returncode;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Checkpoints (--resume)
+//
+// With --resume, the encoder and decoder sync their output to disk every
+// RESUME_INTERVAL bytes or so, and then replace a checkpoint file next to it
+// (the output's name plus ".resume") with what they need to carry on from
+// there.  Run again with --resume after being stopped, they cut the output
+// back to what the checkpoint covers and carry on; the checkpoint is removed
+// once the output is complete.  The file holds:
+//
+//   "ECMR"
+//   u32 kind (RESUME_ENCODE or RESUME_DECODE)
+//   u32 size of the state that follows
+//   the state
+//   u32 EDC of all the above
+//
+// The encoder's state is where in the input it got to, the tallies and EDC
+// so far, the blocks written and the written sectors in the repeat table,
+// so repeats of sectors before it are still found; it ends a run and a block there, so the
+// file can carry on from a block boundary, and on resuming reads the input
+// up to there again to check its EDC (and for subchannel data and digests).
+// The decoder's is the next block to decode and the EDC of those before it.
+// This needs fsync and ftruncate; elsewhere --resume is refused.
+//
+#if defined(_POSIX_VERSION) && (_POSIX_VERSION > 0)
+#define ECM_RESUME 1
+#endif
+
+#define RESUME_INTERVAL    0x4000000
+#define RESUME_HEADER_SIZE 12
+#define RESUME_MAX_SIZE    0x10000000
+#define RESUME_ENCODE      1
+#define RESUME_DECODE      2
+
+//
+// Encoder state: flags, image size, offset, output size, literal bytes to
+// skip, EDC, decoded bytes, records, index size, repeat table entries, then
+// the tallies; the index and the entries (u32 hash, u8 bulk type, u64 input
+// offset, u64 file offset) follow
+//
+#define RESUME_ENCODE_SIZE (1 + 8 * 3 + 4 * 2 + 8 * 4 + 8 * (TYPE_COUNT + RAW_FORM_CODES))
+#define RESUME_DEDUPE_SIZE 21
+
+static const uint8_t resume_magic[4] = { 'E', 'C', 'M', 'R' };
+
+static int8_t resume_enabled = 0;
+
+//
+// Name of the checkpoint file for outfilename, or NULL if out of memory
+//
+static char* resume_name(const char* outfilename) {
+    char* name = malloc(strlen(outfilename) + 12);
+    if(!name) {
+        printf("Out of memory\n");
+        return NULL;
+    }
+    strcpy(name, outfilename);
+    strcat(name, ".resume");
+    return name;
+}
+
+//
+// Sync out, then replace the checkpoint file with one holding size bytes of
+// state
+//
+// Returns nonzero on error, with a message
+//
+static int8_t resume_save(
+    const char* name,
+    uint32_t kind,
+    FILE* out,
+    const char* outfilename,
+    const uint8_t* state,
+    size_t size
+) {
+    uint8_t buffer[RESUME_HEADER_SIZE];
+    char* tempname = NULL;
+    FILE* f = NULL;
+    uint32_t edc;
+
+    if(fflush(out) != 0) { goto error_out; }
+#ifdef ECM_RESUME
+    if(fsync(fileno(out)) != 0) { goto error_out; }
+#endif
+
+    tempname = malloc(strlen(name) + 5);
+    if(!tempname) {
+        printf("Out of memory\n");
+        return 1;
+    }
+    strcpy(tempname, name);
+    strcat(tempname, ".new");
+
+    memcpy(buffer, resume_magic, 4);
+    put32lsb(buffer + 4, kind);
+    put32lsb(buffer + 8, (uint32_t)size);
+    edc = edc_compute(edc_compute(0, buffer, sizeof(buffer)), state, size);
+
+    f = fopen(tempname, "wb");
+    if(!f) { goto error_resume; }
+    if(
+        fwrite(buffer, 1, sizeof(buffer), f) != sizeof(buffer) ||
+        fwrite(state, 1, size, f) != size
+    ) {
+        goto error_resume;
+    }
+    put32lsb(buffer, edc);
+    if(fwrite(buffer, 1, 4, f) != 4 || fflush(f) != 0) { goto error_resume; }
+#ifdef ECM_RESUME
+    if(fsync(fileno(f)) != 0) { goto error_resume; }
+#endif
+    if(fclose(f) != 0) {
+        f = NULL;
+        goto error_resume;
+    }
+    f = NULL;
+    if(rename(tempname, name) != 0) { goto error_resume; }
+    free(tempname);
+    return 0;
+
+error_out:
+    printfileerror(out, outfilename);
+    return 1;
+
+error_resume:
+    printfileerror(f, tempname);
+    if(f) { fclose(f); }
+    free(tempname);
+    return 1;
+}
+
+//
+// Load the state from the checkpoint file into *state (to be freed), or set
+// it to NULL if there's no checkpoint
+//
+// Returns nonzero on error, with a message
+//
+static int8_t resume_load(const char* name, uint32_t kind, uint8_t** state, size_t* size) {
+    uint8_t buffer[RESUME_HEADER_SIZE];
+    FILE* f;
+    uint32_t n;
+
+    *state = NULL;
+    *size = 0;
+    f = fopen(name, "rb");
+    if(!f) {
+        if(errno == ENOENT) { return 0; }
+        printfileerror(NULL, name);
+        return 1;
+    }
+    if(fread(buffer, 1, sizeof(buffer), f) != sizeof(buffer)) { goto error_resume; }
+    n = get32lsb(buffer + 8);
+    if(memcmp(buffer, resume_magic, 4) || get32lsb(buffer + 4) != kind || n > RESUME_MAX_SIZE) {
+        goto corrupt;
+    }
+    *state = malloc(n + 4);
+    if(!*state) {
+        printf("Out of memory\n");
+        fclose(f);
+        return 1;
+    }
+    if(fread(*state, 1, n + 4, f) != n + 4) { goto error_resume; }
+    if(edc_compute(edc_compute(0, buffer, sizeof(buffer)), *state, n) != get32lsb(*state + n)) {
+        goto corrupt;
+    }
+    fclose(f);
+    *size = n;
+    return 0;
+
+error_resume:
+    if(!feof(f)) {
+        printfileerror(f, name);
+        goto error;
+    }
+    // fall through
+corrupt:
+    printf("Error: %s: not a checkpoint of this %s, or damaged\n", name,
+        kind == RESUME_ENCODE ? "encode" : "decode");
+error:
+    if(*state) { free(*state); *state = NULL; }
+    fclose(f);
+    return 1;
+}
+
+//
+// Open the output of an interrupted run, cut back to size bytes
+//
+// Returns NULL on error, with a message
+//
+static FILE* resume_open(const char* outfilename, off_t size) {
+    FILE* out = fopen(outfilename, "r+b");
+    if(!out) {
+        printfileerror(NULL, outfilename);
+        return NULL;
+    }
+    if(fseeko(out, 0, SEEK_END) != 0 || ftello(out) < size) {
+        printf("Error: %s: shorter than its checkpoint says\n", outfilename);
+        fclose(out);
+        return NULL;
+    }
+#ifdef ECM_RESUME
+    if(fflush(out) != 0 || ftruncate(fileno(out), size) != 0 || fseeko(out, size, SEEK_SET) != 0) {
+        printfileerror(out, outfilename);
+        fclose(out);
+        return NULL;
+    }
+#endif
+    return out;
+}
+
+//
+// Write the encoder's checkpoint: the input up to offset has been encoded,
+// with literal_skip literal bytes from there still to skip, into the blocks
+// written so far
+//
+// Returns nonzero on error, with a message
+//
+static int8_t resume_save_encode(
+    const char* name,
+    ecm_writer* w,
+    uint8_t flags,
+    off_t image_size,
+    off_t offset,
+    uint32_t literal_skip,
+    uint32_t edc,
+    const off_t* typetally,
+    const off_t* formtally
+) {
+    uint8_t* state;
+    uint8_t* p;
+    size_t size;
+    size_t entries = 0;
+    size_t i;
+    int8_t failed;
+    int t;
+
+    if(writer_end_block(w)) { return 1; }
+
+    //
+    // Sectors in the repeat table that have been written; the one being
+    // looked at isn't yet, and is looked up again on resuming
+    //
+    for(i = 0; dedupe_table && i < DEDUPE_SLOTS; i++) {
+        if(dedupe_table[i].bulk && dedupe_table[i].file_offset >= 0) { entries++; }
+    }
+
+    size = RESUME_ENCODE_SIZE + w->index_used + entries * RESUME_DEDUPE_SIZE;
+    state = malloc(size);
+    if(!state) {
+        printf("Out of memory\n");
+        return 1;
+    }
+    p = state;
+    *p++ = flags;
+    put64lsb(p, image_size); p += 8;
+    put64lsb(p, offset); p += 8;
+    put64lsb(p, ftello(w->out)); p += 8;
+    put32lsb(p, literal_skip); p += 4;
+    put32lsb(p, edc); p += 4;
+    put64lsb(p, w->decoded_total); p += 8;
+    put64lsb(p, w->record_count); p += 8;
+    put64lsb(p, (off_t)w->index_used); p += 8;
+    put64lsb(p, (off_t)entries); p += 8;
+    for(t = 0; t < TYPE_COUNT; t++) { put64lsb(p, typetally[t]); p += 8; }
+    for(t = 0; t < RAW_FORM_CODES; t++) { put64lsb(p, formtally[t]); p += 8; }
+    if(w->index_used) { memcpy(p, w->index, w->index_used); }
+    p += w->index_used;
+    for(i = 0; entries && i < DEDUPE_SLOTS; i++) {
+        const dedupe_entry* e = dedupe_table + i;
+        if(!e->bulk || e->file_offset < 0) { continue; }
+        put32lsb(p, e->hash);
+        p[4] = (uint8_t)e->bulk;
+        put64lsb(p + 5, e->input_offset);
+        put64lsb(p + 13, e->file_offset);
+        p += RESUME_DEDUPE_SIZE;
+    }
+    failed = resume_save(name, RESUME_ENCODE, w->out, w->outfilename, state, size);
+    free(state);
+    return failed;
+}
+
+typedef struct {
+    uint8_t  flags;
+    off_t    image_size;
+    off_t    offset;
+    off_t    output_size;
+    uint32_t literal_skip;
+    uint32_t edc;
+    off_t    decoded_total;
+    off_t    record_count;
+    off_t    typetally[TYPE_COUNT];
+    off_t    formtally[RAW_FORM_CODES];
+    uint8_t* index;
+    size_t   index_used;
+    dedupe_entry* dedupe; // written sectors in the repeat table
+    size_t   dedupe_count;
+} encode_checkpoint;
+
+//
+// Read the encoder's checkpoint; c->index and c->dedupe are to be freed
+//
+// Returns nonzero on error, with a message; *found is set to whether there is
+// a checkpoint
+//
+static int8_t resume_load_encode(const char* name, encode_checkpoint* c, int8_t* found) {
+    uint8_t* state;
+    const uint8_t* p;
+    size_t size;
+    size_t i;
+    int t;
+
+    memset(c, 0, sizeof(*c));
+    *found = 0;
+    if(resume_load(name, RESUME_ENCODE, &state, &size)) { return 1; }
+    if(!state) { return 0; }
+    if(size < RESUME_ENCODE_SIZE) { goto corrupt; }
+    p = state;
+    c->flags = *p++;
+    c->image_size = get64lsb(p); p += 8;
+    c->offset = get64lsb(p); p += 8;
+    c->output_size = get64lsb(p); p += 8;
+    c->literal_skip = get32lsb(p); p += 4;
+    c->edc = get32lsb(p); p += 4;
+    c->decoded_total = get64lsb(p); p += 8;
+    c->record_count = get64lsb(p); p += 8;
+    c->index_used = (size_t)get64lsb(p); p += 8;
+    c->dedupe_count = (size_t)get64lsb(p); p += 8;
+    for(t = 0; t < TYPE_COUNT; t++) { c->typetally[t] = get64lsb(p); p += 8; }
+    for(t = 0; t < RAW_FORM_CODES; t++) { c->formtally[t] = get64lsb(p); p += 8; }
+    if(
+        c->index_used > size - RESUME_ENCODE_SIZE ||
+        c->dedupe_count > DEDUPE_SLOTS ||
+        c->dedupe_count * RESUME_DEDUPE_SIZE != size - RESUME_ENCODE_SIZE - c->index_used ||
+        c->index_used % ECM_INDEX_ENTRY_SIZE ||
+        c->offset < 0 || c->offset > c->image_size || c->output_size < 4
+    ) {
+        goto corrupt;
+    }
+    c->index = malloc(c->index_used ? c->index_used : 1);
+    c->dedupe = malloc((c->dedupe_count ? c->dedupe_count : 1) * sizeof(dedupe_entry));
+    if(!c->index || !c->dedupe) {
+        printf("Out of memory\n");
+        goto error;
+    }
+    memcpy(c->index, p, c->index_used);
+    p += c->index_used;
+    for(i = 0; i < c->dedupe_count; i++, p += RESUME_DEDUPE_SIZE) {
+        dedupe_entry* e = c->dedupe + i;
+        e->hash = get32lsb(p);
+        e->bulk = (int8_t)p[4];
+        e->input_offset = get64lsb(p + 5);
+        e->file_offset = get64lsb(p + 13);
+        if(
+            e->bulk <= 0 || e->bulk >= TYPE_COUNT ||
+            e->input_offset < 0 || e->input_offset >= c->offset ||
+            e->file_offset < 4 || e->file_offset >= c->output_size
+        ) {
+            goto corrupt;
+        }
+    }
+    free(state);
+    *found = 1;
+    return 0;
+
+corrupt:
+    printf("Error: %s: not a checkpoint of this encode, or damaged\n", name);
+error:
+    if(c->index) { free(c->index); c->index = NULL; }
+    if(c->dedupe) { free(c->dedupe); c->dedupe = NULL; }
+    free(state);
+    return 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// With partial_count partials (bin2ecm --merge), what they found stands in for
+// checking the input.  With source (bin2ecm --recode), the input is the image
+// that ECM file decodes to, infilename, and its records stand in for checking
+// the sectors they say are of a type the encoder finds.  With a cue sheet
+// (bin2ecm --cue=FILE) that lists the input, only the positions where it says
+// sectors start are checked.  With container set, the input is the cue sheet
+// infilename (bin2ecm foo.cue): its files make up the image, and it goes in
+// the output with them.  With source as well, the image is that ECM file's,
+// of files of the sizes the sheet has from it.
+//
+// Returns nonzero on error
+//
+static int8_t ecmify(
+    const char* infilename,
+    const char* outfilename,
+    char** partials,
+    size_t partial_count,
+    ecm_file* source,
+    const cue_sheet* cue,
+    int8_t container
+) {
+    int8_t returncode = 0;
+
+    ecm_input in;
+    FILE* out = NULL;
+
+    uint8_t* queue = NULL;
+    size_t queue_start_ofs = 0;
+    size_t queue_bytes_available = 0;
+
+    uint32_t input_edc = 0;
+
+    //
+    // Current sector type (run)
+    //
+    int8_t   curtype = -1; // not a valid type
+    uint32_t curtype_count = 0;
+    off_t    curtype_in_start = 0;
+
+    uint32_t literal_skip = 0;
+
+    off_t input_file_length; // not counting subchannel data
+    off_t image_size;
+    off_t input_bytes_checked = 0;
+    off_t input_bytes_queued  = 0;
+
+    off_t typetally[TYPE_COUNT] = {0};
+    off_t formtally[RAW_FORM_CODES] = {0}; // TYPE_RAW_MODE2 sectors of each form
+    size_t store_added = 0;
+
+    //
+    // Version 2: mode 1 runs are split where the addresses stop counting up,
+    // so sequential ones can be stored with just the first address
+    //
+    int8_t   sequential_runs = (format_version == 2);
+    int8_t   curtype_sequential = 0;
+    uint8_t  last_address[3] = {0,0,0};
+
+    //
+    // Version 2: whole mode 2 sectors are stored as TYPE_RAW_MODE2 runs, with
+    // a code per sector for its form
+    //
+    int8_t   raw_mode2 = (format_version == 2);
+
+    //
+    // Form map, fill header or references of the current run
+    //
+    uint8_t* curtype_data = NULL;
+    size_t   curtype_data_alloc = 0;
+
+    //
+    // Version 2: an image of 2048-byte sectors is stored as TYPE_COOKED
+    //
+    int8_t   cooked = 0;
+
+    //
+    // Raw sectors end to end: checked a batch at a time, up to aligned_next
+    //
+    int8_t   aligned = 0;
+    off_t    aligned_next = 0;
+    size_t   aligned_alloc = 0;
+
+    ecm_writer w;
+    subchannel_encoder sub;
+    image_digest digest;
+    probe_cache probes;
+    cue_layout layout;
+    input_set set;
+
+    //
+    // Tracing: detection span currently open, if any
+    //
+    double detect_span = 0;
+    off_t detect_span_offset = -1;
+
+    //
+    // --resume: the checkpoint, if there was one, and the EDC of the input up
+    // to resume_edc_end, for the next
+    //
+    char*    resume_file = NULL;
+    int8_t   resumed = 0;
+    encode_checkpoint checkpoint;
+    off_t    resume_next = RESUME_INTERVAL;
+    uint32_t resume_edc = 0;
+    off_t    resume_edc_end = 0;
+    uint8_t  resume_flags = 0;
+
+    size_t queue_size = ((size_t)(-1)) - 4095;
+    PERF_ENTER(PHASE_ENCODE);
+    if((unsigned long)queue_size > 0x40000lu) {
+        queue_size = (size_t)0x40000lu;
+    }
+
+    memset(&w, 0, sizeof(w));
+    memset(&in, 0, sizeof(in));
+    memset(&checkpoint, 0, sizeof(checkpoint));
+    memset(&probes, 0, sizeof(probes));
+    memset(&layout, 0, sizeof(layout));
+    memset(&set, 0, sizeof(set));
+    subchannel_encoder_init(&sub);
+
+    //
+    // Allocate space for queue
+    //
+    queue = malloc(queue_size);
+    if(digest_init(&digest, digest_selected) || !queue) {
+        printf("Out of memory\n");
+        goto error;
+    }
+
+    if(verify_enabled && verify_init()) { goto error; }
+
+    if(format_version == 2) {
+        dedupe_table = calloc(DEDUPE_SLOTS, sizeof(dedupe_entry));
+        if(!dedupe_table) {
+            printf("Out of memory\n");
+            goto error;
+        }
+    }
+
+    if(resume_enabled) {
+        resume_file = resume_name(outfilename);
+        if(!resume_file || resume_load_encode(resume_file, &checkpoint, &resumed)) { goto error; }
+    }
+
+    //
+    // Ensure the output file doesn't already exist, unless it's the one the
+    // checkpoint is of
+    //
+    if(!resumed) {
+        out = fopen(outfilename, "rb");
+        if(out) {
+            printf("Error: %s exists; refusing to overwrite\n", outfilename);
+            goto error;
+        }
+    }
+
+    //
+    // Open both files
+    //
+    if(source) {
+        in.ecm = source;
+    } else if(container) {
+        if(input_set_open(&set, cue, infilename)) { goto error; }
+        in.set = &set;
+    } else {
+        in.f = fopen(infilename, "rb");
+        if(!in.f) { goto error_in; }
+    }
+    if(container && source) {
+        size_t i;
+        set.starts = calloc(cue->file_count + 1, sizeof(off_t));
+        if(!set.starts) {
+            printf("Out of memory\n");
+            goto error;
+        }
+        set.count = cue->file_count;
+        for(i = 0; i < set.count; i++) {
+            set.starts[i + 1] = set.starts[i] + cue->sizes[i];
+        }
+    }
+
+    if(resumed) {
+        out = resume_open(outfilename, checkpoint.output_size);
+        if(!out) { goto error; }
+    } else {
+        out = fopen(outfilename, "wb");
+        if(!out) { goto error_out; }
+    }
+
+    printf("%s %s to %s...\n", source ? "Recoding" : "Encoding", infilename, outfilename);
+
+    //
+    // Get the length of the input file
+    //
+    if(source) {
+        input_file_length = ecm_size(source);
+    } else if(container) {
+        input_file_length = set.starts[set.count];
+    } else {
+        if(fseeko(in.f, 0, SEEK_END) != 0) { goto error_in; }
+        input_file_length = ftello(in.f);
+        if(input_file_length < 0) { goto error_in; }
+    }
+    image_size = input_file_length;
+
+    //
+    // Version 2: for 2448-byte sectors, encode the first 2352 bytes of each
+    // as usual and keep the subchannel data apart
+    //
+    if(format_version == 2 && detect_subchannel_image(&in, input_file_length)) {
+        in.subchannel = 1;
+        input_file_length = (input_file_length / 2448) * 2352;
+        printf("Found 2448-byte sectors with subchannel data\n");
+    } else if(format_version == 2 && detect_cooked_image(&in, input_file_length)) {
+        cooked = 1;
+        printf("Found 2048-byte sectors\n");
+    }
+
+    if(partial_count) {
+        if(probe_cache_load(&probes, partials, partial_count, image_size, input_file_length)) { goto error; }
+        printf("Using %s partials\n", probes.tiled ? "complete" : "incomplete");
+    } else if(source) {
+        if(probe_cache_from_records(&probes, source, in.subchannel)) { goto error; }
+    }
+    if(
+        !cooked && !probes.count &&
+        detect_aligned_image(&in, image_size, in.subchannel ? 2448 : 2352)
+    ) {
+        uint8_t* q = realloc(queue, ALIGNED_QUEUE_SIZE);
+        if(!q) {
+            printf("Out of memory\n");
+            goto error;
+        }
+        queue = q;
+        queue_size = ALIGNED_QUEUE_SIZE;
+        probes.maps = calloc(1, sizeof(probe_map));
+        if(!probes.maps) {
+            printf("Out of memory\n");
+            goto error;
+        }
+        probes.count = 1;
+        aligned = 1;
+        printf("Found aligned 2352-byte sectors\n");
+    }
+
+    //
+    // A cue sheet that doesn't fit is only a missed chance to go faster
+    //
+    if(container) {
+        printf("Taking %lu files from the cue sheet\n", (unsigned long)set.count);
+    }
+    if(container && !cooked) {
+        //
+        // Where each file starts, not counting subchannel data
+        //
+        off_t* starts = malloc((set.count + 1) * sizeof(off_t));
+        size_t i;
+        if(!starts) {
+            printf("Out of memory\n");
+            goto error;
+        }
+        for(i = 0; i <= set.count; i++) {
+            starts[i] = in.subchannel ? (set.starts[i] / 2448) * 2352 : set.starts[i];
+        }
+        if(!cue_layout_build(&layout, cue, -1, starts, input_file_length)) {
+            printf("Using the cue sheet\n");
+        }
+        free(starts);
+    } else if(cue && !cooked) {
+        int file = cue_find_file(cue, infilename);
+        if(file < 0) {
+            printf("Not using the cue sheet: it doesn't list %s\n", infilename);
+        } else if(!cue_layout_build(&layout, cue, file, NULL, input_file_length)) {
+            printf("Using the cue sheet\n");
+        }
+    }
+
+    resetcounter(input_file_length);
+
+    //
+    // Magic identifier, or with a checkpoint, the blocks written before it
+    //
+    resume_flags = (uint8_t)(
+        format_version | (in.subchannel << 2) | (cooked << 3) | (container << 4) | ((base_entries != 0) << 5)
+    );
+    if(!resumed) {
+        if(writer_open(&w, out, outfilename, format_version)) { goto error; }
+        if(resume_enabled && resume_save_encode(
+            resume_file, &w, resume_flags, image_size, 0, 0, 0, typetally, formtally
+        )) { goto error; }
+    } else if(checkpoint.flags != resume_flags || checkpoint.image_size != image_size) {
+        printf("Error: %s: checkpoint is of a different encode\n", resume_file);
+        goto error;
+    } else {
+        size_t i;
+        w.out = out;
+        w.outfilename = outfilename;
+        w.version = format_version;
+        w.block_offset = checkpoint.output_size;
+        w.decoded_total = checkpoint.decoded_total;
+        w.decoded_edc = checkpoint.edc;
+        w.record_count = checkpoint.record_count;
+        w.index = checkpoint.index;
+        w.index_used = checkpoint.index_used;
+        w.index_alloc = checkpoint.index_used;
+        checkpoint.index = NULL;
+        for(i = 0; dedupe_table && i < checkpoint.dedupe_count; i++) {
+            const dedupe_entry* e = checkpoint.dedupe + i;
+            dedupe_table[e->hash & (DEDUPE_SLOTS - 1)] = *e;
+        }
+        memcpy(typetally, checkpoint.typetally, sizeof(typetally));
+        memcpy(formtally, checkpoint.formtally, sizeof(formtally));
+        literal_skip = checkpoint.literal_skip;
+        input_edc = resume_edc = checkpoint.edc;
+        input_bytes_checked = input_bytes_queued = resume_edc_end = checkpoint.offset;
+        resume_next = checkpoint.offset + RESUME_INTERVAL;
+        printf("Resuming at input offset ");
+        fprintdec(stdout, checkpoint.offset);
+        printf("\n");
+
+        //
+        // Read again what came before: its EDC shows it's the same input,
+        // and subchannel data and digests take every byte
+        //
+        {   off_t at = 0;
+            int8_t got = 1;
+            uint32_t edc = 0;
+            if(!input_seek(&in, 0)) { goto error_in; }
+            in.sub = in.subchannel ? &sub : NULL;
+            in.digest = &digest;
+            while(got && at < checkpoint.offset) {
+                size_t n = queue_size;
+                if((off_t)n > checkpoint.offset - at) { n = (size_t)(checkpoint.offset - at); }
+                got = input_read(&in, queue, n);
+                if(got) { edc = edc_compute(edc, queue, n); }
+                if(got && partial_count && probe_cache_check(&probes, queue, at, n)) { goto error; }
+                at += n;
+            }
+            in.sub = NULL;
+            in.digest = NULL;
+            if(!got) {
+                if(in.nomem) { goto error; }
+                goto error_in;
+            }
+            if(edc != checkpoint.edc) {
+                printf("Error: %s: not the input the checkpoint is of\n", infilename);
+                goto error;
+            }
+        }
+    }
+
+    for(;;) {
+        int8_t detecttype;
+        int8_t same_run;
+        uint32_t skip_before = literal_skip;
+        int8_t rawform = 0;
+        int8_t bulk = 0;
+        uint8_t fill_header[FILL_HEADER_SIZE];
+        off_t reference = -1;
+        dedupe_entry* match = NULL;
+
+        //
+        // Refill queue if necessary
+        //
+        if(
+            (queue_bytes_available < 2352) &&
+            (((off_t)queue_bytes_available) < (input_file_length - input_bytes_queued))
+        ) {
+            //
+            // We need to read more data
+            //
+            off_t willread = input_file_length - input_bytes_queued;
+            off_t maxread = queue_size - queue_bytes_available;
+            if(willread > maxread) {
+                willread = maxread;
+            }
+
+            if(resume_enabled) {
+                resume_edc = edc_compute(resume_edc,
+                    queue + queue_start_ofs - (size_t)(input_bytes_checked - resume_edc_end),
+                    (size_t)(input_bytes_checked - resume_edc_end));
+                resume_edc_end = input_bytes_checked;
+            }
+            if(queue_start_ofs > 0) {
+                memmove(queue, queue + queue_start_ofs, queue_bytes_available);
+                queue_start_ofs = 0;
+            }
+            if(willread) {
+                double span;
+                if(detect_span_offset >= 0) {
+                    trace_end("detect", detect_span, 0, detect_span_offset, input_bytes_checked - detect_span_offset);
+                    detect_span_offset = -1;
+                }
+                span = trace_begin();
+
+                setcounter_analyze(input_bytes_queued);
+
+                {   int8_t got;
+                    PERF_ENTER(PHASE_IO);
+                    if(!input_seek(&in, input_bytes_queued)) {
+                        goto error_in;
+                    }
+                    //
+                    // Each sector's subchannel data is collected the one time
+                    // it's read here
+                    //
+                    in.sub = in.subchannel ? &sub : NULL;
+                    in.digest = &digest;
+                    got = input_read(&in, queue + queue_bytes_available, (size_t)willread);
+                    in.sub = NULL;
+                    in.digest = NULL;
+                    if(!got) {
+                        if(in.nomem) { goto error; }
+                        goto error_in;
+                    }
+                    PERF_LEAVE();
+                }
+
+                //
+                // Version 2 takes the EDC of the input from the blocks' EDCs
+                // of what they decode to instead
+                //
+                if(format_version != 2) {
+                    input_edc = edc_compute(
+                        input_edc,
+                        queue + queue_bytes_available,
+                        willread
+                    );
+                }
+                if(partial_count && probe_cache_check(
+                    &probes, queue + queue_bytes_available, input_bytes_queued, (size_t)willread
+                )) { goto error; }
+
+                trace_end("refill", span, 0, input_bytes_queued, willread);
+
+                input_bytes_queued    += willread;
+                queue_bytes_available += willread;
+
+                if(aligned) {
+                    //
+                    // Sectors the encoder has already gone past can't be
+                    // looked up any more
+                    //
+                    off_t first = ((input_bytes_checked + 2351) / 2352) * 2352;
+                    if(first < aligned_next) { first = aligned_next; }
+                    if(first < input_bytes_queued) {
+                        if(aligned_classify(
+                            &probes, &aligned_alloc,
+                            queue + queue_start_ofs + (size_t)(first - input_bytes_checked),
+                            first,
+                            (size_t)(input_bytes_queued - first),
+                            input_bytes_queued == input_file_length,
+                            raw_mode2
+                        )) { goto error; }
+                        aligned_next = first + ((input_bytes_queued - first) / 2352) * 2352;
+                    }
+                }
+            }
+        }
+
+        if(trace_file && detect_span_offset < 0) {
+            detect_span = trace_begin();
+            detect_span_offset = input_bytes_checked;
+        }
+
+        if(queue_bytes_available == 0) {
+            //
+            // No data left to read -> quit
+            //
             detecttype = -1;
 
-        } else if(literal_skip > 0) {
+        } else if(literal_skip > 0) {
+            //
+            // Skipping through literal bytes
+            //
+            literal_skip--;
+            detecttype = 0;
+
+        } else if(cooked) {
+            detecttype = (queue_bytes_available >= 2048) ? TYPE_COOKED : 0;
+
+        } else if(cue_literal(layout.count ? &layout : NULL, input_bytes_checked, &literal_skip)) {
+            //
+            // Audio, or between where the cue sheet says sectors start
+            //
+            detecttype = 0;
+
+        } else if(
+            queue_bytes_available >= 2352 &&
+            !may_be_sector(queue + queue_start_ofs, queue_bytes_available)
+        ) {
+            //
+            // Nothing to look up or check: no sector starts here
+            //
+            detecttype = 0;
+
+        } else {
+            uint8_t code = 0;
+            probe_cache* c = probes.count ? &probes : NULL;
+            int8_t known;
+            PERF_ENTER(PHASE_DETECT);
+            known = probe_lookup(c, input_bytes_checked, &code);
+            if(raw_mode2) {
+                rawform = !known ? probe_raw_mode2(c, input_bytes_checked, queue + queue_start_ofs, queue_bytes_available) :
+                    (code & PROBE_RAW) ? (int8_t)(code & ~PROBE_RAW) : 0;
+            }
+            if(rawform) {
+                detecttype = TYPE_RAW_MODE2;
+
+            //
+            // Heuristic to skip past CD sync after a mode 2 sector
+            //
+            } else if(
+                (curtype == 2 || curtype == 3 || curtype == TYPE_MODE2_FORM2_NOEDC) &&
+                queue_bytes_available >= 0x10 &&
+                queue[queue_start_ofs + 0x0] == 0x00 &&
+                queue[queue_start_ofs + 0x1] == 0xFF &&
+                queue[queue_start_ofs + 0x2] == 0xFF &&
+                queue[queue_start_ofs + 0x3] == 0xFF &&
+                queue[queue_start_ofs + 0x4] == 0xFF &&
+                queue[queue_start_ofs + 0x5] == 0xFF &&
+                queue[queue_start_ofs + 0x6] == 0xFF &&
+                queue[queue_start_ofs + 0x7] == 0xFF &&
+                queue[queue_start_ofs + 0x8] == 0xFF &&
+                queue[queue_start_ofs + 0x9] == 0xFF &&
+                queue[queue_start_ofs + 0xA] == 0xFF &&
+                queue[queue_start_ofs + 0xB] == 0x00 &&
+                queue[queue_start_ofs + 0xF] == 0x02
+            ) {
+                // Treat this byte as a literal...
+                detecttype = 0;
+                // ...and skip the next 15
+                literal_skip = 15;
+            } else {
+                //
+                // Detect the sector type at the current offset
+                //
+                detecttype = known ? (int8_t)code :
+                    detect_sector(queue + queue_start_ofs, queue_bytes_available, format_version);
+                if(!detecttype && format_version == 2) {
+                    detecttype = detect_patched(queue + queue_start_ofs, queue_bytes_available, curtype);
+                }
+            }
+            PERF_LEAVE();
+        }
+
+        //
+        // Version 2: a sector whose bulk is one byte repeated is stored as a
+        // fill, one whose bulk is in the base image or can go in the shared
+        // store as a reference to it, and one whose bulk was already written
+        // as a repeat
+        //
+        if(format_version == 2 && detecttype > 0) {
+            bulk = bulk_type(detecttype, rawform);
+        }
+        if(bulk) {
+            const uint8_t* unit = queue + queue_start_ofs;
+            size_t size = sector_types[detecttype].size;
+            if(detect_fill(bulk, unit, size, fill_header)) {
+                detecttype = sized_type(TYPE_FILL, size);
+            } else {
+                const uint8_t* data = bulk_of(bulk, unit, size);
+                int8_t stored = 0;
+                if(base_entries && base_find(bulk, data, input_bytes_checked + (data - unit), &reference)) {
+                    detecttype = sized_type(TYPE_BASE, size);
+                } else if(shared_store && store_put(shared_store, bulk, data, &reference, &stored)) {
+                    goto error;
+                } else if(stored) {
+                    detecttype = sized_type(TYPE_STORED, size);
+                } else if(dedupe_check(&in, bulk, data, input_bytes_checked + (data - unit), &match)) {
+                    goto error_in;
+                } else if(match) {
+                    detecttype = sized_type(TYPE_REPEAT, size);
+                }
+            }
+        }
+
+        same_run =
+            (detecttype == curtype) &&
+            !is_patched(curtype) && // one per record, so each can be found
+            (curtype_count <= 0x7FFFFFFF); // avoid overflow
+
+        if(same_run && sequential_runs && curtype == 1) {
+            //
+            // A second sector decides whether the run is sequential; after
+            // that, the run ends when that changes
+            //
+            int8_t follows = msf_follows(last_address, queue + queue_start_ofs + 0x00C);
+            if(curtype_count == 1) { curtype_sequential = follows; }
+            same_run = (follows == curtype_sequential);
+        }
+
+        if(same_run && curtype >= 0 && sector_types[curtype].addressed) {
+            same_run = msf_follows(last_address, queue + queue_start_ofs + 0x00C);
+        }
+
+        if(same_run && is_fill(curtype)) {
+            same_run = !memcmp(curtype_data, fill_header, FILL_HEADER_SIZE);
+        }
+
+        //
+        // --resume: once past the next checkpoint, end the run here
+        //
+        if(resume_enabled && detecttype >= 0 && input_bytes_checked >= resume_next) {
+            same_run = 0;
+        }
+
+        if(same_run) {
+            //
+            // Same type as last sector
+            //
+            curtype_count++;
+
+        } else {
+            //
+            // Changing types: Flush the input
+            //
+            if(curtype_count > 0) {
+                int8_t runtype = curtype;
+                if(detect_span_offset >= 0) {
+                    trace_end("detect", detect_span, 0, detect_span_offset, input_bytes_checked - detect_span_offset);
+                    detect_span_offset = -1;
+                }
+                if(runtype == 1 && curtype_sequential && curtype_count > 1) {
+                    runtype = TYPE_MODE1_SEQ;
+                }
+                if(!input_seek(&in, curtype_in_start)) { goto error_in; }
+                typetally[runtype] += curtype_count;
+                if(write_sectors(
+                    runtype,
+                    curtype_count,
+                    curtype_data,
+                    infilename,
+                    &w,
+                    &in
+                )) { goto error; }
+            }
+            if(resume_enabled && detecttype >= 0 && input_bytes_checked >= resume_next) {
+                resume_edc = edc_compute(resume_edc,
+                    queue + queue_start_ofs - (size_t)(input_bytes_checked - resume_edc_end),
+                    (size_t)(input_bytes_checked - resume_edc_end));
+                resume_edc_end = input_bytes_checked;
+                if(verify_enabled && verify_finish()) { goto error; }
+                if(resume_save_encode(
+                    resume_file, &w, resume_flags, image_size, input_bytes_checked, skip_before,
+                    resume_edc, typetally, formtally
+                )) { goto error; }
+                resume_next = input_bytes_checked + RESUME_INTERVAL;
+            }
+            curtype = detecttype;
+            curtype_in_start = input_bytes_checked;
+            curtype_count = 1;
+
+        }
+
+        //
+        // Current type is negative ==> quit
+        //
+        if(curtype < 0) { break; }
+
+        if(curtype == 1 || sector_types[curtype].addressed) {
+            memcpy(last_address, queue + queue_start_ofs + 0x00C, 3);
+        }
+
+        if(curtype == TYPE_RAW_MODE2) {
+            uint32_t n = curtype_count - 1;
+            uint8_t shift = (uint8_t)((n & 3) * 2);
+            if(grow_buffer(&curtype_data, &curtype_data_alloc, form_map_size(curtype_count))) { goto error; }
+            curtype_data[n >> 2] = (uint8_t)(
+                (curtype_data[n >> 2] & ~(3 << shift)) | ((rawform - 1) << shift)
+            );
+            formtally[rawform - 1]++;
+        }
+
+        if(is_fill(curtype) && curtype_count == 1) {
+            if(grow_buffer(&curtype_data, &curtype_data_alloc, FILL_HEADER_SIZE)) { goto error; }
+            memcpy(curtype_data, fill_header, FILL_HEADER_SIZE);
+        }
+
+        if(is_reference(curtype)) {
+            //
+            // A repeat's earlier copy has been written by now
+            //
+            size_t at = (size_t)(curtype_count - 1) * REPEAT_UNIT_SIZE;
+            if(is_repeat(curtype)) { reference = match->file_offset; }
+            if(grow_buffer(&curtype_data, &curtype_data_alloc, at + REPEAT_UNIT_SIZE)) { goto error; }
+            curtype_data[at] = (uint8_t)bulk;
+            put64lsb(curtype_data + at + 1, reference);
+        }
+
+        //
+        // Advance to the next sector
+        //
+        input_bytes_checked   += sector_types[curtype].size;
+        queue_start_ofs       += sector_types[curtype].size;
+        queue_bytes_available -= sector_types[curtype].size;
+
+        //
+        // Take literal bytes still to be skipped all at once, as far as the
+        // queue goes
+        //
+        if(curtype == 0 && literal_skip > 0) {
+            uint32_t n = literal_skip;
+            if(n > queue_bytes_available) { n = (uint32_t)queue_bytes_available; }
+            if(n > 0x7FFFFFFF - curtype_count) { n = 0x7FFFFFFF - curtype_count; }
+            literal_skip          -= n;
+            curtype_count         += n;
+            input_bytes_checked   += n;
+            queue_start_ofs       += n;
+            queue_bytes_available -= n;
+        }
+
+        //
+        // Likewise take literal bytes where no sector can start, up to where
+        // the queue needs refilling or a checkpoint is due
+        //
+        if(curtype == 0 && literal_skip == 0 && !cooked) {
+            while(
+                queue_bytes_available >= 2352 &&
+                curtype_count < 0x7FFFFFFF &&
+                !(resume_enabled && input_bytes_checked >= resume_next) &&
+                !may_be_sector(queue + queue_start_ofs, queue_bytes_available)
+            ) {
+                curtype_count++;
+                input_bytes_checked++;
+                queue_start_ofs++;
+                queue_bytes_available--;
+            }
+        }
+
+    }
+
+    PERF_BYTES(input_file_length);
+
+    if(format_version == 2) { input_edc = writer_decoded_edc(&w); }
+    if(probes.expected && input_edc != probes.edc) {
+        printf("Error: %s: checksum error in the decoded image\n", infilename);
+        goto error;
+    }
+    if(probes.tiled && input_edc != probes.edc) {
+        printf("Error: %s: the partials were made from a different file\n", infilename);
+        goto error;
+    }
+    digest_finish(&digest);
+
+    //
+    // Store the end-of-records indicator, the EDC of the input file, and for
+    // version 2 the index
+    //
+    if(writer_metadata(&w, typetally)) { goto error; }
+    if(in.subchannel && subchannel_finish(&sub, &w)) { goto error; }
+    if(
+        (typetally[TYPE_BASE] || typetally[TYPE_MODE2_BASE] || typetally[TYPE_COOKED_BASE]) &&
+        writer_base(&w)
+    ) { goto error; }
+    if(container && writer_cue(&w, cue, set.starts)) { goto error; }
+    if(writer_finish(&w, input_edc)) { goto error; }
+
+    if(verify_enabled && verify_finish()) { goto error; }
+
+    //
+    // The file is complete, so the store can take in what it refers to
+    //
+    if(shared_store) {
+        store_added = shared_store->added_count;
+        if(store_commit(shared_store)) { goto error; }
+    }
+
+    //
+    // Show report
+    //
+    printf("Literal bytes........... "); fprintdec(stdout, typetally[0]); printf("\n");
+    printf("Mode 1 sectors.......... "); fprintdec(stdout, typetally[1] + typetally[TYPE_MODE1_SEQ]); printf("\n");
+    printf("Mode 2 form 1 sectors... "); fprintdec(stdout, typetally[2] + formtally[0]); printf("\n");
+    printf("Mode 2 form 2 sectors... "); fprintdec(stdout,
+        typetally[3] + typetally[TYPE_MODE2_FORM2_NOEDC] + formtally[1] + formtally[2]); printf("\n");
+    if(typetally[TYPE_MODE0]) {
+        printf("Mode 0 sectors.......... "); fprintdec(stdout, typetally[TYPE_MODE0]); printf("\n");
+    }
+    if(typetally[TYPE_COOKED]) {
+        printf("2048-byte sectors....... "); fprintdec(stdout, typetally[TYPE_COOKED]); printf("\n");
+    }
+    if(typetally[TYPE_PATCHED] || typetally[TYPE_MODE2_PATCHED]) {
+        printf("Patched sectors......... "); fprintdec(stdout,
+            typetally[TYPE_PATCHED] + typetally[TYPE_MODE2_PATCHED]); printf("\n");
+    }
+    if(typetally[TYPE_FILL] || typetally[TYPE_MODE2_FILL] || typetally[TYPE_COOKED_FILL]) {
+        printf("Fill sectors............ "); fprintdec(stdout,
+            typetally[TYPE_FILL] + typetally[TYPE_MODE2_FILL] + typetally[TYPE_COOKED_FILL]); printf("\n");
+    }
+    if(typetally[TYPE_REPEAT] || typetally[TYPE_MODE2_REPEAT] || typetally[TYPE_COOKED_REPEAT]) {
+        printf("Repeated sectors........ "); fprintdec(stdout,
+            typetally[TYPE_REPEAT] + typetally[TYPE_MODE2_REPEAT] + typetally[TYPE_COOKED_REPEAT]); printf("\n");
+    }
+    if(typetally[TYPE_BASE] || typetally[TYPE_MODE2_BASE] || typetally[TYPE_COOKED_BASE]) {
+        printf("Base image sectors...... "); fprintdec(stdout,
+            typetally[TYPE_BASE] + typetally[TYPE_MODE2_BASE] + typetally[TYPE_COOKED_BASE]); printf("\n");
+    }
+    if(shared_store) {
+        printf("Stored sectors.......... "); fprintdec(stdout,
+            typetally[TYPE_STORED] + typetally[TYPE_MODE2_STORED] + typetally[TYPE_COOKED_STORED]);
+        printf(" ("); fprintdec(stdout, (off_t)store_added); printf(" new to the store)\n");
+    }
+    if(in.subchannel) {
+        printf("Subchannel sectors...... "); fprintdec(stdout, sub.sectors);
+        printf(" ("); fprintdec(stdout, sub.stored); printf(" stored)\n");
+    }
+    printf("Encoded ");
+    fprintdec(stdout, image_size);
+    printf(" bytes -> ");
+    fprintdec(stdout, ftello(out));
+    printf(" bytes\n");
+    if(verify_enabled) {
+        printf("Verified ");
+        fprintdec(stdout, verify_checked);
+        printf(" sectors\n");
+    }
+    digest_print(&digest, infilename, NULL);
+
+    //
+    // The output is complete, so the checkpoint is of no more use
+    //
+    if(resume_enabled) { remove(resume_file); }
+
+    //
+    // Success
+    //
+    printf("Done\n");
+    returncode = 0;
+    goto done;
+
+error_in:
+    if(source && errno == EINVAL) {
+        printf("Error: %s: corrupt\n", infilename);
+    } else if(source && errno == ENOENT) {
+        printf("Error: %s: %s\n", infilename, shared_store ?
+            "sector missing from the shared store" :
+            "refers to a shared store; give it with --store=DIR");
+    } else if(source && errno == ENXIO) {
+        printf("Error: %s: %s\n", infilename, base_problem());
+    } else {
+        printfileerror(in.set ? set.files[set.current] : in.f, infilename);
+    }
+    goto error;
+
+error_out:
+    printfileerror(out, outfilename);
+    goto error;
+
+error:
+    returncode = 1;
+    goto done;
+
+done:
+    if(verify_enabled) { verify_free(); }
+    digest_free(&digest);
+    probe_cache_free(&probes);
+    cue_layout_free(&layout);
+    input_set_close(&set);
+    writer_free(&w);
+    if(checkpoint.index != NULL) { free(checkpoint.index); }
+    if(checkpoint.dedupe != NULL) { free(checkpoint.dedupe); }
+    if(resume_file != NULL) { free(resume_file); }
+    if(queue != NULL) { free(queue); }
+    if(curtype_data != NULL) { free(curtype_data); }
+    if(dedupe_table != NULL) { free(dedupe_table); dedupe_table = NULL; }
+    if(in.f  != NULL) { fclose(in.f); }
+    if(sub.data != NULL) { free(sub.data); }
+    if(out   != NULL) { fclose(out); }
+
+    PERF_LEAVE();
+    return returncode;
+}
+
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Result of decoding an ECM record stream
+//
+#define DECODE_OK       0
+#define DECODE_ERROR_IN 1 // read error or unexpected end of input
+#define DECODE_ERROR_OUT 2
+#define DECODE_CORRUPT  3 // invalid sector count
+#define DECODE_CHECKSUM 4 // decoded fine, but the EDC doesn't match
+
+#define DECODE_NOMEM    5
+#define DECODE_NOT_ECM  6 // magic identifier missing
+#define DECODE_BAD_INDEX 7 // version 2 trailer, directory or index missing or bad
+#define DECODE_STORE    8 // a stored sector isn't in the shared store
+#define DECODE_BASE     9 // no base image, or not the one the file needs
+#define DECODE_RESUME  10 // a checkpoint couldn't be written (with a message)
+
+typedef struct {
+    off_t    output_bytes;
+    uint32_t output_edc;
+    uint32_t stored_edc;
+    off_t    failed_block; // version 2: block the error was found in, or -1
+    int      error;        // version 2: errno for DECODE_ERROR_IN, or -1 for end-of-file
+} decode_result;
+
+//
+// Records come either straight from a file (version 1) or from a block that
+// has already been read into memory (version 2)
+//
+typedef struct {
+    FILE*          f;    // NULL to read from data
+    const uint8_t* data;
+    size_t         size;
+    size_t         pos;
+    int8_t         extended; // version 2: extended types allowed
+    FILE*          source;   // version 2: the file, for repeat records
+    int8_t         no_rebuild; // read_sector leaves the rest of the sector out
+} record_reader;
+
+static int reader_getc(record_reader* r) {
+    if(r->f) { return fgetc(r->f); }
+    if(r->pos >= r->size) { return EOF; }
+    return r->data[r->pos++];
+}
+
+//
+// Returns nonzero if all size bytes were read
+//
+static int8_t reader_read(record_reader* r, uint8_t* dest, size_t size) {
+    if(r->f) {
+        return fread(dest, 1, size, r->f) == size;
+    }
+    if(size > r->size - r->pos) { return 0; }
+    memcpy(dest, r->data + r->pos, size);
+    r->pos += size;
+    return 1;
+}
+
+#ifndef ECM_NO_MAIN
+
+//
+// Decoded output is gathered into batches, so it goes out in large writes
+//
+#define DECODE_BATCH_SIZE 0x40000
+
+typedef struct {
+    FILE*    out;
+    uint8_t* batch;        // NULL when there's no output file
+    size_t   batch_used;
+    off_t    batch_offset; // output offset of the start of the batch
+    off_t    end;          // output offset the data must not go past, or -1
+    double   batch_span;
+    unsigned tid;
+    uint32_t edc;
+    image_digest* digest;  // if set, takes each batch as it's flushed
+
+    //
+    // ecm2bin --iso: only the user data of each sector goes out (see
+    // decode_put_user_data)
+    //
+    int8_t   user_data;
+    int8_t   rebuild;       // user_data: rebuild every sector, for image_edc
+    uint32_t image_edc;     // rebuild: EDC of the decoded image
+    off_t    image_size;    // user_data: size of the decoded image so far
+    size_t   pending_size;  // user_data: bytes of the current sector so far
+    uint8_t  pending[2352];
+} decode_output;
+
+//
+// Set up to decode into out, in batches; or, with out NULL, into the given
+// buffer, which must hold everything up to end; or, with both NULL, nowhere
+//
+static void decode_output_init(
+    decode_output* o,
+    FILE* out,
+    uint8_t* batch,
+    off_t offset,
+    off_t end,
+    unsigned tid
+) {
+    o->out = out;
+    o->batch = batch;
+    o->batch_used = 0;
+    o->batch_offset = offset;
+    o->end = end;
+    o->batch_span = trace_begin();
+    o->tid = tid;
+    o->edc = 0;
+    o->digest = NULL;
+    o->user_data = 0;
+    o->rebuild = 0;
+    o->image_edc = 0;
+    o->image_size = 0;
+    o->pending_size = 0;
+}
+
+//
+// Returns nonzero on error
+//
+static int8_t decode_flush(decode_output* o) {
+    trace_end("reconstruct", o->batch_span, o->tid, o->batch_offset, o->batch_used);
+    if(o->batch) {
+        digest_put(o->digest, o->batch, o->batch_used);
+    }
+    if(o->out && o->batch_used) {
+        double span = trace_begin();
+        int8_t failed;
+        PERF_ENTER(PHASE_IO);
+        failed = (fwrite(o->batch, 1, o->batch_used, o->out) != o->batch_used);
+        PERF_LEAVE();
+        if(failed) { return 1; }
+        trace_end("write", span, o->tid, o->batch_offset, o->batch_used);
+    }
+    o->batch_offset += o->batch_used;
+    o->batch_used = 0;
+    o->batch_span = trace_begin();
+    return 0;
+}
+
+//
+// Returns one of the DECODE_* codes
+//
+static int8_t decode_put(decode_output* o, const uint8_t* data, size_t size) {
+    if(o->end >= 0 && (off_t)size > o->end - (o->batch_offset + (off_t)o->batch_used)) {
+        return DECODE_CORRUPT;
+    }
+    o->edc = edc_compute(o->edc, data, size);
+    if(o->batch) {
+        memcpy(o->batch + o->batch_used, data, size);
+    }
+    o->batch_used += size;
+    if((o->out || o->digest || !o->batch) && o->batch_used > DECODE_BATCH_SIZE - 2352) {
+        if(decode_flush(o)) { return DECODE_ERROR_OUT; }
+    }
+    return DECODE_OK;
+}
+
+//
+// Put out the 2048 bytes of user data of a sector: type is the type it was
+// read as (the body's type for TYPE_RAW_MODE2), which for mode 1 and mode 2
+// types says where the user data is even if the sector wasn't rebuilt.
+// Otherwise the sector is whole, and its header says.  Sectors without a
+// sync pattern (audio) have none; mode 2 form 2 sectors give the first 2048
+// bytes of theirs, as in other ISO extractors, so sectors keep their places.
+//
+// Returns one of the DECODE_* codes
+//
+static int8_t decode_put_user_data(decode_output* o, int8_t type, const uint8_t* sector) {
+    size_t offset;
+    if(type == 1 || type == TYPE_MODE1_SEQ) {
+        offset = 0x010;
+    } else if(is_mode2_bulk(type) || sector_types[type].size == 2336) {
+        offset = 0x018;
+    } else if(!has_sync(sector)) {
+        return DECODE_OK;
+    } else if(sector[0x00F] == 0x00 || sector[0x00F] == 0x01) {
+        offset = 0x010;
+    } else if(sector[0x00F] == 0x02) {
+        offset = 0x018;
+    } else {
+        return DECODE_OK;
+    }
+    return decode_put(o, sector + offset, 0x800);
+}
+
+//
+// Put out bytes of the decoded image; with user_data, they're gathered into
+// sectors first
+//
+// Returns one of the DECODE_* codes
+//
+static int8_t decode_put_data(decode_output* o, const uint8_t* data, size_t size) {
+    if(!o->user_data) { return decode_put(o, data, size); }
+    if(o->rebuild) { o->image_edc = edc_compute(o->image_edc, data, size); }
+    o->image_size += (off_t)size;
+    while(size) {
+        size_t n = sizeof(o->pending) - o->pending_size;
+        if(n > size) { n = size; }
+        memcpy(o->pending + o->pending_size, data, n);
+        o->pending_size += n;
+        data += n;
+        size -= n;
+        if(o->pending_size == sizeof(o->pending)) {
+            int8_t status;
+            o->pending_size = 0;
+            status = decode_put_user_data(o, 0, o->pending);
+            if(status != DECODE_OK) { return status; }
+        }
+    }
+    return DECODE_OK;
+}
+
+//
+// Whether a unit of the given size would finish a sector by itself (at most
+// the sync and header having come before it as literal bytes), so that with
+// user_data its sector needn't be rebuilt
+//
+static int8_t decode_unit_aligned(const decode_output* o, size_t size) {
+    return o->user_data && !o->rebuild && o->pending_size == 2352 - size;
+}
+
+//
+// Put out a unit of the given size, at the end of a 2352-byte sector buffer,
+// that was read as the given type (as for decode_put_user_data)
+//
+// Returns one of the DECODE_* codes
+//
+static int8_t decode_put_unit(decode_output* o, int8_t type, const uint8_t* sector, size_t size) {
+    const uint8_t* unit = sector + 2352 - size;
+    if(!o->user_data) { return decode_put(o, unit, size); }
+    if(size == 2048) {
+        //
+        // An image of 2048-byte sectors is all user data
+        //
+        if(o->rebuild) { o->image_edc = edc_compute(o->image_edc, unit, size); }
+        o->image_size += (off_t)size;
+        return decode_put(o, unit, size);
+    }
+    if(o->pending_size != 2352 - size) { return decode_put_data(o, unit, size); }
+    if(o->rebuild) { o->image_edc = edc_compute(o->image_edc, unit, size); }
+    o->image_size += (off_t)size;
+    o->pending_size = 0;
+    return decode_put_user_data(o, type, sector);
+}
+
+#endif
+
+//
+// Read the stored part of one sector of the given type and rebuild the rest;
+// buffer must hold 2352 bytes, and the decoded unit is the last
+// sector_types[type].size of them.  For addressed types, the caller fills in
+// the address.  With in->no_rebuild, only the stored parts are filled in.
+//
+// Returns nonzero if the whole sector was read
+//
+static int8_t read_sector(record_reader* in, int8_t type, uint8_t* buffer) {
+    const sector_type* t = sector_types + type;
+    int i;
+    for(i = 0; i < 2; i++) {
+        if(t->stored[i][1] && !reader_read(in, buffer + t->stored[i][0], t->stored[i][1])) {
+            return 0;
+        }
+    }
+    if(t->rebuild && !in->no_rebuild) { reconstruct_sector(buffer, t->rebuild); }
+    return 1;
+}
+
+//
+// Rebuild a sector of a repeat, stored or base record from its reference,
+// reading the bulk from the file, the shared store or the base image; for
+// 2352-byte units, sector already holds the address
+//
+// Returns one of the DECODE_* codes
+//
+static int8_t read_repeat(FILE* in, int8_t type, const uint8_t* reference, uint8_t* sector) {
+    const sector_type* b;
+    off_t offset = get64lsb(reference + 1);
+    if(!bulk_fits(type, reference[0])) { return DECODE_CORRUPT; }
+    b = sector_types + reference[0];
+    if(is_stored(type)) {
+        if(store_read(shared_store, (int8_t)reference[0], offset, sector)) { return DECODE_STORE; }
+    } else if(is_based(type)) {
+        if(base_read((int8_t)reference[0], offset, sector)) { return DECODE_BASE; }
+    } else {
+        if(!in || offset < 4) { return DECODE_CORRUPT; }
+        if(
+            fseeko(in, offset, SEEK_SET) != 0 ||
+            fread(sector + b->stored[0][0], 1, b->stored[0][1], in) != b->stored[0][1]
+        ) {
+            return DECODE_ERROR_IN;
+        }
+    }
+    if(b->rebuild) { reconstruct_sector(sector, b->rebuild); }
+    return DECODE_OK;
+}
+
+//
+// Read a type/count combo; *num is the count minus 1, or 0xFFFFFFFF for the
+// end-of-records indicator
+//
+// Returns one of the DECODE_* codes
+//
+static int8_t read_record_header(record_reader* in, int8_t* type, uint32_t* num) {
+    int c = reader_getc(in);
+    int first = c;
+    int bits = 5;
+    if(c == EOF) { return DECODE_ERROR_IN; }
+    *type = c & 3;
+    *num = (c >> 2) & 0x1F;
+    while(c & 0x80) {
+        c = reader_getc(in);
+        if(c == EOF) { return DECODE_ERROR_IN; }
+        if(c == 0 && bits == 5 && in->extended) {
+            //
+            // Extended type
+            //
+            if((first & 0x7F) >= TYPE_COUNT - TYPE_EXTENDED) { return DECODE_CORRUPT; }
+            *type = (int8_t)(TYPE_EXTENDED + (first & 0x7F));
+            *num = 0;
+            bits = 0;
+            do {
+                c = reader_getc(in);
+                if(c == EOF) { return DECODE_ERROR_IN; }
+                if(bits > 28 || (bits == 28 && (c & 0x7F) > 0x0F)) { return DECODE_CORRUPT; }
+                *num |= ((uint32_t)(c & 0x7F)) << bits;
+                bits += 7;
+            } while(c & 0x80);
+            return DECODE_OK;
+        }
+        if(
+            (bits > 31) ||
+            ((uint32_t)(c & 0x7F)) >= (((uint32_t)0x80000000LU) >> (bits-1))
+        ) {
+            return DECODE_CORRUPT;
+        }
+        *num |= ((uint32_t)(c & 0x7F)) << bits;
+        bits += 7;
+    }
+    return DECODE_OK;
+}
+
+#ifndef ECM_NO_MAIN
+
+//
+// Decode records until the end-of-records indicator (reading from a file) or
+// the end of the data (reading from memory, where the indicator isn't
+// allowed)
+//
+// Returns one of the DECODE_* codes
+//
+static int8_t decode_records(
+    record_reader* in,
+    decode_output* o,
+    int8_t show_progress
+) {
+    uint8_t buffer[2352];
+    int8_t status;
+    int8_t type;
+    uint32_t num;
+
+    for(;;) {
+        if(!in->f && in->pos == in->size) {
+            // End of block
+            break;
+        }
+        status = read_record_header(in, &type, &num);
+        if(status != DECODE_OK) { return status; }
+        if(num == 0xFFFFFFFF) {
+            // End indicator
+            if(!in->f) { return DECODE_CORRUPT; }
+            break;
+        }
+        num++;
+        if(type == 0) {
+            while(num) {
+                uint32_t b = num;
+                if(b > 2352) { b = 2352; }
+                if(!reader_read(in, buffer, b)) { return DECODE_ERROR_IN; }
+                status = decode_put_data(o, buffer, b);
+                if(status != DECODE_OK) { return status; }
+                num -= b;
+                if(show_progress && in->f) { setcounter_decode(ftello(in->f)); }
+            }
+        } else {
+            const sector_type* st = sector_types + type;
+            uint8_t address[3];
+            uint8_t fill[FILL_HEADER_SIZE];
+            const uint8_t* forms = NULL;
+            uint32_t i;
+            if(st->addressed) {
+                if(!reader_read(in, address, 3)) { return DECODE_ERROR_IN; }
+                if(msf_to_frames(address) < 0) { return DECODE_CORRUPT; }
+            }
+            if(is_fill(type)) {
+                if(!reader_read(in, fill, FILL_HEADER_SIZE)) { return DECODE_ERROR_IN; }
+                if(!bulk_fits(type, fill[0])) { return DECODE_CORRUPT; }
+            }
+            if(is_patched(type) && in->f) {
+                // Only found in version 2 blocks
+                return DECODE_CORRUPT;
+            }
+            if(type == TYPE_RAW_MODE2) {
+                //
+                // Only found in version 2 blocks, which are decoded from
+                // memory
+                //
+                size_t bytes = form_map_size(num);
+                if(in->f) { return DECODE_CORRUPT; }
+                if(bytes > in->size - in->pos) { return DECODE_ERROR_IN; }
+                forms = in->data + in->pos;
+                in->pos += bytes;
+            }
+            for(i = 0; i < num; i++) {
+                int8_t readtype = type;
+                if(st->addressed) {
+                    memcpy(buffer + 0x00C, address, 3);
+                    msf_add(address, 1, address);
+                }
+                if(type == TYPE_RAW_MODE2) {
+                    uint8_t code = form_code(forms, i);
+                    if(code >= RAW_FORM_CODES) { return DECODE_CORRUPT; }
+                    readtype = raw_form_types[code];
+                }
+                //
+                // Only the user data is wanted: mode 1 and mode 2 sectors
+                // have it stored as-is
+                //
+                in->no_rebuild = decode_unit_aligned(o, st->size) &&
+                    (readtype == 1 || is_bulk(readtype));
+                if(is_patched(type)) {
+                    size_t used;
+                    switch(patch_decode(type, in->data + in->pos, in->size - in->pos, buffer, &used)) {
+                    case 0: break;
+                    case 1: return DECODE_ERROR_IN;
+                    default: return DECODE_CORRUPT;
+                    }
+                    in->pos += used;
+                } else if(is_fill(type)) {
+                    fill_sector(fill, buffer);
+                } else if(is_reference(type)) {
+                    uint8_t reference[REPEAT_UNIT_SIZE];
+                    if(!reader_read(in, reference, REPEAT_UNIT_SIZE)) { return DECODE_ERROR_IN; }
+                    status = read_repeat(in->source, type, reference, buffer);
+                    if(status != DECODE_OK) { return status; }
+                } else if(!read_sector(in, readtype, buffer)) {
+                    return DECODE_ERROR_IN;
+                }
+                status = decode_put_unit(o, readtype, buffer, st->size);
+                if(status != DECODE_OK) { return status; }
+                if(show_progress && in->f) { setcounter_decode(ftello(in->f)); }
+            }
+        }
+    }
+    return DECODE_OK;
+}
+
+//
+// Decode a version 1 stream, starting just past the magic identifier,
+// through the EDC at the end
+//
+// out may be NULL to reconstruct and check the data without writing it.
+// The decoded data also goes to digest, if set.
+//
+// Returns one of the DECODE_* codes
+//
+static int8_t decode_stream(
+    FILE* in,
+    FILE* out,
+    image_digest* digest,
+    int8_t show_progress,
+    unsigned tid,
+    decode_result* result
+) {
+    int8_t status;
+    record_reader r;
+    decode_output o;
+    uint8_t edc[4];
+
+    memset(&r, 0, sizeof(r));
+    r.f = in;
+    result->failed_block = -1;
+
+    decode_output_init(&o, out, NULL, 0, -1, tid);
+    o.digest = digest;
+    if(out || digest) {
+        o.batch = malloc(DECODE_BATCH_SIZE);
+        if(!o.batch) { return DECODE_NOMEM; }
+    }
+
+    {   PERF_ENTER(PHASE_DECODE);
+        status = decode_records(&r, &o, show_progress);
+        PERF_LEAVE();
+    }
+    if(status != DECODE_OK) { goto done; }
+    if(decode_flush(&o)) { status = DECODE_ERROR_OUT; goto done; }
+
+    //
+    // Verify the EDC of the entire output file
+    //
+    if(fread(edc, 1, 4, in) != 4) { status = DECODE_ERROR_IN; goto done; }
+
+    PERF_BYTES(o.batch_offset);
+
+    result->output_bytes = o.batch_offset;
+    result->output_edc = o.edc;
+    result->stored_edc = get32lsb(edc);
+
+    status = (result->stored_edc == o.edc) ? DECODE_OK : DECODE_CHECKSUM;
+
+done:
+    if(o.batch != NULL) { free(o.batch); }
+    return status;
+}
+
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// An opened ECM file: its version and, for version 2, where the blocks are
+//
+typedef struct {
+    off_t offset;        // file offset of the block header
+    off_t output_offset; // offset of the block's data in the decoded output
+} ecm_block;
+
+typedef struct {
+    int8_t     version;
+    off_t      file_size;
+
+    //
+    // Version 2 only
+    //
+    off_t      output_size;
+    uint32_t   output_edc;
+    off_t      directory_offset;
+    uint8_t*   directory;      // section entries, as stored
+    size_t     section_count;
+    ecm_block* blocks;
+    size_t     block_count;
+} ecm_container;
+
+static void container_free(ecm_container* c) {
+    if(c->directory) { free(c->directory); c->directory = NULL; }
+    if(c->blocks   ) { free(c->blocks   ); c->blocks    = NULL; }
+}
+
+//
+// Look up a section by tag
+//
+// Returns nonzero if found
+//
+static int8_t container_section(const ecm_container* c, const char* tag, off_t* offset, off_t* size) {
+    size_t i;
+    for(i = 0; i < c->section_count; i++) {
+        const uint8_t* entry = c->directory + ECM_DIRECTORY_ENTRY_SIZE * i;
+        if(!memcmp(entry, tag, 4)) {
+            *offset = get64lsb(entry + 4);
+            *size   = get64lsb(entry + 12);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+//
+// Read the magic identifier and, for version 2, the trailer, directory and
+// index; leaves a version 1 file positioned just past the magic identifier
+//
+// Returns one of the DECODE_* codes
+//
+static int8_t container_open(FILE* in, ecm_container* c) {
+    uint8_t buffer[ECM_TRAILER_SIZE];
+    uint8_t* index = NULL;
+    off_t index_offset;
+    off_t index_size;
+    off_t directory_size;
+    off_t end;
+    size_t i;
+    int8_t status = DECODE_OK;
+
+    memset(c, 0, sizeof(*c));
+
+    if(fseeko(in, 0, SEEK_END) != 0) { return DECODE_ERROR_IN; }
+    c->file_size = ftello(in);
+    if(c->file_size < 0) { return DECODE_ERROR_IN; }
+    if(fseeko(in, 0, SEEK_SET) != 0) { return DECODE_ERROR_IN; }
+
+    if(fread(buffer, 1, 4, in) != 4 || memcmp(buffer, "ECM", 3)) {
+        return ferror(in) ? DECODE_ERROR_IN : DECODE_NOT_ECM;
+    }
+    if(buffer[3] == 0x00) {
+        c->version = 1;
+        return DECODE_OK;
+    }
+    if(buffer[3] != 0x02) { return DECODE_NOT_ECM; }
+    c->version = 2;
+
+    //
+    // Trailer
+    //
+    if(c->file_size < 4 + ECM_TRAILER_SIZE) { return DECODE_BAD_INDEX; }
+    if(fseeko(in, c->file_size - ECM_TRAILER_SIZE, SEEK_SET) != 0) { return DECODE_ERROR_IN; }
+    if(fread(buffer, 1, ECM_TRAILER_SIZE, in) != ECM_TRAILER_SIZE) { return DECODE_ERROR_IN; }
+    if(memcmp(buffer + 20, ecm_magic_v2, 4)) { return DECODE_BAD_INDEX; }
+    c->directory_offset = get64lsb(buffer);
+    c->output_size      = get64lsb(buffer + 8);
+    c->output_edc       = get32lsb(buffer + 16);
+
+    //
+    // Directory
+    //
+    end = c->file_size - ECM_TRAILER_SIZE;
+    if(c->directory_offset < 4 || c->directory_offset > end - 4 || c->output_size < 0) {
+        return DECODE_BAD_INDEX;
+    }
+    if(fseeko(in, c->directory_offset, SEEK_SET) != 0) { return DECODE_ERROR_IN; }
+    if(fread(buffer, 1, 4, in) != 4) { return DECODE_ERROR_IN; }
+    c->section_count = get32lsb(buffer);
+    directory_size = end - c->directory_offset - 4;
+    if(directory_size != ((off_t)c->section_count) * ECM_DIRECTORY_ENTRY_SIZE) {
+        return DECODE_BAD_INDEX;
+    }
+    if(directory_size) {
+        c->directory = malloc((size_t)directory_size);
+        if(!c->directory) { status = DECODE_NOMEM; goto error; }
+        if(fread(c->directory, 1, (size_t)directory_size, in) != (size_t)directory_size) {
+            status = DECODE_ERROR_IN;
+            goto error;
+        }
+    }
+
+    //
+    // Each section must lie between the magic identifier and the directory
+    //
+    for(i = 0; i < c->section_count; i++) {
+        const uint8_t* entry = c->directory + ECM_DIRECTORY_ENTRY_SIZE * i;
+        off_t offset = get64lsb(entry + 4);
+        off_t size   = get64lsb(entry + 12);
+        if(offset < 4 || size < 0 || offset > c->directory_offset || size > c->directory_offset - offset) {
+            status = DECODE_BAD_INDEX;
+            goto error;
+        }
+    }
+
+    //
+    // Index
+    //
+    if(!container_section(c, "INDX", &index_offset, &index_size)) {
+        status = DECODE_BAD_INDEX;
+        goto error;
+    }
+    if(
+        index_offset < 4 || index_size < 0 ||
+        index_offset > c->directory_offset ||
+        index_size > c->directory_offset - index_offset ||
+        index_size % ECM_INDEX_ENTRY_SIZE
+    ) {
+        status = DECODE_BAD_INDEX;
+        goto error;
+    }
+    c->block_count = (size_t)(index_size / ECM_INDEX_ENTRY_SIZE);
+    if(c->block_count) {
+        index = malloc((size_t)index_size);
+        c->blocks = malloc(c->block_count * sizeof(ecm_block));
+        if(!index || !c->blocks) { status = DECODE_NOMEM; goto error; }
+        if(fseeko(in, index_offset, SEEK_SET) != 0) { status = DECODE_ERROR_IN; goto error; }
+        if(fread(index, 1, (size_t)index_size, in) != (size_t)index_size) {
+            status = DECODE_ERROR_IN;
+            goto error;
+        }
+    }
+    for(i = 0; i < c->block_count; i++) {
+        ecm_block* b = c->blocks + i;
+        b->offset        = get64lsb(index + ECM_INDEX_ENTRY_SIZE * i);
+        b->output_offset = get64lsb(index + ECM_INDEX_ENTRY_SIZE * i + 8);
+        //
+        // Blocks must start right after the magic identifier and follow one
+        // another in both the file and the output
+        //
+        if(
+            (i == 0 && (b->offset != 4 || b->output_offset != 0)) ||
+            (i > 0 && (
+                b->offset <= b[-1].offset + ECM_BLOCK_HEADER_SIZE ||
+                b->output_offset <= b[-1].output_offset ||
+                b->output_offset - b[-1].output_offset > ECM_BLOCK_SIZE
+            )) ||
+            b->offset + ECM_BLOCK_HEADER_SIZE > c->directory_offset ||
+            b->output_offset >= c->output_size
+        ) {
+            status = DECODE_BAD_INDEX;
+            goto error;
+        }
+    }
+    if(
+        (c->block_count == 0 && c->output_size != 0) ||
+        (c->block_count > 0 &&
+            c->output_size - c->blocks[c->block_count - 1].output_offset > ECM_BLOCK_SIZE)
+    ) {
+        status = DECODE_BAD_INDEX;
+        goto error;
+    }
+    free(index);
+    return DECODE_OK;
+
+error:
+    if(index != NULL) { free(index); }
+    container_free(c);
+    return status;
+}
+
+#ifndef ECM_NO_MAIN
+
+//
+// Decoded size of a version 2 block, from the index
+//
+static size_t block_size(const ecm_container* c, size_t block) {
+    off_t next = (block + 1 < c->block_count) ?
+        c->blocks[block + 1].output_offset : c->output_size;
+    return (size_t)(next - c->blocks[block].output_offset);
+}
+
+#endif
+
+//
+// Check that the base image the "BASE" section names, if there is one, is
+// the one given
+//
+// Returns one of the DECODE_* codes
+//
+static int8_t base_check(FILE* in, const ecm_container* c) {
+    uint8_t data[ECM_BASE_SIZE];
+    off_t offset;
+    off_t size;
+    if(c->version != 2 || !container_section(c, "BASE", &offset, &size)) { return DECODE_OK; }
+    if(size != ECM_BASE_SIZE) { return DECODE_CORRUPT; }
+    if(fseeko(in, offset, SEEK_SET) != 0 || fread(data, 1, sizeof(data), in) != sizeof(data)) {
+        return DECODE_ERROR_IN;
+    }
+    if(
+        !base_file ||
+        get64lsb(data) != base_file_size ||
+        get64lsb(data + 8) != base_size ||
+        get32lsb(data + 16) != base_edc
+    ) {
+        return DECODE_BASE;
+    }
+    return DECODE_OK;
+}
+
+#ifndef ECM_NO_MAIN
+
+//
+// Load the cue sheet and the names and sizes of its files, from the "CUES"
+// and "TRKS" sections of a container (bin2ecm foo.cue); the sheet is left
+// empty if the file has none
+//
+// Returns one of the DECODE_* codes
+//
+static int8_t container_cue(FILE* in, const ecm_container* c, cue_sheet* cue) {
+    uint8_t* table = NULL;
+    off_t offset;
+    off_t size;
+    off_t table_offset;
+    off_t table_size;
+    size_t used = 4;
+    size_t i;
+    int8_t status = DECODE_CORRUPT;
+
+    memset(cue, 0, sizeof(*cue));
+    if(c->version != 2 || !container_section(c, "CUES", &offset, &size)) { return DECODE_OK; }
+    if(
+        !container_section(c, "TRKS", &table_offset, &table_size) ||
+        size > 0x100000 || table_size < 4 || table_size > 0x100000
+    ) { return DECODE_CORRUPT; }
+
+    cue->text = malloc((size_t)size + 1);
+    table = malloc((size_t)table_size);
+    if(!cue->text || !table) { status = DECODE_NOMEM; goto error; }
+    if(
+        fseeko(in, offset, SEEK_SET) != 0 ||
+        fread(cue->text, 1, (size_t)size, in) != (size_t)size ||
+        fseeko(in, table_offset, SEEK_SET) != 0 ||
+        fread(table, 1, (size_t)table_size, in) != (size_t)table_size
+    ) { status = DECODE_ERROR_IN; goto error; }
+    cue->text[size] = 0;
+    cue->text_size = (size_t)size;
+
+    cue->file_count = get32lsb(table);
+    if(cue->file_count < 1 || cue->file_count > (size_t)table_size / 12) { goto error; }
+    cue->files = calloc(cue->file_count, sizeof(char*));
+    cue->sizes = calloc(cue->file_count, sizeof(off_t));
+    if(!cue->files || !cue->sizes) { status = DECODE_NOMEM; goto error; }
+    for(i = 0; i < cue->file_count; i++) {
+        size_t length;
+        if((size_t)table_size - used < 12) { goto error; }
+        cue->sizes[i] = get64lsb(table + used);
+        length = get32lsb(table + used + 8);
+        used += 12;
+        if(cue->sizes[i] < 0 || length > (size_t)table_size - used) { goto error; }
+        cue->files[i] = malloc(length + 1);
+        if(!cue->files[i]) { status = DECODE_NOMEM; goto error; }
+        memcpy(cue->files[i], table + used, length);
+        cue->files[i][length] = 0;
+        used += length;
+        if(strlen(cue->files[i]) != length || !cue_plain_name(cue->files[i])) { goto error; }
+    }
+    if(used != (size_t)table_size || cue_parse(cue, NULL)) { goto error; }
+
+    free(table);
+    return DECODE_OK;
+
+error:
+    if(table) { free(table); }
+    cue_free(cue);
+    return status;
+}
+
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Reading the "SUBC" section
+//
+// The whole section is loaded and checked against its EDC when the file is
+// opened; after that, any sector's subchannel data can be had directly.
+//
+typedef struct {
+    off_t          first;       // first sector of the run
+    uint32_t       count;
+    const uint8_t* stored;      // the run's sectors, or NULL if predicted
+    const uint8_t* base;        // predicted: the last stored sector before it
+    off_t          base_sector;
+} subchannel_run;
+
+typedef struct {
+    int8_t          layout;
+    off_t           sectors;    // 0 if the file has no subchannel data
+    uint8_t*        data;
+    subchannel_run* runs;
+    size_t          run_count;
+    off_t           written;    // interleaving: sector bytes written so far
+} subchannel;
+
+static void subchannel_free(subchannel* s) {
+    if(s->data) { free(s->data); }
+    if(s->runs) { free(s->runs); }
+    memset(s, 0, sizeof(*s));
+}
+
+//
+// Get the subchannel data of one sector
+//
+// Returns nonzero on success
+//
+static int8_t subchannel_sector(const subchannel* s, off_t sector, uint8_t* sub) {
+    size_t lo = 0;
+    size_t hi = s->run_count;
+    const subchannel_run* run;
+    if(sector < 0 || sector >= s->sectors) { return 0; }
+    while(hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if(s->runs[mid].first <= sector) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    run = s->runs + lo;
+    if(run->stored) {
+        memcpy(sub, run->stored + (size_t)(sector - run->first) * SUBCHANNEL_SIZE, SUBCHANNEL_SIZE);
+        return 1;
+    }
+    return subchannel_predict(run->base, sector - run->base_sector, s->layout, sub);
+}
+
+//
+// Load the "SUBC" section, if there is one, and check it
+//
+// Returns one of the DECODE_* codes
+//
+static int8_t subchannel_open(FILE* in, const ecm_container* c, subchannel* s) {
+    off_t offset;
+    off_t size;
+    size_t pos;
+    off_t sector = 0;
+    off_t k;
+    const uint8_t* base = NULL;
+    off_t base_sector = 0;
+    uint32_t edc = 0;
+    size_t alloc = 0;
+    uint8_t header[ECM_SUBC_HEADER_SIZE];
+
+    memset(s, 0, sizeof(*s));
+    if(c->version != 2 || !container_section(c, "SUBC", &offset, &size)) { return DECODE_OK; }
+    if(size < ECM_SUBC_HEADER_SIZE) { return DECODE_CORRUPT; }
+    if(fseeko(in, offset, SEEK_SET) != 0) { return DECODE_ERROR_IN; }
+    if(fread(header, 1, sizeof(header), in) != sizeof(header)) { return DECODE_ERROR_IN; }
+
+    s->layout = (int8_t)get32lsb(header);
+    s->sectors = get64lsb(header + 4);
+    if(
+        get32lsb(header) > SUBCHANNEL_PACKED || s->sectors < 0 ||
+        s->sectors > c->output_size / 2352 ||
+        c->output_size != s->sectors * 2352
+    ) {
+        return DECODE_CORRUPT;
+    }
+
+    //
+    // Each sector takes at most a run of its own: a count and its data
+    //
+    if(
+        size - ECM_SUBC_HEADER_SIZE > s->sectors * (4 + SUBCHANNEL_SIZE) ||
+        (off_t)(size_t)size != size
+    ) {
+        return DECODE_CORRUPT;
+    }
+    s->data = malloc((size_t)size);
+    if(!s->data) { return DECODE_NOMEM; }
+    memcpy(s->data, header, sizeof(header));
+    if(fread(s->data + sizeof(header), 1, (size_t)size - sizeof(header), in) != (size_t)size - sizeof(header)) {
+        return DECODE_ERROR_IN;
+    }
+
+    //
+    // Runs
+    //
+    for(pos = ECM_SUBC_HEADER_SIZE; pos < (size_t)size; ) {
+        subchannel_run* run;
+        uint32_t word;
+        if((size_t)size - pos < 4) { return DECODE_CORRUPT; }
+        word = get32lsb(s->data + pos);
+        pos += 4;
+        if(s->run_count == alloc) {
+            size_t n = alloc ? alloc * 2 : 64;
+            subchannel_run* p = realloc(s->runs, n * sizeof(subchannel_run));
+            if(!p) { return DECODE_NOMEM; }
+            s->runs = p;
+            alloc = n;
+        }
+        run = s->runs + s->run_count++;
+        run->first = sector;
+        run->count = word & 0x7FFFFFFF;
+        run->stored = NULL;
+        run->base = base;
+        run->base_sector = base_sector;
+        if(run->count == 0 || run->count > s->sectors - sector) { return DECODE_CORRUPT; }
+        if(word & 0x80000000LU) {
+            size_t bytes = (size_t)run->count * SUBCHANNEL_SIZE;
+            if((size_t)size - pos < bytes) { return DECODE_CORRUPT; }
+            run->stored = s->data + pos;
+            pos += bytes;
+            base = s->data + pos - SUBCHANNEL_SIZE;
+            base_sector = sector + run->count - 1;
+        } else if(!base) {
+            return DECODE_CORRUPT;
+        }
+        sector += run->count;
+    }
+    if(sector != s->sectors) { return DECODE_CORRUPT; }
+
+    //
+    // Every sector must come out right
+    //
+    for(k = 0; k < s->sectors; k++) {
+        uint8_t sub[SUBCHANNEL_SIZE];
+        if(!subchannel_sector(s, k, sub)) { return DECODE_CORRUPT; }
+        edc = edc_compute(edc, sub, SUBCHANNEL_SIZE);
+    }
+    if(edc != get32lsb(s->data + 12)) { return DECODE_CHECKSUM; }
+    return DECODE_OK;
+}
+
+#ifndef ECM_NO_MAIN
+
+//
+// Offset in the image of the given offset in the decoded sectors
+//
+static off_t subchannel_image_offset(const subchannel* s, off_t offset) {
+    if(!s->sectors) { return offset; }
+    return (offset / 2352) * 2448 + offset % 2352;
+}
+
+//
+// Files the decoded image of a container (bin2ecm foo.cue) is split into
+//
+typedef struct {
+    FILE**   files;
+    off_t*   ends;    // image offset where each file ends
+    size_t   count;
+    size_t   current;
+    off_t    written;
+} track_output;
+
+//
+// Write to out, or with tracks set, to whichever of its files the data goes in
+//
+// Returns nonzero if all size bytes were written
+//
+static int8_t image_put(FILE* out, track_output* tracks, const uint8_t* data, size_t size) {
+    if(!tracks) { return !out || fwrite(data, 1, size, out) == size; }
+    while(size) {
+        size_t n = size;
+        while(tracks->current < tracks->count && tracks->written >= tracks->ends[tracks->current]) {
+            tracks->current++;
+        }
+        if(tracks->current == tracks->count) { return 0; }
+        if((off_t)n > tracks->ends[tracks->current] - tracks->written) {
+            n = (size_t)(tracks->ends[tracks->current] - tracks->written);
+        }
+        if(fwrite(data, 1, n, tracks->files[tracks->current]) != n) { return 0; }
+        tracks->written += n;
+        data += n;
+        size -= n;
+    }
+    return 1;
+}
+
+//
+// Put out decoded sectors, to out (or tracks) unless it's NULL and to digest
+// if set, each followed by its subchannel data if the image has any
+//
+// Returns nonzero on error
+//
+static int8_t image_write(
+    subchannel* s,
+    FILE* out,
+    track_output* tracks,
+    image_digest* digest,
+    const uint8_t* data,
+    size_t size
+) {
+    while(size) {
+        size_t n = size;
+        if(s->sectors && n > 2352 - (size_t)(s->written % 2352)) {
+            n = 2352 - (size_t)(s->written % 2352);
+        }
+        if(!image_put(out, tracks, data, n)) { return 1; }
+        digest_put(digest, data, n);
+        data += n;
+        size -= n;
+        if(!s->sectors) { continue; }
+        s->written += n;
+        if(s->written % 2352 == 0) {
+            uint8_t sub[SUBCHANNEL_SIZE];
+            if(!subchannel_sector(s, s->written / 2352 - 1, sub)) { return 1; }
+            if(!image_put(out, tracks, sub, SUBCHANNEL_SIZE)) { return 1; }
+            digest_put(digest, sub, SUBCHANNEL_SIZE);
+        }
+    }
+    return 0;
+}
+
+//
+// Read the records of one version 2 block into *records (grown as needed),
+// and check them against their EDC
+//
+// *header is filled in with the block header.
+//
+// Returns one of the DECODE_* codes
+//
+static int8_t read_block(
+    FILE* in,
+    const ecm_container* c,
+    size_t block,
+    uint8_t** records,
+    size_t* records_alloc,
+    uint8_t* header
+) {
+    const ecm_block* b = c->blocks + block;
+    off_t limit = (block + 1 < c->block_count) ? b[1].offset : c->directory_offset;
+    size_t size = block_size(c, block);
+    size_t records_size;
+    int8_t status;
+
+    {   PERF_ENTER(PHASE_IO);
+        status = DECODE_OK;
+        if(fseeko(in, b->offset, SEEK_SET) != 0 ||
+           fread(header, 1, ECM_BLOCK_HEADER_SIZE, in) != ECM_BLOCK_HEADER_SIZE
+        ) {
+            status = DECODE_ERROR_IN;
+        }
+        PERF_LEAVE();
+    }
+    if(status != DECODE_OK) { return status; }
+
+    records_size = get32lsb(header);
+    if(
+        (off_t)records_size > limit - b->offset - ECM_BLOCK_HEADER_SIZE ||
+        get32lsb(header + 4) != size
+    ) {
+        return DECODE_CORRUPT;
+    }
+    if(records_size > *records_alloc) {
+        uint8_t* p = realloc(*records, records_size);
+        if(!p) { return DECODE_NOMEM; }
+        *records = p;
+        *records_alloc = records_size;
+    }
+    {   PERF_ENTER(PHASE_IO);
+        if(fread(*records, 1, records_size, in) != records_size) {
+            status = DECODE_ERROR_IN;
+        }
+        PERF_LEAVE();
+    }
+    if(status != DECODE_OK) { return status; }
+
+    //
+    // Fail fast on damaged records, before decoding any of them
+    //
+    if(edc_compute(0, *records, records_size) != get32lsb(header + 8)) {
+        return DECODE_CHECKSUM;
+    }
+    return DECODE_OK;
+}
+
+//
+// Read, check and decode one version 2 block
+//
+// The records are read into *records (grown as needed) and checked against
+// their EDC before anything is decoded.  data may be NULL to only check the
+// block; otherwise it must hold block_size() bytes.  *edc is set to the EDC
+// of the decoded data.
+//
+// Returns one of the DECODE_* codes
+//
+static int8_t decode_block(
+    FILE* in,
+    const ecm_container* c,
+    size_t block,
+    uint8_t** records,
+    size_t* records_alloc,
+    uint8_t* data,
+    uint32_t* edc,
+    unsigned tid
+) {
+    uint8_t header[ECM_BLOCK_HEADER_SIZE];
+    const ecm_block* b = c->blocks + block;
+    size_t size = block_size(c, block);
+    record_reader r;
+    decode_output o;
+    int8_t status;
+
+    status = read_block(in, c, block, records, records_alloc, header);
+    if(status != DECODE_OK) { return status; }
+
+    memset(&r, 0, sizeof(r));
+    r.data = *records;
+    r.size = get32lsb(header);
+    r.extended = 1;
+    r.source = in;
+    decode_output_init(&o, NULL, data, b->output_offset, b->output_offset + (off_t)size, tid);
+    status = decode_records(&r, &o, 0);
+    if(status != DECODE_OK) { return status; }
+    decode_flush(&o);
+
+    if(o.batch_offset != b->output_offset + (off_t)size) { return DECODE_CORRUPT; }
+    if(o.edc != get32lsb(header + 12)) { return DECODE_CHECKSUM; }
+    *edc = o.edc;
+    return DECODE_OK;
+}
+
+//
+// Check every block of a version 2 file in turn, without writing anything;
+// with digest set, the decoded image (with its subchannel data from sub) goes
+// to it
+//
+// Returns one of the DECODE_* codes
+//
+static int8_t check_blocks(
+    FILE* in,
+    const ecm_container* c,
+    subchannel* sub,
+    image_digest* digest,
+    unsigned tid,
+    decode_result* result
+) {
+    uint8_t* records = NULL;
+    size_t records_alloc = 0;
+    uint8_t* data = NULL;
+    uint32_t edc = 0;
+    int8_t status = DECODE_OK;
+    size_t i;
+
+    result->output_bytes = 0;
+    result->failed_block = -1;
+    result->error = 0;
+    if(digest) {
+        data = malloc(ECM_BLOCK_SIZE);
+        if(!data) { return DECODE_NOMEM; }
+    }
+    for(i = 0; i < c->block_count; i++) {
+        uint32_t block_edc;
+        status = decode_block(in, c, i, &records, &records_alloc, data, &block_edc, tid);
+        if(status == DECODE_OK && data && image_write(sub, NULL, NULL, digest, data, block_size(c, i))) {
+            status = DECODE_CORRUPT;
+        }
+        if(status != DECODE_OK) {
+            result->failed_block = (off_t)i;
+            result->error = feof(in) ? -1 : errno;
+            break;
+        }
+        edc = edc_combine(edc, block_edc, (off_t)block_size(c, i));
+        result->output_bytes += block_size(c, i);
+    }
+    if(status == DECODE_OK) {
+        result->output_edc = edc;
+        result->stored_edc = c->output_edc;
+        if(edc != c->output_edc) { status = DECODE_CHECKSUM; }
+    }
+    if(records != NULL) { free(records); }
+    if(data    != NULL) { free(data   ); }
+    return status;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Parallel decode of a version 2 file
+//
+// Blocks are decoded a wave at a time, one block per worker thread; while one
+// wave is being written out, the next is decoded in the background.  The
+// first bad block stops everything, with the blocks before it written.
+//
+typedef struct {
+    FILE*    in;
+    uint8_t* records;
+    size_t   records_alloc;
+} block_reader;
+
+typedef struct {
+    const ecm_container* c;
+    block_reader* readers; // one per worker
+    size_t    first;       // first block of the wave
+    size_t    count;
+    uint8_t** data;        // decoded data, one per block of the wave
+    int8_t*   status;
+    int*      error;
+    uint32_t* edc;
+    jobqueue  jobs;
+} decode_wave;
+
+static void decode_wave_worker(void* context, unsigned index) {
+    decode_wave* wave = (decode_wave*)context;
+    block_reader* r = wave->readers + index;
+    size_t job;
+
+    while(jobqueue_take(&wave->jobs, &job)) {
+        size_t block = wave->first + job;
+        double span = trace_begin();
+        wave->status[job] = decode_block(
+            r->in, wave->c, block, &r->records, &r->records_alloc,
+            wave->data[job], wave->edc + job, index + 1
+        );
+        trace_end("decode_block", span, index + 1,
+            wave->c->blocks[block].output_offset, (off_t)block_size(wave->c, block));
+        if(wave->status[job] != DECODE_OK) {
+            wave->error[job] = feof(r->in) ? -1 : errno;
+            //
+            // Blocks after this one won't be written, so don't bother
+            //
+            jobqueue_fail(&wave->jobs, -1);
+        }
+    }
+}
+
+static void decode_wave_start(decode_wave* wave, size_t first, unsigned workers, background* task) {
+    size_t j;
+    wave->first = first;
+    wave->count = wave->c->block_count - first;
+    if(wave->count > workers) { wave->count = workers; }
+    for(j = 0; j < wave->count; j++) {
+        wave->status[j] = -1; // not decoded
+    }
+    jobqueue_init(&wave->jobs, wave->count);
+    background_start(task, decode_wave_worker, wave, (unsigned)wave->count);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Decoder checkpoints (see "Checkpoints" above)
+//
+// The state is the size of the ECM file and the EDC it stores for the image,
+// which tell it's the same file, then the next block to decode and the EDC of
+// the blocks before it.
+//
+#define RESUME_DECODE_SIZE 24
+
+typedef struct {
+    char*       name;
+    const char* outfilename;
+    size_t      first; // block to start at
+    uint32_t    edc;   // EDC of the blocks before it
+} decode_resume;
+
+//
+// Returns nonzero on error, with a message
+//
+static int8_t resume_save_decode(const decode_resume* r, const ecm_container* c, FILE* out, size_t next, uint32_t edc) {
+    uint8_t state[RESUME_DECODE_SIZE];
+    put64lsb(state, c->file_size);
+    put32lsb(state + 8, c->output_edc);
+    put64lsb(state + 12, (off_t)next);
+    put32lsb(state + 20, edc);
+    return resume_save(r->name, RESUME_DECODE, out, r->outfilename, state, sizeof(state));
+}
+
+//
+// Read the decoder's checkpoint of c into r; *found is set to whether there
+// is one
+//
+// Returns nonzero on error, with a message
+//
+static int8_t resume_load_decode(decode_resume* r, const ecm_container* c, int8_t* found) {
+    uint8_t* state;
+    size_t size;
+    *found = 0;
+    if(resume_load(r->name, RESUME_DECODE, &state, &size)) { return 1; }
+    if(!state) { return 0; }
+    if(
+        size != RESUME_DECODE_SIZE ||
+        get64lsb(state) != c->file_size ||
+        get32lsb(state + 8) != c->output_edc ||
+        get64lsb(state + 12) < 0 ||
+        get64lsb(state + 12) > (off_t)c->block_count
+    ) {
+        printf("Error: %s: not a checkpoint of this decode, or damaged\n", r->name);
+        free(state);
+        return 1;
+    }
+    r->first = (size_t)get64lsb(state + 12);
+    r->edc = get32lsb(state + 20);
+    free(state);
+    *found = 1;
+    return 0;
+}
+
+//
+// out may be NULL to check the data without writing it; with tracks set, the
+// data goes to its files instead.  It also goes to digest, if set.  With
+// resume set, decoding starts at its block, with out already holding the
+// output of those before, and checkpoints are left as it goes.
+//
+// Returns one of the DECODE_* codes
+//
+static int8_t decode_parallel(
+    const char* infilename,
+    const ecm_container* c,
+    subchannel* sub,
+    FILE* out,
+    track_output* tracks,
+    image_digest* digest,
+    const decode_resume* resume,
+    decode_result* result
+) {
+    int8_t status = DECODE_OK;
+    unsigned workers = get_thread_count();
+    block_reader* readers = NULL;
+    decode_wave waves[2];
+    background task;
+    int8_t current = 0;
+    int8_t pending = 0; // a wave is being decoded in the background
+    uint32_t edc = 0;
+    size_t first = 0;
+    off_t resume_next = 0;
+    unsigned i;
+    int w;
+
+    result->output_bytes = 0;
+    result->failed_block = -1;
+    result->error = 0;
+
+    if(resume) {
+        first = resume->first;
+        edc = resume->edc;
+        result->output_bytes = (first < c->block_count) ? c->blocks[first].output_offset : c->output_size;
+        sub->written = result->output_bytes;
+        resume_next = result->output_bytes + RESUME_INTERVAL;
+    }
+
+    memset(waves, 0, sizeof(waves));
+    memset(&task, 0, sizeof(task));
+
+    if(workers > c->block_count) { workers = (unsigned)c->block_count; }
+    if(workers < 1) { workers = 1; }
+
+    //
+    // Each worker reads through its own handle
+    //
+    readers = calloc(workers, sizeof(block_reader));
+    if(!readers) { status = DECODE_NOMEM; goto done; }
+    for(i = 0; i < workers; i++) {
+        readers[i].in = fopen(infilename, "rb");
+        if(!readers[i].in) {
+            result->error = errno;
+            status = DECODE_ERROR_IN;
+            goto done;
+        }
+    }
+    for(w = 0; w < 2; w++) {
+        decode_wave* wave = waves + w;
+        wave->c = c;
+        wave->readers = readers;
+        wave->data   = calloc(workers, sizeof(uint8_t*));
+        wave->status = calloc(workers, sizeof(int8_t));
+        wave->error  = calloc(workers, sizeof(int));
+        wave->edc    = calloc(workers, sizeof(uint32_t));
+        if(!wave->data || !wave->status || !wave->error || !wave->edc) {
+            status = DECODE_NOMEM;
+            goto done;
+        }
+        for(i = 0; i < workers; i++) {
+            wave->data[i] = malloc(ECM_BLOCK_SIZE);
+            if(!wave->data[i]) { status = DECODE_NOMEM; goto done; }
+        }
+    }
+
+    if(first < c->block_count) {
+        PERF_ENTER(PHASE_DECODE);
+        decode_wave_start(waves, first, workers, &task);
+        PERF_LEAVE();
+        pending = 1;
+    }
+    while(pending) {
+        decode_wave* wave = waves + current;
+        size_t next;
+        size_t j;
+
+        {   PERF_ENTER(PHASE_DECODE);
+            background_wait(&task);
+            PERF_LEAVE();
+        }
+        jobqueue_destroy(&wave->jobs);
+        pending = 0;
+
+        //
+        // Start on the next wave while this one is written
+        //
+        next = wave->first + wave->count;
+        if(next < c->block_count && !wave->jobs.failed) {
+            PERF_ENTER(PHASE_DECODE);
+            decode_wave_start(waves + (current ^ 1), next, workers, &task);
+            PERF_LEAVE();
+            pending = 1;
+        }
+
+        for(j = 0; j < wave->count; j++) {
+            size_t block = wave->first + j;
+            size_t size = block_size(c, block);
+            double span;
+            int8_t failed;
+            if(wave->status[j] != DECODE_OK) {
+                status = wave->status[j];
+                result->failed_block = (off_t)block;
+                result->error = wave->error[j];
+                goto done;
+            }
+            span = trace_begin();
+            {   PERF_ENTER(PHASE_IO);
+                failed = image_write(sub, out, tracks, digest, wave->data[j], size);
+                PERF_LEAVE();
+            }
+            if(failed) { status = DECODE_ERROR_OUT; goto done; }
+            trace_end("write", span, 0, c->blocks[block].output_offset, (off_t)size);
+            edc = edc_combine(edc, wave->edc[j], (off_t)size);
+            result->output_bytes += size;
+            setcounter_decode(block + 1 < c->block_count ? c->blocks[block + 1].offset : c->file_size);
+            if(resume && result->output_bytes >= resume_next && block + 1 < c->block_count) {
+                if(resume_save_decode(resume, c, out, block + 1, edc)) {
+                    status = DECODE_RESUME;
+                    goto done;
+                }
+                resume_next = result->output_bytes + RESUME_INTERVAL;
+            }
+        }
+        current ^= 1;
+    }
+
+    PERF_BYTES(result->output_bytes);
+
+    result->output_edc = edc;
+    result->stored_edc = c->output_edc;
+    if(edc != c->output_edc) { status = DECODE_CHECKSUM; }
+
+done:
+    if(pending) {
+        background_wait(&task);
+        jobqueue_destroy(&waves[current ^ 1].jobs);
+    }
+    for(w = 0; w < 2; w++) {
+        decode_wave* wave = waves + w;
+        if(wave->data) {
+            for(i = 0; i < workers; i++) {
+                if(wave->data[i]) { free(wave->data[i]); }
+            }
+            free(wave->data);
+        }
+        if(wave->status) { free(wave->status); }
+        if(wave->error ) { free(wave->error ); }
+        if(wave->edc   ) { free(wave->edc   ); }
+    }
+    if(readers) {
+        for(i = 0; i < workers; i++) {
+            if(readers[i].in     ) { fclose(readers[i].in); }
+            if(readers[i].records) { free(readers[i].records); }
+        }
+        free(readers);
+    }
+    return status;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Returns nonzero on error
+//
+static int8_t unecmify(
+    const char* infilename,
+    const char* outfilename
+) {
+    int8_t returncode = 0;
+
+    FILE* in  = NULL;
+    FILE* out = NULL;
+
+    ecm_container container;
+    subchannel sub;
+    decode_result result;
+    image_digest digest;
+    int8_t status;
+    cue_sheet cue;
+    track_output tracks;
+    char* trackname = NULL;
+    size_t i;
+
+    //
+    // What was created, to be removed if the decode fails
+    //
+    int8_t created = 0;
+    size_t tracks_created = 0;
+
+    decode_resume resume;
+    int8_t resumed = 0;
+    uint8_t* buffer = NULL;
+
+    memset(&resume, 0, sizeof(resume));
+    memset(&container, 0, sizeof(container));
+    memset(&sub, 0, sizeof(sub));
+    memset(&cue, 0, sizeof(cue));
+    memset(&tracks, 0, sizeof(tracks));
+
+    if(digest_init(&digest, digest_selected)) {
+        printf("Out of memory\n");
+        goto error;
+    }
+
+    //
+    // Open the input
+    //
+    in = fopen(infilename, "rb");
+    if(!in) { goto error_in; }
+
+    //
+    // Magic header, and for version 2 the index
+    //
+    status = container_open(in, &container);
+    switch(status) {
+    case DECODE_ERROR_IN: goto error_in;
+    case DECODE_NOMEM:
+        printf("Out of memory\n");
+        goto error;
+    case DECODE_NOT_ECM:
+        printf("Header missing; does not appear to be an ECM file\n");
+        goto error;
+    case DECODE_BAD_INDEX:
+        printf("Corrupt ECM file; missing or invalid index\n");
+        goto error;
+    }
+
+    if(resume_enabled) {
+        if(container.version == 1) {
+            printf("Error: %s: --resume needs the version 2 format\n", infilename);
+            goto error;
+        }
+        resume.outfilename = outfilename;
+        resume.name = resume_name(outfilename);
+        if(!resume.name || resume_load_decode(&resume, &container, &resumed)) { goto error; }
+    }
+
+    //
+    // Ensure the output file doesn't already exist, unless it's the one the
+    // checkpoint is of
+    //
+    if(!resumed) {
+        out = fopen(outfilename, "rb");
+        if(out) {
+            printf("Error: %s exists; refusing to overwrite\n", outfilename);
+            goto error;
+        }
+    }
+
+    status = subchannel_open(in, &container, &sub);
+    switch(status) {
+    case DECODE_ERROR_IN: goto error_in;
+    case DECODE_NOMEM:
+        printf("Out of memory\n");
+        goto error;
+    case DECODE_CORRUPT:
+        printf("Corrupt ECM file; invalid subchannel data\n");
+        goto error;
+    case DECODE_CHECKSUM:
+        printf("Subchannel checksum error\n");
+        goto error;
+    }
+
+    status = base_check(in, &container);
+    switch(status) {
+    case DECODE_ERROR_IN: goto error_in;
+    case DECODE_CORRUPT:
+        printf("Corrupt ECM file; invalid base image section\n");
+        goto error;
+    case DECODE_BASE:
+        printf("Error: %s: %s\n", infilename, base_problem());
+        goto error;
+    }
+
+    //
+    // A container decodes to its cue sheet, with the files next to it
+    //
+    status = container_cue(in, &container, &cue);
+    switch(status) {
+    case DECODE_ERROR_IN: goto error_in;
+    case DECODE_NOMEM:
+        printf("Out of memory\n");
+        goto error;
+    case DECODE_CORRUPT:
+        printf("Corrupt ECM file; invalid cue sheet or file table\n");
+        goto error;
+    }
+    if(cue.file_count && resume_enabled) {
+        printf("Error: %s: --resume can't be used for a cue sheet and its files\n", infilename);
+        goto error;
+    }
+    if(cue.file_count) {
+        tracks.files = calloc(cue.file_count, sizeof(FILE*));
+        tracks.ends  = calloc(cue.file_count, sizeof(off_t));
+        if(!tracks.files || !tracks.ends) {
+            printf("Out of memory\n");
+            goto error;
+        }
+        tracks.count = cue.file_count;
+        for(i = 0; i < cue.file_count; i++) {
+            tracks.ends[i] = (i ? tracks.ends[i - 1] : 0) + cue.sizes[i];
+        }
+        if(tracks.ends[tracks.count - 1] != subchannel_image_offset(&sub, container.output_size)) {
+            printf("Corrupt ECM file; the files don't add up to the image\n");
+            goto error;
+        }
+        for(i = 0; i < cue.file_count; i++) {
+            trackname = cue_path(outfilename, cue.files[i]);
+            if(!trackname) {
+                printf("Out of memory\n");
+                goto error;
+            }
+            tracks.files[i] = fopen(trackname, "rb");
+            if(tracks.files[i]) {
+                printf("Error: %s exists; refusing to overwrite\n", trackname);
+                goto error;
+            }
+            tracks.files[i] = fopen(trackname, "wb");
+            if(!tracks.files[i]) {
+                printfileerror(NULL, trackname);
+                goto error;
+            }
+            tracks_created = i + 1;
+            free(trackname);
+            trackname = NULL;
+        }
+    }
+
+    resetcounter(container.file_size);
+
+    //
+    // Open output file: with a checkpoint, the part of it that covers, which
+    // is hashed again
+    //
+    if(resumed) {
+        off_t size = subchannel_image_offset(&sub,
+            resume.first < container.block_count ? container.blocks[resume.first].output_offset : container.output_size);
+        off_t at = 0;
+        out = resume_open(outfilename, size);
+        if(!out) { goto error; }
+        if(digest_selected) {
+            buffer = malloc(ECM_BLOCK_SIZE);
+            if(!buffer) {
+                printf("Out of memory\n");
+                goto error;
+            }
+            if(fseeko(out, 0, SEEK_SET) != 0) { goto error_out; }
+            while(at < size) {
+                size_t n = ECM_BLOCK_SIZE;
+                if((off_t)n > size - at) { n = (size_t)(size - at); }
+                if(fread(buffer, 1, n, out) != n) { goto error_out; }
+                digest_put(&digest, buffer, n);
+                at += n;
+            }
+            if(fseeko(out, size, SEEK_SET) != 0) { goto error_out; }
+        }
+    } else {
+        out = fopen(outfilename, "wb");
+        if(!out) { goto error_out; }
+        created = !resume_enabled;
+        if(resume_enabled && resume_save_decode(&resume, &container, out, 0, 0)) { goto error; }
+    }
+
+    printf("Decoding %s to %s...\n", infilename, outfilename);
+    if(resumed) {
+        printf("Resuming at block ");
+        fprintdec(stdout, (off_t)resume.first);
+        printf("\n");
+    }
+
+    if(cue.file_count) {
+        printf("Writing %lu files from the cue sheet\n", (unsigned long)cue.file_count);
+        if(fwrite(cue.text, 1, cue.text_size, out) != cue.text_size) { goto error_out; }
+    }
+
+    if(container.version == 1) {
+        status = decode_stream(in, out, &digest, 1, 0, &result);
+    } else {
+        status = decode_parallel(infilename, &container, &sub, out, cue.file_count ? &tracks : NULL, &digest,
+            resume_enabled ? &resume : NULL, &result);
+    }
+    if(status != DECODE_OK && result.failed_block >= 0) {
+        printf("Block ");
+        fprintdec(stdout, result.failed_block);
+        printf(" (output offset ");
+        fprintdec(stdout, subchannel_image_offset(&sub, container.blocks[result.failed_block].output_offset));
+        printf("): ");
+    }
+    switch(status) {
+    case DECODE_ERROR_IN:
+        if(container.version == 1) { goto error_in; }
+        if(result.error < 0) {
+            printf("Error: %s: Unexpected end-of-file\n", infilename);
+        } else {
+            errno = result.error;
+            printfileerror(NULL, infilename);
+        }
+        goto error;
+    case DECODE_ERROR_OUT: goto error_out;
+    case DECODE_NOMEM:
+        printf("Out of memory\n");
+        goto error;
+    case DECODE_CORRUPT:
+        printf("Corrupt ECM file; invalid sector count\n");
+        goto error;
+    case DECODE_STORE:
+        printf(shared_store ?
+            "A stored sector is missing from the shared store\n" :
+            "The file refers to a shared store; give it with --store=DIR\n");
+        goto error;
+    case DECODE_BASE:
+        printf("Error: %s: %s\n", infilename, base_problem());
+        goto error;
+    case DECODE_RESUME: goto error;
+    }
+    if(status == DECODE_CHECKSUM && result.failed_block >= 0) {
+        printf("Checksum error\n");
+        goto error;
+    }
+
+    printf("Decoded ");
+    fprintdec(stdout, container.version == 1 ? ftello(in) : container.file_size);
+    printf(" bytes -> ");
+    fprintdec(stdout, cue.file_count ? tracks.written : ftello(out));
+    printf(" bytes\n");
+
+    if(status == DECODE_CHECKSUM) {
+        printf("Checksum error (0x%08lX, should be 0x%08lX)\n",
+            (unsigned long)result.output_edc,
+            (unsigned long)result.stored_edc
+        );
+        goto error;
+    }
+
+    digest_finish(&digest);
+    digest_print(&digest, outfilename, NULL);
+
+    if(resume_enabled) { remove(resume.name); }
+
+    //
+    // Success
+    //
+    printf("Done\n");
+    returncode = 0;
+    goto done;
+
+error_in:
+    printfileerror(in, infilename);
+    goto error;
+
+error_out:
+    printfileerror(out, outfilename);
+    goto error;
+
+error:
+    returncode = 1;
+    goto done;
+
+done:
+    digest_free(&digest);
+    container_free(&container);
+    subchannel_free(&sub);
+    for(i = 0; tracks.files && i < tracks.count; i++) {
+        if(tracks.files[i] != NULL) { fclose(tracks.files[i]); }
+    }
+    if(in    != NULL) { fclose(in ); }
+    if(out   != NULL) { fclose(out); }
+
+    //
+    // Don't leave a partial output behind; with --resume it stays, to carry
+    // on from
+    //
+    if(returncode) {
+        if(created) { remove(outfilename); }
+        for(i = 0; i < tracks_created; i++) {
+            if(trackname) { free(trackname); }
+            trackname = cue_path(outfilename, cue.files[i]);
+            if(trackname) { remove(trackname); }
+        }
+    }
+
+    if(tracks.files) { free(tracks.files); }
+    if(tracks.ends) { free(tracks.ends); }
+    if(trackname) { free(trackname); }
+    cue_free(&cue);
+    if(resume.name) { free(resume.name); }
+    if(buffer) { free(buffer); }
+
+    return returncode;
+}
+
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Random access (see ecm.h)
+//
+// Opening a file builds an index of its runs: one entry per record, giving
+// where the record's stored data starts in the file and where its output
+// starts in the decoded image.  A read looks up the run covering the offset,
+// seeks straight to the unit it needs and rebuilds only that.  Rebuilt
+// sectors are kept in a small LRU cache.
+//
+// The index can be saved next to the ECM file ("foo.ecm.idx"):
+//
+//   "ECMI"
+//   u32 version (2)
+//   u64 size of the ECM file
+//   u32 EDC of the decoded image, as stored in the ECM file
+//   u64 size of the decoded image
+//   u64 number of runs
+//   for each run: u64 file offset, u64 output offset, u32 count, u8 type,
+//                 3-byte address of the first sector (types whose records
+//                 store one)
+//
+// It is only used if the size and EDC still match the ECM file.
+//
+#define ECM_CACHE_SECTORS  64
+#define ECM_INDEX_VERSION  2
+#define ECM_INDEX_HEADER_SIZE 36
+#define ECM_RUN_ENTRY_SIZE 24
+
+typedef struct {
+    off_t    in_offset;  // file offset of the run's first unit
+    off_t    out_offset; // output offset of the run's first unit
+    uint32_t count;
+    int8_t   type;
+    uint8_t  address[3]; // addressed types: address of the first sector
+} ecm_run;
+
+typedef struct {
+    off_t    out_offset; // output offset of the unit, or -1 if unused
+    uint32_t used;       // clock value when last used
+    uint8_t  sector[2352];
+} ecm_cache_entry;
+
+struct ecm_file {
+    char*     filename;
+    FILE*     in;
+    off_t     file_size;
+    int8_t    version;
+    off_t     size;       // decoded size
+    uint32_t  output_edc; // as stored in the file
+    int8_t    index_loaded; // index came from the sidecar
+
+    ecm_run*  runs;
+    size_t    run_count;
+    size_t    run_alloc;
+
+    ecm_cache_entry cache[ECM_CACHE_SECTORS];
+    uint32_t  cache_clock;
+
+    //
+    // TYPE_RAW_MODE2: the unit after the last one rebuilt, so reading a run
+    // in order needn't count form codes from its start for every unit
+    //
+    const ecm_run* form_run;
+    uint32_t  form_next;
+    off_t     form_longs; // form 2 units before form_next
+
+    subchannel sub;       // for 2448-byte sector images
+};
+
+//
+// Returns nonzero on error
+//
+static int8_t index_add_run(ecm_file* f, int8_t type, uint32_t count, off_t in_offset, const uint8_t* address) {
+    ecm_run* run;
+    if(f->run_count == f->run_alloc) {
+        size_t n = f->run_alloc ? f->run_alloc * 2 : 256;
+        ecm_run* p = realloc(f->runs, n * sizeof(ecm_run));
+        if(!p) { errno = ENOMEM; return 1; }
+        f->runs = p;
+        f->run_alloc = n;
+    }
+    run = f->runs + f->run_count++;
+    run->in_offset = in_offset;
+    run->out_offset = f->size;
+    run->count = count;
+    run->type = type;
+    memcpy(run->address, address, 3);
+    f->size += ((off_t)count) * (off_t)sector_types[type].size;
+    return 0;
+}
+
+//
+// Count the form 2 sectors among the first n of a TYPE_RAW_MODE2 run's form
+// map, which starts at the given file offset; if form isn't NULL, also get
+// the code of sector n
+//
+// Returns nonzero on error
+//
+static int8_t read_form_codes(FILE* in, off_t offset, uint32_t n, off_t* longs, uint8_t* form) {
+    uint8_t buffer[256];
+    size_t left = form ? (size_t)(n >> 2) + 1 : form_map_size(n);
+    off_t code = 0; // codes counted so far
+    *longs = 0;
+    if(fseeko(in, offset, SEEK_SET) != 0) { return 1; }
+    while(left) {
+        size_t b = left < sizeof(buffer) ? left : sizeof(buffer);
+        size_t i;
+        if(fread(buffer, 1, b, in) != b) { return 1; }
+        for(i = 0; i < b; i++) {
+            uint8_t byte = buffer[i];
+            if(n - code < 4) {
+                int shift = (int)(n - code) * 2;
+                if(form) { *form = (byte >> shift) & 3; }
+                byte &= (uint8_t)((1 << shift) - 1);
+            }
+            *longs += long_units(byte);
+            code += 4;
+        }
+        left -= b;
+    }
+    return 0;
+}
+
+//
+// Read the unit of a patched type at the given file offset into sector (or
+// just find its size, if sector is NULL)
+//
+// Returns one of the DECODE_* codes
+//
+static int8_t read_patched_unit(FILE* in, off_t offset, int8_t type, uint8_t* sector, size_t* used) {
+    uint8_t payload[PATCH_MAX_PAYLOAD];
+    size_t got;
+    if(fseeko(in, offset, SEEK_SET) != 0) { return DECODE_ERROR_IN; }
+    got = fread(payload, 1, sizeof(payload), in);
+    if(got < sizeof(payload) && ferror(in)) { return DECODE_ERROR_IN; }
+    switch(patch_decode(type, payload, got, sector, used)) {
+    case 0: return DECODE_OK;
+    case 1: return DECODE_ERROR_IN;
+    }
+    return DECODE_CORRUPT;
+}
+
+//
+// Add the runs of records from the current position up to end (version 2
+// block), or through the end-of-records indicator (end < 0, version 1)
+//
+// Returns one of the DECODE_* codes
+//
+static int8_t index_scan(ecm_file* f, off_t end) {
+    record_reader r;
+    memset(&r, 0, sizeof(r));
+    r.f = f->in;
+    r.extended = (f->version == 2);
+    for(;;) {
+        int8_t status;
+        int8_t type;
+        uint32_t num;
+        uint8_t address[3] = {0,0,0};
+        off_t longs = 0; // TYPE_RAW_MODE2: form 2 sectors
+        off_t pos = ftello(f->in);
+        if(pos < 0) { return DECODE_ERROR_IN; }
+        if(end >= 0 && pos == end) { break; }
+        status = read_record_header(&r, &type, &num);
+        if(status != DECODE_OK) { return status; }
+        if(num == 0xFFFFFFFF) {
+            if(end >= 0) { return DECODE_CORRUPT; }
+            break;
+        }
+        num++;
+        if(sector_types[type].addressed) {
+            if(!reader_read(&r, address, 3)) { return DECODE_ERROR_IN; }
+            if(msf_to_frames(address) < 0) { return DECODE_CORRUPT; }
+        }
+        if(is_fill(type)) {
+            uint8_t fill[FILL_HEADER_SIZE];
+            if(!reader_read(&r, fill, FILL_HEADER_SIZE)) { return DECODE_ERROR_IN; }
+            if(!bulk_fits(type, fill[0])) { return DECODE_CORRUPT; }
+        }
+        pos = ftello(f->in);
+        if(type == TYPE_RAW_MODE2) {
+            //
+            // Skip the form map; form 2 sectors store more
+            //
+            if(read_form_codes(f->in, pos, num, &longs, NULL)) { return DECODE_ERROR_IN; }
+            pos += form_map_size(num);
+        }
+        if(index_add_run(f, type, num, pos, address)) { return DECODE_NOMEM; }
+        if(is_patched(type)) {
+            //
+            // Each unit has to be looked at for its size
+            //
+            uint32_t i;
+            for(i = 0; i < num; i++) {
+                size_t used;
+                status = read_patched_unit(f->in, pos, type, NULL, &used);
+                if(status != DECODE_OK) { return status; }
+                pos += used;
+            }
+        } else {
+            pos += ((off_t)num) * (off_t)sector_types[type].payload + longs * RAW_MODE2_EXTRA;
+        }
+        if(pos > (end >= 0 ? end : f->file_size)) { return DECODE_ERROR_IN; }
+        if(fseeko(f->in, pos, SEEK_SET) != 0) { return DECODE_ERROR_IN; }
+    }
+    return DECODE_OK;
+}
+
+//
+// Build the index from the record headers
+//
+// Returns one of the DECODE_* codes
+//
+static int8_t index_build(ecm_file* f, const ecm_container* c) {
+    int8_t status;
+    size_t i;
+
+    if(c->version == 1) {
+        uint8_t edc[4];
+        if(fseeko(f->in, 4, SEEK_SET) != 0) { return DECODE_ERROR_IN; }
+        status = index_scan(f, -1);
+        if(status != DECODE_OK) { return status; }
+        if(fread(edc, 1, 4, f->in) != 4) { return DECODE_ERROR_IN; }
+        f->output_edc = get32lsb(edc);
+        return DECODE_OK;
+    }
+
+    for(i = 0; i < c->block_count; i++) {
+        uint8_t header[ECM_BLOCK_HEADER_SIZE];
+        off_t start = c->blocks[i].offset + ECM_BLOCK_HEADER_SIZE;
+        if(f->size != c->blocks[i].output_offset) { return DECODE_BAD_INDEX; }
+        if(fseeko(f->in, c->blocks[i].offset, SEEK_SET) != 0) { return DECODE_ERROR_IN; }
+        if(fread(header, 1, sizeof(header), f->in) != sizeof(header)) { return DECODE_ERROR_IN; }
+        status = index_scan(f, start + get32lsb(header));
+        if(status != DECODE_OK) { return status; }
+    }
+    if(f->size != c->output_size) { return DECODE_BAD_INDEX; }
+    f->output_edc = c->output_edc;
+    return DECODE_OK;
+}
+
+static char* index_filename(const ecm_file* f) {
+    char* name = malloc(strlen(f->filename) + 5);
+    if(name) {
+        strcpy(name, f->filename);
+        strcat(name, ".idx");
+    }
+    return name;
+}
+
+//
+// Load the index from the sidecar file, if there is one and it matches
+//
+// Returns nonzero if loaded
+//
+static int8_t index_load(ecm_file* f, uint32_t output_edc) {
+    uint8_t header[ECM_INDEX_HEADER_SIZE];
+    uint8_t entry[ECM_RUN_ENTRY_SIZE];
+    char* name = index_filename(f);
+    FILE* idx = NULL;
+    off_t count;
+    off_t i;
+    int8_t loaded = 0;
+
+    if(!name) { goto done; }
+    idx = fopen(name, "rb");
+    if(!idx) { goto done; }
+    if(fread(header, 1, sizeof(header), idx) != sizeof(header)) { goto done; }
+    if(
+        memcmp(header, "ECMI", 4) ||
+        get32lsb(header + 4) != ECM_INDEX_VERSION ||
+        get64lsb(header + 8) != f->file_size ||
+        get32lsb(header + 16) != output_edc
+    ) {
+        goto done;
+    }
+    count = get64lsb(header + 28);
+    for(i = 0; i < count; i++) {
+        off_t in_offset;
+        int8_t type;
+        uint32_t n;
+        if(fread(entry, 1, sizeof(entry), idx) != sizeof(entry)) { goto done; }
+        in_offset = get64lsb(entry);
+        n = get32lsb(entry + 16);
+        type = entry[20];
+        //
+        // Runs must be contiguous in the output and lie within the file
+        //
+        if(
+            entry[20] >= TYPE_COUNT || n == 0 ||
+            (sector_types[type].addressed && msf_to_frames(entry + 21) < 0) ||
+            get64lsb(entry + 8) != f->size ||
+            in_offset < 4 ||
+            ((off_t)n) * (off_t)sector_types[type].payload > f->file_size - in_offset
+        ) {
+            goto done;
+        }
+        if(index_add_run(f, type, n, in_offset, entry + 21)) { goto done; }
+    }
+    if(f->size != get64lsb(header + 20)) { goto done; }
+    f->output_edc = output_edc;
+    loaded = 1;
+
+done:
+    if(!loaded) {
+        f->run_count = 0;
+        f->size = 0;
+    }
+    if(idx ) { fclose(idx); }
+    if(name) { free(name); }
+    return loaded;
+}
+
+int ecm_save_index(ecm_file* f) {
+    uint8_t header[ECM_INDEX_HEADER_SIZE];
+    uint8_t entry[ECM_RUN_ENTRY_SIZE];
+    char* name = index_filename(f);
+    FILE* idx = NULL;
+    size_t i;
+    int returncode = 1;
+
+    if(!name) { errno = ENOMEM; goto done; }
+    idx = fopen(name, "wb");
+    if(!idx) { goto done; }
+
+    memcpy(header, "ECMI", 4);
+    put32lsb(header + 4, ECM_INDEX_VERSION);
+    put64lsb(header + 8, f->file_size);
+    put32lsb(header + 16, f->output_edc);
+    put64lsb(header + 20, f->size);
+    put64lsb(header + 28, (off_t)f->run_count);
+    if(fwrite(header, 1, sizeof(header), idx) != sizeof(header)) { goto done; }
+    for(i = 0; i < f->run_count; i++) {
+        const ecm_run* run = f->runs + i;
+        put64lsb(entry, run->in_offset);
+        put64lsb(entry + 8, run->out_offset);
+        put32lsb(entry + 16, run->count);
+        entry[20] = (uint8_t)run->type;
+        memcpy(entry + 21, run->address, 3);
+        if(fwrite(entry, 1, sizeof(entry), idx) != sizeof(entry)) { goto done; }
+    }
+    if(fclose(idx)) { idx = NULL; goto done; }
+    idx = NULL;
+    returncode = 0;
+
+done:
+    if(idx) {
+        fclose(idx);
+        remove(name);
+    }
+    if(name) { free(name); }
+    return returncode;
+}
+
+ecm_file* ecm_open(const char* filename) {
+    ecm_file* f;
+    ecm_container c;
+    uint8_t edc[4];
+    uint32_t output_edc;
+    int8_t status;
+    unsigned i;
+
+    eccedc_init();
+
+    f = calloc(1, sizeof(ecm_file));
+    if(!f) { errno = ENOMEM; return NULL; }
+    for(i = 0; i < ECM_CACHE_SECTORS; i++) {
+        f->cache[i].out_offset = -1;
+    }
+    f->filename = malloc(strlen(filename) + 1);
+    if(!f->filename) { errno = ENOMEM; goto error; }
+    strcpy(f->filename, filename);
+
+    f->in = fopen(filename, "rb");
+    if(!f->in) { goto error; }
+
+    status = container_open(f->in, &c);
+    if(status != DECODE_OK) { goto error_status; }
+    f->file_size = c.file_size;
+    f->version = c.version;
+
+    //
+    // The EDC the sidecar must match
+    //
+    if(c.version == 1) {
+        if(
+            f->file_size < 4 + 4 ||
+            fseeko(f->in, f->file_size - 4, SEEK_SET) != 0 ||
+            fread(edc, 1, 4, f->in) != 4
+        ) {
+            container_free(&c);
+            status = DECODE_ERROR_IN;
+            goto error_status;
+        }
+        output_edc = get32lsb(edc);
+    } else {
+        output_edc = c.output_edc;
+    }
+
+    if(index_load(f, output_edc)) {
+        f->index_loaded = 1;
+    } else {
+        status = index_build(f, &c);
+    }
+    if(status == DECODE_OK) {
+        status = subchannel_open(f->in, &c, &f->sub);
+    }
+    if(status == DECODE_OK) {
+        status = base_check(f->in, &c);
+    }
+    container_free(&c);
+    if(status != DECODE_OK) { goto error_status; }
+    return f;
+
+error_status:
+    switch(status) {
+    case DECODE_ERROR_IN:
+        if(feof(f->in)) { errno = EINVAL; }
+        break;
+    case DECODE_NOMEM:
+        errno = ENOMEM;
+        break;
+    case DECODE_BASE:
+        errno = ENXIO;
+        break;
+    default:
+        errno = EINVAL;
+        break;
+    }
+
+error:
+    {   int error = errno;
+        ecm_close(f);
+        errno = error;
+    }
+    return NULL;
+}
+
+void ecm_close(ecm_file* f) {
+    if(!f) { return; }
+    if(f->in      ) { fclose(f->in); }
+    if(f->runs    ) { free(f->runs); }
+    if(f->filename) { free(f->filename); }
+    subchannel_free(&f->sub);
+    free(f);
+}
+
+int ecm_open_store(const char* directory) {
+    const char* part;
+    ecm_store* s = store_open(directory, 0, &part);
+    if(!s) { return 1; }
+    store_close(shared_store);
+    shared_store = s;
+    return 0;
+}
+
+void ecm_close_store(void) {
+    store_close(shared_store);
+    shared_store = NULL;
+}
+
+static void base_close(void) {
+    if(base_file) { fclose(base_file); }
+    if(base_index) { free(base_index); }
+    base_file = NULL;
+    base_index = NULL;
+    base_entries = 0;
+}
+
+//
+// Open the base image, and for an encoder (indexed nonzero), index the bulks
+// its ECM file holds as-is: those of the runs of types that have a bulk, and
+// of TYPE_RAW_MODE2 runs
+//
+// Returns nonzero on error, with errno set
+//
+static int8_t base_open(const char* filename, int8_t indexed) {
+    ecm_file* f;
+    uint8_t* forms = NULL;
+    size_t alloc = 0;
+    size_t i;
+    int error;
+
+    base_close();
+    f = ecm_open(filename);
+    if(!f) { return 1; }
+    base_file = fopen(filename, "rb");
+    if(!base_file) { goto error; }
+    base_file_size = f->file_size;
+    base_size = ecm_size(f);
+    base_edc = f->output_edc;
+
+    for(i = 0; indexed && i < f->run_count; i++) {
+        const ecm_run* run = f->runs + i;
+        off_t offset = run->in_offset;
+        uint32_t n;
+        if(run->type != TYPE_RAW_MODE2 && !bulk_type(run->type, 0)) { continue; }
+        if(run->type == TYPE_RAW_MODE2) {
+            size_t size = form_map_size(run->count);
+            if(forms) { free(forms); }
+            forms = malloc(size);
+            if(!forms) {
+                errno = ENOMEM;
+                goto error;
+            }
+            if(
+                fseeko(f->in, offset - (off_t)size, SEEK_SET) != 0 ||
+                fread(forms, 1, size, f->in) != size
+            ) {
+                goto error_in;
+            }
+        }
+        if(fseeko(f->in, offset, SEEK_SET) != 0) { goto error_in; }
+        for(n = 0; n < run->count; n++) {
+            uint8_t data[0x918];
+            int8_t type = run->type;
+            int8_t bulk;
+            size_t payload;
+            size_t size;
+            base_entry* e;
+            if(type == TYPE_RAW_MODE2) {
+                int8_t code = form_code(forms, n);
+                if(code >= RAW_FORM_CODES) {
+                    errno = EINVAL;
+                    goto error;
+                }
+                type = raw_form_types[code];
+            }
+            bulk = bulk_type(type, 0);
+            payload = sector_types[type].payload;
+            size = sector_types[bulk].stored[0][1];
+            if(fread(data, 1, payload, f->in) != payload) { goto error_in; }
+            if(base_entries == alloc) {
+                size_t k = alloc ? alloc * 2 : 0x1000;
+                base_entry* p = realloc(base_index, k * sizeof(base_entry));
+                if(!p) {
+                    errno = ENOMEM;
+                    goto error;
+                }
+                base_index = p;
+                alloc = k;
+            }
+            //
+            // The bulk is always the last part stored
+            //
+            e = base_index + base_entries++;
+            e->hash = bulk_hash64((uint64_t)bulk, data + payload - size, size);
+            e->offset = offset + (off_t)(payload - size);
+            e->position = run->out_offset + ((off_t)n) * (off_t)sector_types[run->type].size +
+                (off_t)(sector_types[bulk].stored[0][0] - (2352 - sector_types[run->type].size));
+            e->bulk = bulk;
+            offset += (off_t)payload;
+        }
+    }
+    if(base_entries) {
+        qsort(base_index, base_entries, sizeof(base_entry), base_entry_compare);
+    }
+
+    if(forms) { free(forms); }
+    ecm_close(f);
+    return 0;
+
+error_in:
+    if(feof(f->in)) { errno = EINVAL; }
+
+error:
+    error = errno;
+    if(forms) { free(forms); }
+    ecm_close(f);
+    base_close();
+    errno = error;
+    return 1;
+}
+
+int ecm_open_base(const char* filename) {
+    return base_open(filename, 0);
+}
+
+void ecm_close_base(void) {
+    base_close();
+}
+
+off_t ecm_size(const ecm_file* f) {
+    return f->size + f->sub.sectors * SUBCHANNEL_SIZE;
+}
+
+//
+// Index of the run covering the given output offset, which must be in range
+//
+static size_t find_run(const ecm_file* f, off_t offset) {
+    size_t lo = 0;
+    size_t hi = f->run_count;
+    while(hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if(f->runs[mid].out_offset <= offset) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+//
+// Rebuild unit n of a sector run, or find it in the cache
+//
+// Returns NULL on error
+//
+static const uint8_t* get_sector(ecm_file* f, const ecm_run* run, uint32_t n) {
+    const sector_type* t = sector_types + run->type;
+    off_t out_offset = run->out_offset + ((off_t)n) * (off_t)t->size;
+    off_t in_offset = run->in_offset + ((off_t)n) * (off_t)t->payload;
+    int8_t type = run->type;
+    ecm_cache_entry* e = NULL;
+    record_reader r;
+    unsigned i;
+
+    f->cache_clock++;
+    for(i = 0; i < ECM_CACHE_SECTORS; i++) {
+        ecm_cache_entry* c = f->cache + i;
+        if(c->out_offset == out_offset) {
+            e = c;
+            e->used = f->cache_clock;
+            goto found;
+        }
+        //
+        // Otherwise replace an unused entry, or the least recently used one
+        //
+        if(
+            !e || c->out_offset < 0 ||
+            (e->out_offset >= 0 && f->cache_clock - c->used > f->cache_clock - e->used)
+        ) {
+            e = c;
+        }
+    }
+
+    e->out_offset = -1;
+    if(type == TYPE_RAW_MODE2) {
+        //
+        // Units before this one are longer if they're form 2
+        //
+        off_t map = run->in_offset - form_map_size(run->count);
+        off_t longs;
+        uint8_t form;
+        if(run == f->form_run && n == f->form_next) {
+            uint8_t byte;
+            if(fseeko(f->in, map + (n >> 2), SEEK_SET) != 0 || fread(&byte, 1, 1, f->in) != 1) {
+                return NULL;
+            }
+            longs = f->form_longs;
+            form = (byte >> ((n & 3) * 2)) & 3;
+        } else if(read_form_codes(f->in, map, n, &longs, &form)) {
+            return NULL;
+        }
+        if(form >= RAW_FORM_CODES) {
+            errno = EINVAL;
+            return NULL;
+        }
+        f->form_run = run;
+        f->form_next = n + 1;
+        f->form_longs = longs + (form != 0);
+        in_offset += longs * RAW_MODE2_EXTRA;
+        type = raw_form_types[form];
+    }
+    if(is_patched(type)) {
+        //
+        // Units vary in size, so walk to this one
+        //
+        size_t used;
+        uint32_t k;
+        in_offset = run->in_offset;
+        for(k = 0; k <= n; k++) {
+            int8_t status = read_patched_unit(f->in, in_offset, type, k == n ? e->sector : NULL, &used);
+            if(status != DECODE_OK) {
+                if(status == DECODE_CORRUPT) { errno = EINVAL; }
+                return NULL;
+            }
+            in_offset += used;
+        }
+        goto rebuilt;
+    }
+    if(is_fill(type) || is_reference(type)) {
+        //
+        // A fill's header is just before its first unit
+        //
+        uint8_t data[REPEAT_UNIT_SIZE];
+        size_t length = is_fill(type) ? FILL_HEADER_SIZE : REPEAT_UNIT_SIZE;
+        if(is_fill(type)) { in_offset = run->in_offset - FILL_HEADER_SIZE; }
+        if(fseeko(f->in, in_offset, SEEK_SET) != 0 || fread(data, 1, length, f->in) != length) {
+            return NULL;
+        }
+        if(t->addressed) {
+            msf_add(run->address, n, e->sector + 0x00C);
+        }
+        if(is_fill(type)) {
+            if(!bulk_fits(type, data[0])) {
+                errno = EINVAL;
+                return NULL;
+            }
+            fill_sector(data, e->sector);
+        } else {
+            int8_t status = read_repeat(f->in, type, data, e->sector);
+            if(status != DECODE_OK) {
+                if(status == DECODE_CORRUPT) { errno = EINVAL; }
+                if(status == DECODE_STORE) { errno = ENOENT; }
+                if(status == DECODE_BASE) { errno = ENXIO; }
+                return NULL;
+            }
+        }
+        goto rebuilt;
+    }
+    memset(&r, 0, sizeof(r));
+    r.f = f->in;
+    if(fseeko(f->in, in_offset, SEEK_SET) != 0) {
+        return NULL;
+    }
+    if(t->addressed) {
+        msf_add(run->address, n, e->sector + 0x00C);
+    }
+    if(!read_sector(&r, type, e->sector)) { return NULL; }
+
+rebuilt:
+    e->out_offset = out_offset;
+    e->used = f->cache_clock;
+
+found:
+    return e->sector + 2352 - t->size;
+}
+
+//
+// Read from the decoded sectors, leaving out any subchannel data
+//
+// Returns nonzero on error
+//
+static int read_sectors(ecm_file* f, off_t offset, uint8_t* dest, size_t size) {
+    if(offset < 0 || offset > f->size || (off_t)size > f->size - offset) {
+        errno = EINVAL;
+        return 1;
+    }
+    while(size) {
+        const ecm_run* run = f->runs + find_run(f, offset);
+        off_t within = offset - run->out_offset;
+        size_t unit = sector_types[run->type].size;
+        size_t n;
+        if(run->type == 0) {
+            //
+            // Literal bytes are stored as-is
+            //
+            off_t left = ((off_t)run->count) - within;
+            n = size;
+            if((off_t)n > left) { n = (size_t)left; }
+            if(fseeko(f->in, run->in_offset + within, SEEK_SET) != 0) { return 1; }
+            if(fread(dest, 1, n, f->in) != n) {
+                if(feof(f->in)) { errno = EINVAL; }
+                return 1;
+            }
+        } else {
+            const uint8_t* sector = get_sector(f, run, (uint32_t)(within / unit));
+            size_t skip = (size_t)(within % unit);
+            if(!sector) {
+                if(feof(f->in)) { errno = EINVAL; }
+                return 1;
+            }
+            n = unit - skip;
+            if(n > size) { n = size; }
+            memcpy(dest, sector + skip, n);
+        }
+        dest += n;
+        offset += n;
+        size -= n;
+    }
+    return 0;
+}
+
+int ecm_read(ecm_file* f, off_t offset, void* buffer, size_t size) {
+    uint8_t* dest = (uint8_t*)buffer;
+
+    if(!f->sub.sectors) {
+        return read_sectors(f, offset, dest, size);
+    }
+    if(offset < 0 || offset > ecm_size(f) || (off_t)size > ecm_size(f) - offset) {
+        errno = EINVAL;
+        return 1;
+    }
+    while(size) {
+        off_t sector = offset / 2448;
+        size_t within = (size_t)(offset % 2448);
+        size_t n = (within < 2352 ? 2352 : 2448) - within;
+        if(n > size) { n = size; }
+        if(within < 2352) {
+            if(read_sectors(f, sector * 2352 + within, dest, n)) { return 1; }
+        } else {
+            uint8_t sub[SUBCHANNEL_SIZE];
+            if(!subchannel_sector(&f->sub, sector, sub)) {
+                errno = EINVAL;
+                return 1;
+            }
+            memcpy(dest, sub + (within - 2352), n);
+        }
+        dest += n;
+        offset += n;
+        size -= n;
+    }
+    return 0;
+}
+
+int ecm_read_sector(ecm_file* f, uint32_t lba, uint8_t* sector) {
+    return read_sectors(f, ((off_t)lba) * 2352, sector, 2352);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Everything from here on is only used by the command line tool
+//
+#ifndef ECM_NO_MAIN
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Re-encoding an ECM file (bin2ecm --recode)
+//
+// The image is decoded through the random-access reader as the encoder reads
+// it, so it never goes to disk.  A run of a type the encoder detects tells it
+// what checking each of the run's units would find, in the format being
+// written; a TYPE_RAW_MODE2 run, the form of each sector.  Literal bytes, and
+// sectors stored as patches, fills, repeats or references, are checked again.
+//
+
+//
+// The file's positions and EDC leave out any subchannel data it kept apart,
+// so they're only of use to an encode that does the same (subchannel
+// nonzero); for any other, the cache is left empty
+//
+// Returns nonzero on error, with a message
+//
+static int8_t probe_cache_from_records(probe_cache* c, ecm_file* f, int8_t subchannel) {
+    probe_map* m;
+    size_t alloc = 0;
+    size_t i;
+
+    memset(c, 0, sizeof(*c));
+    if((f->sub.sectors != 0) != (subchannel != 0)) { return 0; }
+    c->maps = calloc(1, sizeof(probe_map));
+    if(!c->maps) {
+        printf("Out of memory\n");
+        return 1;
+    }
+    c->count = 1;
+    m = c->maps;
+    m->end = f->size;
+    c->expected = 1;
+    c->edc = f->output_edc;
+
+    for(i = 0; i < f->run_count; i++) {
+        const ecm_run* run = f->runs + i;
+        int8_t type = run->type;
+        if(type == TYPE_MODE1_SEQ) { type = 1; }
+        if(type == TYPE_RAW_MODE2) {
+            //
+            // Version 1 has no whole mode 2 sectors; there, each body is
+            // checked after its header
+            //
+            uint8_t buffer[256];
+            off_t map = run->in_offset - form_map_size(run->count);
+            uint32_t n = 0;
+            if(fseeko(f->in, map, SEEK_SET) != 0) { goto error_in; }
+            while(n < run->count) {
+                size_t b = form_map_size(run->count - n);
+                size_t k;
+                if(b > sizeof(buffer)) { b = sizeof(buffer); }
+                if(fread(buffer, 1, b, f->in) != b) { goto error_in; }
+                for(k = 0; k < b * 4 && n < run->count; k++, n++) {
+                    uint8_t form = (buffer[k >> 2] >> ((k & 3) * 2)) & 3;
+                    off_t offset = run->out_offset + (off_t)n * 2352;
+                    int8_t body;
+                    if(form >= RAW_FORM_CODES) { break; }
+                    body = raw_form_types[form];
+                    if(format_version == 2) {
+                        if(probe_map_add(m, &alloc, offset, 1, (uint8_t)(PROBE_RAW | (form + 1)))) { return 1; }
+                    } else if(sector_types[body].version == 1) {
+                        if(probe_map_add(m, &alloc, offset + 0x010, 1, (uint8_t)body)) { return 1; }
+                    }
+                }
+                if(k < b * 4 && n < run->count) { break; }
+            }
+        } else if(type && sector_types[type].detect && sector_types[type].version <= format_version) {
+            if(probe_map_add(m, &alloc, run->out_offset, run->count, (uint8_t)type)) { return 1; }
+        }
+    }
+    return 0;
+
+error_in:
+    printfileerror(f->in, f->filename);
+    return 1;
+}
+
+//
+// Returns nonzero on error
+//
+static int8_t recode(const char* infilename, const char* outfilename) {
+    int8_t returncode;
+    ecm_container container;
+    cue_sheet cue;
+    FILE* in;
+    int8_t status;
+    ecm_file* f = ecm_open(infilename);
+    if(!f) {
+        if(errno == EINVAL) {
+            printf("Error: %s: not an ECM file, or corrupt\n", infilename);
+        } else if(errno == ENXIO) {
+            printf("Error: %s: %s\n", infilename, base_problem());
+        } else {
+            printfileerror(NULL, infilename);
+        }
+        return 1;
+    }
+
+    //
+    // A container keeps its cue sheet and files
+    //
+    memset(&container, 0, sizeof(container));
+    in = fopen(infilename, "rb");
+    if(!in) {
+        printfileerror(NULL, infilename);
+        ecm_close(f);
+        return 1;
+    }
+    status = container_open(in, &container);
+    if(status == DECODE_OK) { status = container_cue(in, &container, &cue); }
+    container_free(&container);
+    fclose(in);
+    if(status != DECODE_OK) {
+        printf("Error: %s: %s\n", infilename, status == DECODE_NOMEM ? "out of memory" : "corrupt");
+        ecm_close(f);
+        return 1;
+    }
+    if(cue.file_count && format_version == 1) {
+        printf("Error: %s: a cue sheet's files need the version 2 format\n", infilename);
+        cue_free(&cue);
+        ecm_close(f);
+        return 1;
+    }
+
+    returncode = ecmify(infilename, outfilename, NULL, 0, f, cue.file_count ? &cue : NULL, cue.file_count != 0);
+    cue_free(&cue);
+    ecm_close(f);
+    return returncode;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Extract part of the decoded image (ecm2bin --range=START:LEN)
+//
+// Returns nonzero on error
+//
+static int8_t extract_range(
+    const char* infilename,
+    const char* outfilename,
+    off_t start,
+    off_t length
+) {
+    int8_t returncode = 0;
+
+    ecm_file* f = NULL;
+    FILE* out = NULL;
+    uint8_t* buffer = NULL;
+    off_t done_bytes = 0;
+    int8_t created = 0; // to be removed if the extract fails
+
+    //
+    // Ensure the output file doesn't already exist
+    //
+    out = fopen(outfilename, "rb");
+    if(out) {
+        printf("Error: %s exists; refusing to overwrite\n", outfilename);
+        goto error;
+    }
+
+    f = ecm_open(infilename);
+    if(!f) {
+        if(errno == EINVAL) {
+            printf("Error: %s: not an ECM file, or corrupt\n", infilename);
+            goto error;
+        }
+        if(errno == ENXIO) {
+            printf("Error: %s: %s\n", infilename, base_problem());
+            goto error;
+        }
+        goto error_in;
+    }
+    if(!f->index_loaded) {
+        //
+        // Best effort; the next extract from this file can skip the scan
+        //
+        ecm_save_index(f);
+    }
+
+    //
+    // A length of -1 means through the end
+    //
+    if(length < 0 && start <= ecm_size(f)) { length = ecm_size(f) - start; }
+    if(start > ecm_size(f) || length > ecm_size(f) - start) {
+        printf("Error: range is past the end of the image (");
+        fprintdec(stdout, ecm_size(f));
+        printf(" bytes)\n");
+        goto error;
+    }
+
+    buffer = malloc(DECODE_BATCH_SIZE);
+    if(!buffer) {
+        printf("Out of memory\n");
+        goto error;
+    }
+
+    out = fopen(outfilename, "wb");
+    if(!out) { goto error_out; }
+    created = 1;
+
+    printf("Extracting ");
+    fprintdec(stdout, length);
+    printf(" bytes at ");
+    fprintdec(stdout, start);
+    printf(" from %s to %s...\n", infilename, outfilename);
+
+    while(done_bytes < length) {
+        size_t n = DECODE_BATCH_SIZE;
+        if((off_t)n > length - done_bytes) { n = (size_t)(length - done_bytes); }
+        if(ecm_read(f, start + done_bytes, buffer, n)) {
+            if(errno == ENOENT) {
+                printf("Error: %s: %s\n", infilename, shared_store ?
+                    "sector missing from the shared store" :
+                    "refers to a shared store; give it with --store=DIR");
+                goto error;
+            }
+            if(errno == ENXIO) {
+                printf("Error: %s: %s\n", infilename, base_problem());
+                goto error;
+            }
+            goto error_in;
+        }
+        if(fwrite(buffer, 1, n, out) != n) { goto error_out; }
+        done_bytes += n;
+    }
+
+    //
+    // Success
+    //
+    printf("Done\n");
+    returncode = 0;
+    goto done;
+
+error_in:
+    printfileerror(NULL, infilename);
+    goto error;
+
+error_out:
+    printfileerror(out, outfilename);
+    goto error;
+
+error:
+    returncode = 1;
+    goto done;
+
+done:
+    if(buffer != NULL) { free(buffer); }
+    if(f      != NULL) { ecm_close(f); }
+    if(out    != NULL) { fclose(out); }
+    if(returncode && created) { remove(outfilename); }
+
+    return returncode;
+}
+
+//
+// Write only the user data of the image's sectors (ecm2bin --iso)
+//
+// Sectors whose user data is stored as-is aren't rebuilt, and version 2 blocks
+// are checked against the EDC of their records rather than of the decoded
+// data, so this is far quicker than a full decode.  Version 1 files have only
+// the EDC of the whole image, so every sector is rebuilt to check it.
+//
+// Returns nonzero on error
+//
+static int8_t extract_iso(
+    const char* infilename,
+    const char* outfilename
+) {
+    int8_t returncode = 0;
+
+    FILE* in = NULL;
+    FILE* out = NULL;
+    ecm_container container;
+    decode_output o;
+    uint8_t* records = NULL;
+    size_t records_alloc = 0;
+    off_t failed_block = -1;
+    image_digest digest;
+    int8_t status;
+    int8_t created = 0; // to be removed if the extract fails
+
+    memset(&container, 0, sizeof(container));
+    decode_output_init(&o, NULL, NULL, 0, -1, 0);
+
+    if(digest_init(&digest, digest_selected)) {
+        printf("Out of memory\n");
+        goto error;
+    }
+
+    //
+    // Ensure the output file doesn't already exist
+    //
+    out = fopen(outfilename, "rb");
+    if(out) {
+        printf("Error: %s exists; refusing to overwrite\n", outfilename);
+        fclose(out);
+        out = NULL;
+        goto error;
+    }
+
+    in = fopen(infilename, "rb");
+    if(!in) { goto error_in; }
+
+    status = container_open(in, &container);
+    switch(status) {
+    case DECODE_ERROR_IN: goto error_in;
+    case DECODE_NOMEM:
+        printf("Out of memory\n");
+        goto error;
+    case DECODE_NOT_ECM:
+        printf("Header missing; does not appear to be an ECM file\n");
+        goto error;
+    case DECODE_BAD_INDEX:
+        printf("Corrupt ECM file; missing or invalid index\n");
+        goto error;
+    }
+
+    status = base_check(in, &container);
+    switch(status) {
+    case DECODE_ERROR_IN: goto error_in;
+    case DECODE_CORRUPT:
+        printf("Corrupt ECM file; invalid base image section\n");
+        goto error;
+    case DECODE_BASE:
+        printf("Error: %s: %s\n", infilename, base_problem());
+        goto error;
+    }
+
+    out = fopen(outfilename, "wb");
+    if(!out) { goto error_out; }
+    created = 1;
+
+    decode_output_init(&o, out, malloc(DECODE_BATCH_SIZE), 0, -1, 0);
+    if(!o.batch) {
+        printf("Out of memory\n");
+        goto error;
+    }
+    o.user_data = 1;
+    o.digest = &digest;
+
+    resetcounter(container.file_size);
+
+    printf("Extracting user data of %s to %s...\n", infilename, outfilename);
+
+    if(container.version == 1) {
+        record_reader r;
+        uint8_t edc[4];
+        memset(&r, 0, sizeof(r));
+        r.f = in;
+        o.rebuild = 1;
+        status = decode_records(&r, &o, 1);
+        if(status == DECODE_OK && fread(edc, 1, 4, in) != 4) { status = DECODE_ERROR_IN; }
+        if(status == DECODE_OK && get32lsb(edc) != o.image_edc) { status = DECODE_CHECKSUM; }
+    } else {
+        size_t i;
+        status = DECODE_OK;
+        for(i = 0; i < container.block_count && status == DECODE_OK; i++) {
+            uint8_t header[ECM_BLOCK_HEADER_SIZE];
+            record_reader r;
+            status = read_block(in, &container, i, &records, &records_alloc, header);
+            if(status != DECODE_OK) { break; }
+            memset(&r, 0, sizeof(r));
+            r.data = records;
+            r.size = get32lsb(header);
+            r.extended = 1;
+            r.source = in;
+            status = decode_records(&r, &o, 0);
+            if(
+                status == DECODE_OK &&
+                o.image_size != container.blocks[i].output_offset + (off_t)block_size(&container, i)
+            ) {
+                status = DECODE_CORRUPT;
+            }
+            setcounter_decode(i + 1 < container.block_count ? container.blocks[i + 1].offset : container.file_size);
+        }
+        if(status != DECODE_OK) { failed_block = (off_t)i; }
+    }
+    if(status == DECODE_OK && decode_flush(&o)) { status = DECODE_ERROR_OUT; }
+
+    if(status != DECODE_OK && failed_block >= 0) {
+        printf("Block ");
+        fprintdec(stdout, failed_block);
+        printf(" (output offset ");
+        fprintdec(stdout, container.blocks[failed_block].output_offset);
+        printf("): ");
+    }
+    switch(status) {
+    case DECODE_ERROR_IN: goto error_in;
+    case DECODE_ERROR_OUT: goto error_out;
+    case DECODE_NOMEM:
+        printf("Out of memory\n");
+        goto error;
+    case DECODE_CORRUPT:
+        printf("Corrupt ECM file; invalid sector count\n");
+        goto error;
+    case DECODE_CHECKSUM:
+        printf("Checksum error\n");
+        goto error;
+    case DECODE_STORE:
+        printf(shared_store ?
+            "A stored sector is missing from the shared store\n" :
+            "The file refers to a shared store; give it with --store=DIR\n");
+        goto error;
+    case DECODE_BASE:
+        printf("Error: %s: %s\n", infilename, base_problem());
+        goto error;
+    }
+
+    printf("Extracted ");
+    fprintdec(stdout, o.batch_offset / 0x800);
+    printf(" sectors (");
+    fprintdec(stdout, o.batch_offset);
+    printf(" bytes) of ");
+    fprintdec(stdout, o.image_size);
+    printf(" bytes\n");
+
+    digest_finish(&digest);
+    digest_print(&digest, outfilename, NULL);
+
+    //
+    // Success
+    //
+    printf("Done\n");
+    returncode = 0;
+    goto done;
+
+error_in:
+    printfileerror(in, infilename);
+    goto error;
+
+error_out:
+    printfileerror(out, outfilename);
+    goto error;
+
+error:
+    returncode = 1;
+    goto done;
+
+done:
+    digest_free(&digest);
+    container_free(&container);
+    if(o.batch != NULL) { free(o.batch); }
+    if(records != NULL) { free(records); }
+    if(in  != NULL) { fclose(in); }
+    if(out != NULL) { fclose(out); }
+    if(returncode && created) { remove(outfilename); }
+
+    return returncode;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Describe ECM files without decoding them (ecm2bin --info)
+//
+// Version 2 files are described from their "META" section.  Version 1 files,
+// and version 2 files without one, are described by reading the record
+// headers and seeking past the data.  Writes lines of the form:
+//
+//   filename <TAB> key <TAB> value
+//
+#define ECM_META_MAX_SIZE 0x10000
+
+typedef struct {
+    int8_t version;
+    off_t  size;
+    off_t  runs;
+    off_t  types[TYPE_COUNT];
+    int8_t from_metadata;
+} ecm_info;
+
+//
+// Fill in info from the "META" section, if there is a usable one
+//
+// Returns nonzero if it was used
+//
+static int8_t read_metadata(FILE* in, const ecm_container* c, ecm_info* info) {
+    uint8_t* meta = NULL;
+    off_t offset;
+    off_t size;
+    size_t pos;
+    int8_t got_size = 0;
+    int8_t got_runs = 0;
+    int8_t got_types = 0;
+
+    if(!container_section(c, "META", &offset, &size)) { return 0; }
+    if(size < 0 || size > ECM_META_MAX_SIZE || offset < 4 || size > c->directory_offset - offset) {
+        return 0;
+    }
+    meta = malloc((size_t)size + 1);
+    if(!meta) { return 0; }
+    if(
+        fseeko(in, offset, SEEK_SET) != 0 ||
+        fread(meta, 1, (size_t)size, in) != (size_t)size
+    ) {
+        free(meta);
+        return 0;
+    }
+    for(pos = 0; pos + ECM_FIELD_HEADER_SIZE <= (size_t)size; ) {
+        const uint8_t* field = meta + pos + ECM_FIELD_HEADER_SIZE;
+        uint32_t n = get32lsb(meta + pos + 4);
+        if(n > (size_t)size - pos - ECM_FIELD_HEADER_SIZE) { break; }
+        if(!memcmp(meta + pos, "SIZE", 4) && n == 8) {
+            info->size = get64lsb(field);
+            got_size = info->size >= 0;
+        } else if(!memcmp(meta + pos, "RUNS", 4) && n == 8) {
+            info->runs = get64lsb(field);
+            got_runs = info->runs >= 0;
+        } else if(!memcmp(meta + pos, "TYPE", 4)) {
             //
-            // Skipping through literal bytes
+            // Written by an older or newer encoder, this may have fewer or
+            // more types than we know
             //
-            literal_skip--;
-            detecttype = 0;
+            uint32_t i;
+            got_types = 1;
+            for(i = 0; i < n / 8 && i < TYPE_COUNT; i++) {
+                info->types[i] = get64lsb(field + 8 * i);
+                if(info->types[i] < 0) { got_types = 0; }
+            }
+        }
+        pos += ECM_FIELD_HEADER_SIZE + n;
+    }
+    free(meta);
+    info->from_metadata = got_size && got_runs && got_types;
+    return info->from_metadata;
+}
+
+//
+// Read the header of the "SUBC" section
+//
+// Returns nonzero if the file has one
+//
+static int8_t read_subchannel_header(FILE* in, const ecm_container* c, int8_t* layout, off_t* sectors) {
+    uint8_t header[ECM_SUBC_HEADER_SIZE];
+    off_t offset;
+    off_t size;
+    if(c->version != 2 || !container_section(c, "SUBC", &offset, &size)) { return 0; }
+    if(
+        size < ECM_SUBC_HEADER_SIZE ||
+        fseeko(in, offset, SEEK_SET) != 0 ||
+        fread(header, 1, sizeof(header), in) != sizeof(header)
+    ) {
+        return 0;
+    }
+    *layout = (int8_t)get32lsb(header);
+    *sectors = get64lsb(header + 4);
+    return 1;
+}
+
+//
+// Number of files of a container (bin2ecm foo.cue), from its "TRKS" section
+//
+// Returns 0 if it isn't one
+//
+static uint32_t read_file_count(FILE* in, const ecm_container* c) {
+    uint8_t header[4];
+    off_t offset;
+    off_t size;
+    if(c->version != 2 || !container_section(c, "TRKS", &offset, &size)) { return 0; }
+    if(
+        size < 4 ||
+        fseeko(in, offset, SEEK_SET) != 0 ||
+        fread(header, 1, sizeof(header), in) != sizeof(header)
+    ) {
+        return 0;
+    }
+    return get32lsb(header);
+}
+
+//
+// Returns nonzero if any file couldn't be described
+//
+static int8_t info_files(char** filenames, size_t count) {
+    int8_t returncode = 0;
+    size_t i;
+
+    for(i = 0; i < count; i++) {
+        const char* filename = filenames[i];
+        ecm_container container;
+        ecm_info info;
+        int8_t status = DECODE_ERROR_IN;
+        int error = 0;
+        int t;
+        int8_t has_subchannel = 0;
+        int8_t layout = 0;
+        off_t subchannel_sectors = 0;
+        uint32_t file_count = 0;
+        FILE* in;
+
+        memset(&info, 0, sizeof(info));
+        memset(&container, 0, sizeof(container));
 
+        in = fopen(filename, "rb");
+        if(in) {
+            status = container_open(in, &container);
+            if(status == DECODE_ERROR_IN) { error = feof(in) ? -1 : errno; }
         } else {
-            //
-            // Heuristic to skip past CD sync after a mode 2 sector
-            //
-            if(
-                curtype >= 2 &&
-                queue_bytes_available >= 0x10 &&
-                queue[queue_start_ofs + 0x0] == 0x00 &&
-                queue[queue_start_ofs + 0x1] == 0xFF &&
-                queue[queue_start_ofs + 0x2] == 0xFF &&
-                queue[queue_start_ofs + 0x3] == 0xFF &&
-                queue[queue_start_ofs + 0x4] == 0xFF &&
-                queue[queue_start_ofs + 0x5] == 0xFF &&
-                queue[queue_start_ofs + 0x6] == 0xFF &&
-                queue[queue_start_ofs + 0x7] == 0xFF &&
-                queue[queue_start_ofs + 0x8] == 0xFF &&
-                queue[queue_start_ofs + 0x9] == 0xFF &&
-                queue[queue_start_ofs + 0xA] == 0xFF &&
-                queue[queue_start_ofs + 0xB] == 0x00 &&
-                queue[queue_start_ofs + 0xF] == 0x02
-            ) {
-                // Treat this byte as a literal...
-                detecttype = 0;
-                // ...and skip the next 15
-                literal_skip = 15;
+            error = errno;
+        }
+        if(status == DECODE_OK) {
+            info.version = container.version;
+            has_subchannel = read_subchannel_header(in, &container, &layout, &subchannel_sectors);
+            file_count = read_file_count(in, &container);
+            if(read_metadata(in, &container, &info)) {
+                //
+                // The size there doesn't count subchannel data
+                //
+                info.size += subchannel_sectors * SUBCHANNEL_SIZE;
             } else {
                 //
-                // Detect the sector type at the current offset
+                // Fall back on the record headers
                 //
-                detecttype = detect_sector(queue + queue_start_ofs, queue_bytes_available);
+                ecm_file* f = ecm_open(filename);
+                if(f) {
+                    size_t r;
+                    info.size = ecm_size(f);
+                    info.runs = (off_t)f->run_count;
+                    for(r = 0; r < f->run_count; r++) {
+                        info.types[f->runs[r].type] += f->runs[r].count;
+                    }
+                    ecm_close(f);
+                } else {
+                    status = (errno == EINVAL) ? DECODE_CORRUPT : DECODE_ERROR_IN;
+                    error = errno;
+                }
             }
         }
+        if(in) { fclose(in); }
 
-        if(
-            (detecttype == curtype) &&
-            (curtype_count <= 0x7FFFFFFF) // avoid overflow
-        ) {
+        switch(status) {
+        case DECODE_OK:
+            break;
+        case DECODE_NOT_ECM:
+            printf("%s\terror\tnot an ECM file\n", filename);
+            break;
+        case DECODE_BAD_INDEX:
+            printf("%s\terror\tmissing or invalid index\n", filename);
+            break;
+        case DECODE_CORRUPT:
+            printf("%s\terror\tcorrupt records\n", filename);
+            break;
+        case DECODE_NOMEM:
+            printf("%s\terror\tout of memory\n", filename);
+            break;
+        default:
+            printf("%s\terror\t%s\n", filename, error < 0 ? "unexpected end-of-file" : strerror(error));
+            break;
+        }
+        if(status != DECODE_OK) {
+            returncode = 1;
+            container_free(&container);
+            continue;
+        }
+
+        printf("%s\tformat\t%d\n", filename, (int)info.version);
+        printf("%s\tsize\t", filename); fprintdec(stdout, info.size); printf("\n");
+        if(info.version == 2) {
+            printf("%s\tblocks\t", filename); fprintdec(stdout, (off_t)container.block_count); printf("\n");
+        }
+        printf("%s\truns\t", filename); fprintdec(stdout, info.runs); printf("\n");
+        for(t = 0; t < TYPE_COUNT; t++) {
+            printf("%s\t%s\t", filename, sector_types[t].name); fprintdec(stdout, info.types[t]); printf("\n");
+        }
+        if(has_subchannel) {
+            printf("%s\tsubchannel\t%s\n", filename, layout == SUBCHANNEL_PACKED ? "packed" : "interleaved");
+        }
+        if(file_count) {
+            printf("%s\tfiles\t%lu\n", filename, (unsigned long)file_count);
+        }
+        printf("%s\tsource\t%s\n", filename, info.from_metadata ? "metadata" : "headers");
+
+        container_free(&container);
+    }
+
+    return returncode;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Verify-only decode of any number of ECM files
+//
+// Each file is reconstructed and checked against its EDC in memory, with no
+// output written; files are handed out to worker threads.  One line per file
+// is written to stdout, in the order given:
+//
+//   filename <TAB> pass <TAB> decoded size
+//   filename <TAB> fail <TAB> reason
+//
+typedef struct {
+    int8_t   status;
+    int      error; // errno, for DECODE_ERROR_IN
+    off_t    output_bytes;
+    off_t    failed_block;
+    int8_t   in_subchannel; // the error is in the subchannel data
+    image_digest digest;    // --hash
+} test_result;
+
+typedef struct {
+    char** filenames;
+    test_result* results;
+    jobqueue jobs;
+} test_context;
+
+static void test_worker(void* context, unsigned index) {
+    test_context* ctx = (test_context*)context;
+    size_t job;
+
+    while(jobqueue_take(&ctx->jobs, &job)) {
+        test_result* r = ctx->results + job;
+        decode_result result;
+        ecm_container container;
+        FILE* in = fopen(ctx->filenames[job], "rb");
+        r->failed_block = -1;
+        if(!in) {
+            r->status = DECODE_ERROR_IN;
+            r->error = errno;
+            continue;
+        }
+        r->status = container_open(in, &container);
+        if(r->status == DECODE_OK && digest_init(&r->digest, digest_selected)) {
+            r->status = DECODE_NOMEM;
+        }
+        if(r->status == DECODE_OK) {
+            image_digest* digest = digest_selected ? &r->digest : NULL;
+            subchannel sub;
             //
-            // Same type as last sector
+            // The subchannel data is loaded first, as it's part of the image
+            // that's digested
             //
-            curtype_count++;
-
-        } else {
+            r->status = subchannel_open(in, &container, &sub);
+            r->in_subchannel = (r->status != DECODE_OK);
+            if(r->status == DECODE_OK) {
+                r->status = base_check(in, &container);
+            }
             //
-            // Changing types: Flush the input
+            // Version 2 blocks are checked in turn; the parallelism here is
+            // across files
             //
-            if(curtype_count > 0) {
-                if(fseeko(in, curtype_in_start, SEEK_SET) != 0) { goto error_in; }
-                typetally[curtype] += curtype_count;
-                if(write_sectors(
-                    curtype,
-                    curtype_count,
-                    infilename,
-                    outfilename,
-                    in,
-                    out
-                )) { goto error; }
+            if(r->status == DECODE_OK) {
+                if(container.version == 1) {
+                    r->status = decode_stream(in, NULL, digest, 0, index + 1, &result);
+                } else {
+                    r->status = check_blocks(in, &container, &sub, digest, index + 1, &result);
+                }
+                r->output_bytes = result.output_bytes + sub.sectors * SUBCHANNEL_SIZE;
+                r->failed_block = result.failed_block;
             }
-            curtype = detecttype;
-            curtype_in_start = input_bytes_checked;
-            curtype_count = 1;
+            if(r->status == DECODE_OK) {
+                digest_finish(&r->digest);
+            }
+            subchannel_free(&sub);
+            container_free(&container);
+        }
+        digest_free(&r->digest);
+        if(r->status == DECODE_ERROR_IN) {
+            r->error = feof(in) ? -1 : errno;
+        }
+        fclose(in);
+    }
+}
+
+//
+// Returns nonzero if any file failed
+//
+static int8_t test_files(char** filenames, size_t count) {
+    int8_t returncode = 0;
+    test_context ctx;
+    unsigned workers;
+    size_t i;
+
+    ctx.filenames = filenames;
+    ctx.results = calloc(count, sizeof(test_result));
+    if(!ctx.results) {
+        printf("Out of memory\n");
+        return 1;
+    }
+    jobqueue_init(&ctx.jobs, count);
 
+    workers = get_thread_count();
+    if(workers > count) { workers = (unsigned)count; }
+    run_workers(test_worker, &ctx, workers);
+
+    for(i = 0; i < count; i++) {
+        test_result* r = ctx.results + i;
+        printf("%s\t%s\t", filenames[i], r->status == DECODE_OK ? "pass" : "fail");
+        switch(r->status) {
+        case DECODE_OK:
+            fprintdec(stdout, r->output_bytes);
+            break;
+        case DECODE_NOT_ECM:
+            printf("not an ECM file");
+            break;
+        case DECODE_BAD_INDEX:
+            printf("missing or invalid index");
+            break;
+        case DECODE_ERROR_IN:
+            printf("%s", r->error < 0 ? "unexpected end-of-file" : strerror(r->error));
+            break;
+        case DECODE_CORRUPT:
+            printf("%s", r->in_subchannel ? "invalid subchannel data" : "invalid sector count");
+            break;
+        case DECODE_CHECKSUM:
+            printf("checksum error");
+            break;
+        case DECODE_NOMEM:
+            printf("out of memory");
+            break;
+        case DECODE_STORE:
+            printf("%s", shared_store ?
+                "sector missing from the shared store" :
+                "refers to a shared store; give it with --store=DIR");
+            break;
+        case DECODE_BASE:
+            printf("%s", base_problem());
+            break;
+        }
+        if(r->status != DECODE_OK && r->failed_block >= 0) {
+            printf(" in block ");
+            fprintdec(stdout, r->failed_block);
+        }
+        if(r->status == DECODE_CHECKSUM && r->in_subchannel) {
+            printf(" in subchannel data");
         }
+        printf("\n");
+        if(r->status == DECODE_OK) {
+            digest_print(&r->digest, filenames[i], ".ecm");
+        }
+        if(r->status != DECODE_OK) { returncode = 1; }
+    }
 
-        //
-        // Current type is negative ==> quit
-        //
-        if(curtype < 0) { break; }
+    jobqueue_destroy(&ctx.jobs);
+    free(ctx.results);
 
-        //
-        // Advance to the next sector
-        //
-        input_bytes_checked   += sectorsize[curtype];
-        queue_start_ofs       += sectorsize[curtype];
-        queue_bytes_available -= sectorsize[curtype];
+    return returncode;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Consistency check of a shared store (ecm2bin --check-store --store=DIR)
+//
+// Every entry of the index must be in order and point into the pack at a bulk
+// of a known type that matches its ID, and every stored sector of the given
+// ECM files must be in the store.  One line for the store, then one per file,
+// is written to stdout:
+//
+//   name <TAB> pass <TAB> number of entries or references
+//   name <TAB> fail <TAB> reason
+//
+// Returns nonzero if anything failed
+//
+static int8_t check_store(const char* directory, char** filenames, size_t count) {
+    int8_t returncode = 0;
+    ecm_store* s = shared_store;
+    off_t last = -1;
+    off_t used = STORE_PACK_HEADER_SIZE; // bytes of the pack that entries take up
+    size_t i;
 
+    for(i = 0; i < s->entries; i++) {
+        const uint8_t* e = s->index + STORE_INDEX_HEADER_SIZE + i * STORE_ENTRY_SIZE;
+        off_t id = get64lsb(e);
+        off_t offset = get64lsb(e + 8);
+        const char* problem = NULL;
+        if(id <= last) {
+            problem = "index out of order";
+        } else if(offset < STORE_PACK_HEADER_SIZE || offset >= s->covered) {
+            problem = "offset outside the pack";
+        } else if(!is_bulk(s->pack[offset])) {
+            problem = "unknown bulk type";
+        } else if(s->covered - offset - 1 < (off_t)sector_types[s->pack[offset]].stored[0][1]) {
+            problem = "entry runs past the end of the pack";
+        } else if(bulk_id((int8_t)s->pack[offset], s->pack + offset + 1) != id) {
+            problem = "contents don't match the ID";
+        }
+        if(problem) {
+            printf("%s\tfail\t%s at entry ", directory, problem);
+            fprintdec(stdout, (off_t)i);
+            printf("\n");
+            returncode = 1;
+            break;
+        }
+        used += (off_t)(1 + sector_types[s->pack[offset]].stored[0][1]);
+        last = id;
+    }
+    if(!returncode) {
+        printf("%s\tpass\t", directory);
+        fprintdec(stdout, (off_t)s->entries);
+        printf(" entries");
+        if(used < s->covered) {
+            printf(", ");
+            fprintdec(stdout, s->covered - used);
+            printf(" bytes unused");
+        }
+        printf("\n");
     }
 
-    //
-    // Store the end-of-records indicator
-    //
-    if(write_type_count(outfilename, out, 0, 0)) { goto error; }
+    for(i = 0; i < count; i++) {
+        const char* filename = filenames[i];
+        ecm_file* f = ecm_open(filename);
+        const char* problem = NULL;
+        off_t references = 0;
+        off_t at = -1; // output offset of a sector that's missing
+        size_t r;
+
+        if(!f) {
+            printf("%s\tfail\t%s\n", filename,
+                errno == EINVAL ? "not an ECM file, or corrupt" :
+                errno == ENXIO ? base_problem() : strerror(errno));
+            returncode = 1;
+            continue;
+        }
+        for(r = 0; r < f->run_count && !problem; r++) {
+            const ecm_run* run = f->runs + r;
+            uint32_t n;
+            if(!is_stored(run->type)) { continue; }
+            if(fseeko(f->in, run->in_offset, SEEK_SET) != 0) {
+                problem = strerror(errno);
+                break;
+            }
+            for(n = 0; n < run->count; n++) {
+                uint8_t reference[REPEAT_UNIT_SIZE];
+                uint8_t sector[2352];
+                if(fread(reference, 1, REPEAT_UNIT_SIZE, f->in) != REPEAT_UNIT_SIZE) {
+                    problem = feof(f->in) ? "unexpected end-of-file" : strerror(errno);
+                    break;
+                }
+                if(!bulk_fits(run->type, reference[0])) {
+                    problem = "corrupt records";
+                    break;
+                }
+                if(store_read(s, (int8_t)reference[0], get64lsb(reference + 1), sector)) {
+                    problem = "sector missing from the shared store";
+                    at = subchannel_image_offset(&f->sub,
+                        run->out_offset + ((off_t)n) * (off_t)sector_types[run->type].size);
+                    break;
+                }
+                references++;
+            }
+        }
+        if(problem) {
+            printf("%s\tfail\t%s", filename, problem);
+            if(at >= 0) {
+                printf(" at output offset ");
+                fprintdec(stdout, at);
+            }
+            printf("\n");
+            returncode = 1;
+        } else {
+            printf("%s\tpass\t", filename);
+            fprintdec(stdout, references);
+            printf(" references\n");
+        }
+        ecm_close(f);
+    }
+
+    return returncode;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Integrity scan of a raw image
+//
+// Checks every sector in parallel, read-only, and writes one line per sector
+// to stdout.  Sectors are 2352 bytes, or 2448 in an image with subchannel
+// data, which is skipped over:
+//
+//   filename <TAB> lba <TAB> claimed type <TAB> EDC status <TAB> ECC status
+//
+#define SCAN_CHUNK_SECTORS 256
+
+typedef struct {
+    const char* filename;
+    off_t sectors;
+    off_t stride;      // from one sector to the next
+    uint8_t* results;
+    jobqueue jobs;
+} scan_context;
+
+static void scan_worker(void* context, unsigned index) {
+    scan_context* ctx = (scan_context*)context;
+    FILE* in = NULL;
+    uint8_t* buffer = NULL;
+    size_t job;
+
+    (void)index;
+
+    in = fopen(ctx->filename, "rb");
+    if(!in) { jobqueue_fail(&ctx->jobs, errno); goto done; }
+
+    buffer = malloc((size_t)ctx->stride * SCAN_CHUNK_SECTORS);
+    if(!buffer) { jobqueue_fail(&ctx->jobs, ENOMEM); goto done; }
+
+    while(jobqueue_take(&ctx->jobs, &job)) {
+        off_t first = ((off_t)job) * SCAN_CHUNK_SECTORS;
+        size_t n = SCAN_CHUNK_SECTORS;
+        size_t i;
+        if(((off_t)n) > ctx->sectors - first) {
+            n = (size_t)(ctx->sectors - first);
+        }
+        if(fseeko(in, first * ctx->stride, SEEK_SET) != 0) {
+            jobqueue_fail(&ctx->jobs, errno);
+            break;
+        }
+        if(fread(buffer, 1, n * (size_t)ctx->stride, in) != n * (size_t)ctx->stride) {
+            jobqueue_fail(&ctx->jobs, feof(in) ? -1 : errno);
+            break;
+        }
+        for(i = 0; i < n; i++) {
+            ctx->results[first + i] = scan_sector(buffer + (size_t)ctx->stride * i);
+        }
+    }
+
+done:
+    if(buffer != NULL) { free(buffer); }
+    if(in     != NULL) { fclose(in); }
+}
+
+//
+// Returns nonzero on error
+//
+static int8_t scan_image(const char* infilename) {
+    int8_t returncode = 0;
+
+    ecm_input in;
+    off_t input_file_length;
+    off_t lba;
+    off_t bad_edc = 0;
+    off_t bad_ecc = 0;
+    unsigned workers;
+
+    scan_context ctx;
+    ctx.filename = infilename;
+    ctx.stride = 2352;
+    ctx.results = NULL;
+    jobqueue_init(&ctx.jobs, 0);
+
+    memset(&in, 0, sizeof(in));
 
     //
-    // Store the EDC of the input file
+    // Get the length of the input file, and whether its sectors carry
+    // subchannel data the way the encoder would decide it
     //
-    put32lsb(sector_buffer, input_edc);
-    if(fwrite(sector_buffer, 1, 4, out) != 4) { goto error_out; }
+    in.f = fopen(infilename, "rb");
+    if(!in.f) { goto error_in; }
+    if(fseeko(in.f, 0, SEEK_END) != 0) { goto error_in; }
+    input_file_length = ftello(in.f);
+    if(input_file_length < 0) { goto error_in; }
+    if(detect_subchannel_image(&in, input_file_length)) {
+        ctx.stride = 2448;
+    }
+    fclose(in.f);
+    in.f = NULL;
+
+    ctx.sectors = input_file_length / ctx.stride;
+    if(((off_t)((size_t)ctx.sectors)) != ctx.sectors) {
+        printf("Out of memory\n");
+        goto error;
+    }
+    ctx.results = malloc(ctx.sectors ? (size_t)ctx.sectors : 1);
+    if(!ctx.results) {
+        printf("Out of memory\n");
+        goto error;
+    }
+
+    jobqueue_destroy(&ctx.jobs);
+    jobqueue_init(&ctx.jobs, (size_t)((ctx.sectors + SCAN_CHUNK_SECTORS - 1) / SCAN_CHUNK_SECTORS));
+
+    workers = get_thread_count();
+    if(workers > ctx.jobs.count) { workers = ctx.jobs.count; }
+    run_workers(scan_worker, &ctx, workers);
+
+    if(ctx.jobs.failed) {
+        printf("Error: %s: %s\n", infilename,
+            ctx.jobs.error < 0 ? "Unexpected end-of-file" : strerror(ctx.jobs.error)
+        );
+        goto error;
+    }
 
     //
-    // Show report
+    // Report
     //
-    printf("Literal bytes........... "); fprintdec(stdout, typetally[0]); printf("\n");
-    printf("Mode 1 sectors.......... "); fprintdec(stdout, typetally[1]); printf("\n");
-    printf("Mode 2 form 1 sectors... "); fprintdec(stdout, typetally[2]); printf("\n");
-    printf("Mode 2 form 2 sectors... "); fprintdec(stdout, typetally[3]); printf("\n");
-    printf("Encoded ");
-    fprintdec(stdout, input_file_length);
-    printf(" bytes -> ");
-    fprintdec(stdout, ftello(out));
-    printf(" bytes\n");
+    for(lba = 0; lba < ctx.sectors; lba++) {
+        uint8_t r = ctx.results[lba];
+        if(SCAN_EDC(r) == CHECK_BAD) { bad_edc++; }
+        if(SCAN_ECC(r) == CHECK_BAD) { bad_ecc++; }
+        printf("%s\t", infilename);
+        fprintdec(stdout, lba);
+        printf("\t%s\t%s\t%s\n",
+            claim_names[SCAN_CLAIM(r)],
+            check_names[SCAN_EDC(r)],
+            check_names[SCAN_ECC(r)]
+        );
+    }
+
+    fprintf(stderr, "%s: ", infilename);
+    fprintdec(stderr, ctx.sectors);
+    fprintf(stderr, " sectors, ");
+    fprintdec(stderr, bad_edc);
+    fprintf(stderr, " bad EDC, ");
+    fprintdec(stderr, bad_ecc);
+    fprintf(stderr, " bad ECC");
+    if(ctx.stride == 2448) {
+        fprintf(stderr, ", with subchannel data");
+    }
+    if(input_file_length % ctx.stride) {
+        fprintf(stderr, ", ");
+        fprintdec(stderr, input_file_length % ctx.stride);
+        fprintf(stderr, " trailing bytes");
+    }
+    fprintf(stderr, "\n");
 
     //
     // Success
     //
-    printf("Done\n");
     returncode = 0;
     goto done;
 
 error_in:
-    printfileerror(in, infilename);
-    goto error;
-
-error_out:
-    printfileerror(out, outfilename);
+    printfileerror(in.f, infilename);
     goto error;
 
 error:
@@ -838,176 +10266,279 @@ error:
     goto done;
 
 done:
-    if(queue != NULL) { free(queue); }
-    if(in    != NULL) { fclose(in ); }
-    if(out   != NULL) { fclose(out); }
+    if(ctx.results != NULL) { free(ctx.results); }
+    if(in.f        != NULL) { fclose(in.f); }
+    jobqueue_destroy(&ctx.jobs);
 
     return returncode;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Returns nonzero on error
+// Estimate how well images would encode, from a sample (bin2ecm --estimate)
 //
-static int8_t unecmify(
-    const char* infilename,
-    const char* outfilename
-) {
-    int8_t returncode = 0;
-
-    FILE* in  = NULL;
-    FILE* out = NULL;
-
-    off_t input_file_length;
+// Windows spread evenly over the image (or the whole image, if it's small)
+// are gone through the way the encoder goes through its input: sectors are
+// looked for wherever one may start, and each window is read again and
+// written to a scratch file through the encoder's writer.  The sector counts,
+// literal bytes and encoded size are scaled up to the whole image, with 95%
+// bounds from how much the windows differ, and so is the time all that took.
+// Repeats and patches aren't looked for, and subchannel data is counted
+// whole, so the encoded size errs high.  Writes lines of the form:
+//
+//   filename <TAB> key <TAB> value
+//
+#define ESTIMATE_WINDOWS        64
+#define ESTIMATE_WINDOW_SECTORS 16
+#define ESTIMATE_Z              1.96
 
-    uint32_t output_edc = 0;
+//
+// Count the sector at unit in tally (literal bytes for type 0) as what the
+// encoder would most likely store it as
+//
+// Returns the bytes that would take, not counting record headers, or -1 if
+// there's no sector there
+//
+static off_t estimate_sector(const uint8_t* unit, size_t size_available, int8_t cooked, off_t* tally) {
+    uint8_t header[FILL_HEADER_SIZE];
+    off_t literal = 0;
+    int8_t form = 0;
     int8_t type;
-    uint32_t num;
+    int8_t bulk;
 
+    if(cooked) {
+        type = (size_available >= 2048) ? TYPE_COOKED : 0;
+    } else {
+        form = (format_version == 2) ? detect_raw_mode2(unit, size_available) : 0;
+        type = form ? TYPE_RAW_MODE2 : detect_sector(unit, size_available, format_version);
+        if(!type && size_available >= 0x010 + 2336 && has_sync(unit)) {
+            //
+            // Mode 2 sync and header as literal bytes, then the body
+            //
+            type = detect_sector(unit + 0x010, size_available - 0x010, format_version);
+            if(type && sector_types[type].size == 2336) {
+                literal = 0x010;
+                unit += literal;
+            } else {
+                type = 0;
+            }
+        }
+    }
+    if(!type) { return -1; }
+    tally[0] += literal;
     //
-    // Ensure the output file doesn't already exist
+    // Mode 1 addresses nearly always count up
     //
-    out = fopen(outfilename, "rb");
-    if(out) {
-        printf("Error: %s exists; refusing to overwrite\n", outfilename);
-        goto error;
+    if(type == 1 && format_version == 2) { type = TYPE_MODE1_SEQ; }
+
+    bulk = (format_version == 2) ? bulk_type(type, form) : 0;
+    if(bulk && detect_fill(bulk, unit, sector_types[type].size, header)) {
+        type = sized_type(TYPE_FILL, sector_types[type].size);
+    }
+    tally[type]++;
+    if(type == TYPE_RAW_MODE2) {
+        return literal + (off_t)sector_types[raw_form_types[form - 1]].payload;
     }
+    return literal + (off_t)sector_types[type].payload;
+}
 
-    //
-    // Open both files
-    //
-    in = fopen(infilename, "rb");
-    if(!in) { goto error_in; }
+//
+// Returns nonzero on error
+//
+static int8_t estimate_image(const char* infilename) {
+    int8_t returncode = 0;
 
-    //
-    // Get the length of the input file
-    //
-    if(fseeko(in, 0, SEEK_END) != 0) { goto error_in; }
-    input_file_length = ftello(in);
+    ecm_input in;
+    uint8_t* buffer = NULL;
+    off_t input_file_length;
+    off_t stride = 2352;    // from one sector to the next
+    off_t unit_size = 2352; // of a sector without its subchannel data
+    int8_t cooked = 0;
+    off_t span;
+    off_t sampled = 0;
+    off_t tally[TYPE_COUNT] = {0};
+    double encoded[ESTIMATE_WINDOWS];
+    double literal[ESTIMATE_WINDOWS];
+    double encoded_total = 0;
+    double literal_total = 0;
+    double encoded_spread = 0;
+    double literal_spread = 0;
+    double scale = 0;
+    double elapsed = 0;
+    unsigned windows = ESTIMATE_WINDOWS;
+    unsigned w;
+    int t;
+
+    ecm_writer writer;
+    FILE* scratch = NULL;
+    uint32_t edc = 0;
+
+    memset(&in, 0, sizeof(in));
+    memset(&writer, 0, sizeof(writer));
+
+    in.f = fopen(infilename, "rb");
+    if(!in.f) { goto error_in; }
+    if(fseeko(in.f, 0, SEEK_END) != 0) { goto error_in; }
+    input_file_length = ftello(in.f);
     if(input_file_length < 0) { goto error_in; }
 
-    resetcounter(input_file_length);
+    //
+    // Sectors are found the way the encoder finds them
+    //
+    if(format_version == 2 && detect_subchannel_image(&in, input_file_length)) {
+        stride = 2448;
+    } else if(format_version == 2 && detect_cooked_image(&in, input_file_length)) {
+        stride = 2048;
+        unit_size = 2048;
+        cooked = 1;
+    }
 
-    if(fseeko(in, 0, SEEK_SET) != 0) { goto error_in; }
+    span = ESTIMATE_WINDOW_SECTORS * stride;
+    if(input_file_length <= ESTIMATE_WINDOWS * span) {
+        windows = 1;
+        span = input_file_length;
+    }
 
     //
-    // Magic header
+    // Room for a sector that starts at the end of a window
     //
-    if(
-        (fgetc(in) != 'E') ||
-        (fgetc(in) != 'C') ||
-        (fgetc(in) != 'M') ||
-        (fgetc(in) != 0x00)
-    ) {
-        printf("Header missing; does not appear to be an ECM file\n");
+    buffer = malloc((size_t)(span + stride));
+    if(!buffer) {
+        printf("Out of memory\n");
         goto error;
     }
 
     //
-    // Open output file
+    // What the encoder would write goes here, to be timed
     //
-    out = fopen(outfilename, "wb");
-    if(!out) { goto error_out; }
+    scratch = tmpfile();
+    if(!scratch) {
+        printf("Can't create a scratch file: %s\n", strerror(errno));
+        goto error;
+    }
+    if(writer_open(&writer, scratch, "scratch file", format_version)) { goto error; }
 
-    printf("Decoding %s to %s...\n", infilename, outfilename);
+    for(w = 0; w < windows; w++) {
+        off_t first = (windows == 1) ? 0 :
+            ((input_file_length / stride - ESTIMATE_WINDOW_SECTORS) * w / (ESTIMATE_WINDOWS - 1)) * stride;
+        off_t literal_before = tally[0];
+        off_t bytes = 0;
+        off_t pos = 0;
+        size_t got;
+        size_t written;
+        double start = trace_now();
+        if(fseeko(in.f, first, SEEK_SET) != 0) { goto error_in; }
+        got = fread(buffer, 1, (size_t)(span + stride), in.f);
+        if(got < (size_t)span) { goto error_in; }
 
-    for(;;) {
-        int c = fgetc(in);
-        int bits = 5;
-        if(c == EOF) { goto error_in; }
-        type = c & 3;
-        num = (c >> 2) & 0x1F;
-        while(c & 0x80) {
-            c = fgetc(in);
-            if(c == EOF) { goto error_in; }
-            if(
-                (bits > 31) ||
-                ((uint32_t)(c & 0x7F)) >= (((uint32_t)0x80000000LU) >> (bits-1))
-            ) {
-                printf("Corrupt ECM file; invalid sector count\n");
-                goto error;
-            }
-            num |= ((uint32_t)(c & 0x7F)) << bits;
-            bits += 7;
-        }
-        if(num == 0xFFFFFFFF) {
-            // End indicator
-            break;
-        }
-        num++;
-        if(type == 0) {
-            while(num) {
-                uint32_t b = num;
-                if(b > sizeof(sector_buffer)) { b = sizeof(sector_buffer); }
-                if(fread(sector_buffer, 1, b, in) != b) {
-                    goto error_in;
-                }
-                output_edc = edc_compute(output_edc, sector_buffer, b);
-                if(fwrite(sector_buffer, 1, b, out) != b) {
-                    goto error_out;
+        while(pos < span) {
+            off_t n = estimate_sector(buffer + pos, got - (size_t)pos, cooked, tally);
+            if(n >= 0) {
+                bytes += n;
+                pos += unit_size;
+            } else if(stride != 2352) {
+                //
+                // Sectors of these images are all in their places
+                //
+                bytes += unit_size;
+                tally[0] += unit_size;
+                pos += unit_size;
+            } else {
+                off_t next = pos + 1;
+                while(next < span && !may_be_sector(buffer + next, got - (size_t)next)) {
+                    next++;
                 }
-                num -= b;
-                setcounter_decode(ftello(in));
+                bytes += next - pos;
+                tally[0] += next - pos;
+                pos = next;
             }
-        } else {
-            for(; num; num--) {
-                switch(type) {
-                case 1:
-                    if(fread(sector_buffer + 0x00C, 1, 0x003, in) != 0x003) { goto error_in; }
-                    if(fread(sector_buffer + 0x010, 1, 0x800, in) != 0x800) { goto error_in; }
-                    reconstruct_sector(sector_buffer, 1);
-                    output_edc = edc_compute(output_edc, sector_buffer, 2352);
-                    if(fwrite(sector_buffer, 1, 2352, out) != 2352) { goto error_out; }
-                    break;
-                case 2:
-                    if(fread(sector_buffer + 0x014, 1, 0x804, in) != 0x804) { goto error_in; }
-                    reconstruct_sector(sector_buffer, 2);
-                    output_edc = edc_compute(output_edc, sector_buffer + 0x10, 2336);
-                    if(fwrite(sector_buffer + 0x10, 1, 2336, out) != 2336) { goto error_out; }
-                    break;
-                case 3:
-                    if(fread(sector_buffer + 0x014, 1, 0x918, in) != 0x918) { goto error_in; }
-                    reconstruct_sector(sector_buffer, 3);
-                    output_edc = edc_compute(output_edc, sector_buffer + 0x10, 2336);
-                    if(fwrite(sector_buffer + 0x10, 1, 2336, out) != 2336) { goto error_out; }
-                    break;
-                }
-                setcounter_decode(ftello(in));
+            if(stride != unit_size) {
+                //
+                // Past the subchannel data, which is kept apart
+                //
+                bytes += SUBCHANNEL_SIZE;
+                pos += SUBCHANNEL_SIZE;
             }
         }
+
+        //
+        // The encoder reads what it found again to write it, and each byte
+        // costs about the same to write whatever it turned out to be.
+        // Version 1 also takes the EDC of the input as it's checked.
+        //
+        if(fseeko(in.f, first, SEEK_SET) != 0) { goto error_in; }
+        if(fread(buffer, 1, (size_t)pos, in.f) != (size_t)pos) { goto error_in; }
+        if(format_version != 2) { edc = edc_compute(edc, buffer, (size_t)pos); }
+        for(written = 0; written < (size_t)pos; ) {
+            uint32_t room;
+            size_t n = (size_t)pos - written;
+            if(writer_room(&writer, 1, &room)) { goto error; }
+            if(n > room) { n = room; }
+            if(write_type_count(&writer, 0, (uint32_t)n)) { goto error; }
+            if(writer_literal(&writer, buffer + written, n)) { goto error; }
+            written += n;
+        }
+        elapsed += trace_now() - start;
+
+        encoded[w] = (double)bytes / (double)pos;
+        literal[w] = (double)(tally[0] - literal_before) / (double)pos;
+        encoded_total += (double)bytes;
+        literal_total += (double)(tally[0] - literal_before);
+        sampled += pos;
     }
+
+    if(writer_finish(&writer, edc)) { goto error; }
+
     //
-    // Verify the EDC of the entire output file
+    // Spread of the windows' encoded and literal bytes per input byte, less
+    // for a larger share of the image
     //
-    if(fread(sector_buffer, 1, 4, in) != 4) { goto error_in; }
-
-    printf("Decoded ");
-    fprintdec(stdout, ftello(in));
-    printf(" bytes -> ");
-    fprintdec(stdout, ftello(out));
-    printf(" bytes\n");
+    if(sampled) {
+        double share = (double)sampled / (double)input_file_length;
+        scale = (double)input_file_length / (double)sampled;
+        encoded_total *= scale;
+        literal_total *= scale;
+        if(windows > 1 && share < 1) {
+            double mean_encoded = encoded_total / (double)input_file_length;
+            double mean_literal = literal_total / (double)input_file_length;
+            for(w = 0; w < windows; w++) {
+                encoded_spread += (encoded[w] - mean_encoded) * (encoded[w] - mean_encoded);
+                literal_spread += (literal[w] - mean_literal) * (literal[w] - mean_literal);
+            }
+            encoded_spread = ESTIMATE_Z * (double)input_file_length *
+                sqrt(encoded_spread / (windows - 1) / windows * (1 - share));
+            literal_spread = ESTIMATE_Z * (double)input_file_length *
+                sqrt(literal_spread / (windows - 1) / windows * (1 - share));
+        }
+    }
 
-    if(get32lsb(sector_buffer) != output_edc) {
-        printf("Checksum error (0x%08lX, should be 0x%08lX)\n",
-            (unsigned long)output_edc,
-            (unsigned long)get32lsb(sector_buffer)
-        );
-        goto error;
+    printf("%s\tsize\t", infilename); fprintdec(stdout, input_file_length); printf("\n");
+    printf("%s\tsectorsize\t%d\n", infilename, (int)stride);
+    printf("%s\tsampled\t", infilename); fprintdec(stdout, sampled); printf("\n");
+    for(t = 0; t < TYPE_COUNT; t++) {
+        printf("%s\t%s\t", infilename, sector_types[t].name);
+        fprintdec(stdout, (off_t)((double)tally[t] * scale + 0.5)); printf("\n");
     }
+    printf("%s\tliterallow\t", infilename);
+    fprintdec(stdout, (off_t)(literal_total > literal_spread ? literal_total - literal_spread + 0.5 : 0)); printf("\n");
+    printf("%s\tliteralhigh\t", infilename);
+    fprintdec(stdout, (off_t)(literal_total + literal_spread < (double)input_file_length ?
+        literal_total + literal_spread + 0.5 : (double)input_file_length)); printf("\n");
+    printf("%s\tencoded\t", infilename); fprintdec(stdout, (off_t)(encoded_total + 0.5)); printf("\n");
+    printf("%s\tencodedlow\t", infilename);
+    fprintdec(stdout, (off_t)(encoded_total > encoded_spread ? encoded_total - encoded_spread + 0.5 : 0)); printf("\n");
+    printf("%s\tencodedhigh\t", infilename);
+    fprintdec(stdout, (off_t)(encoded_total + encoded_spread + 0.5)); printf("\n");
+    printf("%s\tseconds\t%.1f\n", infilename, elapsed * scale / 1e6);
 
     //
     // Success
     //
-    printf("Done\n");
     returncode = 0;
     goto done;
 
 error_in:
-    printfileerror(in, infilename);
-    goto error;
-
-error_out:
-    printfileerror(out, outfilename);
+    printfileerror(in.f, infilename);
     goto error;
 
 error:
@@ -1015,36 +10546,281 @@ error:
     goto done;
 
 done:
-    if(in    != NULL) { fclose(in ); }
-    if(out   != NULL) { fclose(out); }
+    writer_free(&writer);
+    if(scratch != NULL) { fclose(scratch); }
+    if(buffer  != NULL) { free(buffer); }
+    if(in.f    != NULL) { fclose(in.f); }
 
     return returncode;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Parse "START:LEN" (decimal); *length is set to -1 if LEN is left out
+//
+// Returns nonzero on error
+//
+static int8_t parse_range(const char* s, off_t* start, off_t* length) {
+    off_t* value = start;
+    *start = 0;
+    *length = -1;
+    if(!isdigit((unsigned char)*s)) { return 1; }
+    for(; *s; s++) {
+        if(*s == ':' && value == start) {
+            value = length;
+            if(!s[1]) { break; }
+            *length = 0;
+        } else if(isdigit((unsigned char)*s) && *value <= (((off_t)1) << 60)) {
+            *value = *value * 10 + (*s - '0');
+        } else {
+            return 1;
+        }
+    }
+    return value != length;
+}
+
+//
+// Parse a comma-separated list of digest names into a DIGEST_* bit mask
+//
+// Returns nonzero on error
+//
+static int8_t parse_digests(const char* s, unsigned* types) {
+    *types = 0;
+    while(*s) {
+        size_t length = strcspn(s, ",");
+        int8_t t;
+        for(t = 0; t < DIGEST_COUNT; t++) {
+            if(strlen(digest_types[t].name) == length && !strncmp(s, digest_types[t].name, length)) { break; }
+        }
+        if(t == DIGEST_COUNT) { return 1; }
+        *types |= 1u << t;
+        s += length;
+        if(*s == ',') { s++; }
+    }
+    return *types == 0;
+}
+
+//
+// Open the shared store, with a message on error
+//
+// Returns nonzero on error
+//
+static int8_t open_store(const char* directory, int8_t writing) {
+    const char* part;
+    shared_store = store_open(directory, writing, &part);
+    if(!shared_store) {
+        printf("Error: %s/%s: %s\n", directory, part,
+            errno == EINVAL ? "not part of a shared store, or damaged" : strerror(errno));
+        return 1;
+    }
+    return 0;
+}
+
+//
+// Open the base image, with a message on error
+//
+// Returns nonzero on error
+//
+static int8_t open_base(const char* filename, int8_t indexed) {
+    if(base_open(filename, indexed)) {
+        printf("Error: %s: %s\n", filename,
+            errno == ENXIO ? "a base image can't itself be encoded against one" :
+            errno == EINVAL ? "not an ECM file, or corrupt" : strerror(errno));
+        return 1;
+    }
+    return 0;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
 int main(int argc, char** argv) {
     int returncode = 0;
     int8_t encode = 0;
+    int8_t scan = 0;
+    int8_t estimate = 0;
+    int8_t test = 0;
+    int8_t info = 0;
+    int8_t perf = 0;
+    int8_t range = 0;
+    int8_t checkstore = 0;
+    int8_t iso = 0;
+    int8_t merge = 0;
+    int8_t recoding = 0;
+    int8_t container = 0;
+    off_t range_start = 0;
+    off_t range_length = -1;
     char* infilename  = NULL;
     char* outfilename = NULL;
     char* tempfilename = NULL;
+    char* tracefilename = NULL;
+    char* storedirectory = NULL;
+    char* basefilename = NULL;
+    char* cuefilename = NULL;
+    cue_sheet cue;
+    char** partials = NULL;
+    size_t partial_count = 0;
+    int i;
+    int files = 0;
 
+    memset(&cue, 0, sizeof(cue));
     normalize_argv0(argv[0]);
+    if(!strcmp(argv[0], "ecm2iso")) { iso = 1; }
+
+    //
+    // Pull out options; everything else is a filename
+    //
+    for(i = 1; i < argc; i++) {
+        char* arg = argv[i];
+        if(arg[0] != '-' || arg[1] != '-') {
+            argv[++files] = arg;
+        } else if(!strcmp(arg, "--")) {
+            while(++i < argc) { argv[++files] = argv[i]; }
+        } else if(!strcmp(arg, "--scan")) {
+            scan = 1;
+        } else if(!strcmp(arg, "--estimate")) {
+            estimate = 1;
+        } else if(!strcmp(arg, "--test")) {
+            test = 1;
+        } else if(!strcmp(arg, "--info")) {
+            info = 1;
+        } else if(!strcmp(arg, "--verify")) {
+            verify_enabled = 1;
+        } else if(!strcmp(arg, "--v1")) {
+            format_version = 1;
+        } else if(!strncmp(arg, "--range=", 8)) {
+            if(parse_range(arg + 8, &range_start, &range_length)) {
+                printf("Invalid range: %s\n", arg + 8);
+                goto usage;
+            }
+            range = 1;
+        } else if(!strncmp(arg, "--store=", 8) && arg[8]) {
+            storedirectory = arg + 8;
+        } else if(!strncmp(arg, "--base=", 7) && arg[7]) {
+            basefilename = arg + 7;
+        } else if(!strncmp(arg, "--cue=", 6) && arg[6]) {
+            cuefilename = arg + 6;
+        } else if(!strcmp(arg, "--check-store")) {
+            checkstore = 1;
+        } else if(!strcmp(arg, "--iso")) {
+            iso = 1;
+        } else if(!strcmp(arg, "--merge")) {
+            merge = 1;
+        } else if(!strcmp(arg, "--recode")) {
+            recoding = 1;
+        } else if(!strcmp(arg, "--resume")) {
+            resume_enabled = 1;
+        } else if(!strcmp(arg, "--hash")) {
+            digest_selected = (1u << DIGEST_COUNT) - 1;
+        } else if(!strncmp(arg, "--hash=", 7)) {
+            if(parse_digests(arg + 7, &digest_selected)) {
+                printf("Invalid digest list: %s\n", arg + 7);
+                goto usage;
+            }
+        } else if(!strncmp(arg, "--trace=", 8)) {
+            tracefilename = arg + 8;
+        } else if(!strcmp(arg, "--perf-counters")) {
+            perf = 1;
+        } else if(!strncmp(arg, "--threads=", 10)) {
+            char* end;
+            long n;
+            errno = 0;
+            n = strtol(arg + 10, &end, 10);
+            if(end == arg + 10 || *end || errno || n < 1 || (long)(unsigned)n != n) {
+                printf("Invalid thread count: %s\n", arg + 10);
+                goto usage;
+            }
+            thread_count = (unsigned)n;
+        } else {
+            printf("Unknown option: %s\n", arg);
+            goto usage;
+        }
+    }
+    argc = files + 1;
+
+    if(tracefilename && trace_open(tracefilename)) { goto error; }
+
+    //
+    // Initialize the ECC/EDC tables
+    //
+    eccedc_init();
+
+    if(scan) {
+        //
+        // bin2ecm --scan cdimagefile...
+        //
+        if(files < 1) { goto usage; }
+        for(i = 1; i <= files; i++) {
+            if(scan_image(argv[i])) { returncode = 1; }
+        }
+        goto done;
+    }
+
+    if(estimate) {
+        //
+        // bin2ecm --estimate cdimagefile...
+        //
+        if(files < 1) { goto usage; }
+        for(i = 1; i <= files; i++) {
+            if(estimate_image(argv[i])) { returncode = 1; }
+        }
+        goto done;
+    }
+
+    if(checkstore) {
+        //
+        // ecm2bin --check-store --store=DIR ecmfile...
+        //
+        if(!storedirectory) { goto usage; }
+        if(open_store(storedirectory, 0)) { goto error; }
+        returncode = check_store(storedirectory, argv + 1, files);
+        goto done;
+    }
+
+    if(test) {
+        //
+        // ecm2bin --test ecmfile...
+        //
+        if(files < 1) { goto usage; }
+        if(storedirectory && open_store(storedirectory, 0)) { goto error; }
+        if(basefilename && open_base(basefilename, 0)) { goto error; }
+        returncode = test_files(argv + 1, files);
+        goto done;
+    }
+
+    if(info) {
+        //
+        // ecm2bin --info ecmfile...
+        //
+        if(files < 1) { goto usage; }
+        returncode = info_files(argv + 1, files);
+        goto done;
+    }
 
     //
     // Check command line
     //
-    switch(argc) {
+    switch(merge ? 0 : argc) {
+    case 0:
+        //
+        // bin2ecm --merge source dest partial...
+        //
+        if(files < 3 || range || iso || !strcmp(argv[0], "ecm2bin")) { goto usage; }
+        encode = 1;
+        infilename  = argv[1];
+        outfilename = argv[2];
+        partials = argv + 3;
+        partial_count = (size_t)(files - 2);
+        break;
+
     case 2:
         //
         // bin2ecm source
         // ecm2bin source
         //
-        encode = (strcmp(argv[0], "ecm2bin") != 0);
+        encode = (strcmp(argv[0], "ecm2bin") != 0) && !iso;
         infilename  = argv[1];
 
-        tempfilename = malloc(strlen(infilename) + 7);
+        tempfilename = malloc(strlen(infilename) + 11);
         if(!tempfilename) {
             printf("Out of memory\n");
             goto error;
@@ -1076,6 +10852,14 @@ int main(int argc, char** argv) {
                 //
                 strcat(tempfilename, ".unecm");
             }
+            if(iso) {
+                //
+                // foo.bin.ecm becomes foo.iso
+                //
+                l = strlen(tempfilename);
+                if(l > 4 && !strcmp(tempfilename + l - 4, ".bin")) { tempfilename[l - 4] = 0; }
+                strcat(tempfilename, ".iso");
+            }
         }
         outfilename = tempfilename;
         break;
@@ -1084,8 +10868,9 @@ int main(int argc, char** argv) {
         //
         // bin2ecm source dest
         // ecm2bin source dest
+        // bin2ecm --recode source dest
         //
-        encode = (strcmp(argv[0], "ecm2bin") != 0);
+        encode = (strcmp(argv[0], "ecm2bin") != 0) && !iso;
         infilename  = argv[1];
         outfilename = argv[2];
         break;
@@ -1094,20 +10879,102 @@ int main(int argc, char** argv) {
         goto usage;
     }
 
+    if(recoding && (argc != 3 || !encode || range)) { goto usage; }
+
     //
-    // Initialize the ECC/EDC tables
+    // bin2ecm foo.cue: the sheet and its files go in one ECM file
     //
-    eccedc_init();
+    if(encode && !recoding) {
+        size_t l = strlen(infilename);
+        container =
+            (l > 4) &&
+            infilename[l - 4] == '.' &&
+            tolower(infilename[l - 3]) == 'c' &&
+            tolower(infilename[l - 2]) == 'u' &&
+            tolower(infilename[l - 1]) == 'e';
+    }
+    if(container) {
+        if(cuefilename || range || merge) { goto usage; }
+        if(format_version == 1) {
+            printf("Error: %s: a cue sheet's files need the version 2 format\n", infilename);
+            goto error;
+        }
+        if(cue_load(&cue, infilename)) { goto error; }
+        for(i = 0; i < (int)cue.file_count; i++) {
+            if(!cue_plain_name(cue.files[i])) {
+                printf("Error: %s: %s: files must be next to the cue sheet, named without directories\n",
+                    infilename, cue.files[i]);
+                goto error;
+            }
+        }
+    }
+
+    if(cuefilename) {
+        if(!encode || range || recoding) { goto usage; }
+        if(cue_load(&cue, cuefilename)) { goto error; }
+    }
+
+    if(resume_enabled) {
+        //
+        // Only whole encodes and decodes to a file keep checkpoints
+        //
+        if(range || iso || storedirectory) { goto usage; }
+#ifndef ECM_RESUME
+        printf("Error: --resume isn't supported on this platform\n");
+        goto error;
+#endif
+    }
+
+    if(storedirectory) {
+        //
+        // Only an encode adds to the store
+        //
+        if(encode && !range && format_version == 1) {
+            printf("Error: --store needs the version 2 format\n");
+            goto error;
+        }
+        if(open_store(storedirectory, encode && !range)) { goto error; }
+    }
+
+    if(basefilename) {
+        //
+        // Only an encode needs the base's sectors indexed
+        //
+        if(encode && !range && format_version == 1) {
+            printf("Error: --base needs the version 2 format\n");
+            goto error;
+        }
+        if(open_base(basefilename, encode && !range)) { goto error; }
+    }
+
+    if(perf) { perf_open(); }
 
     //
     // Go!
     //
-    if(encode) {
-        if(ecmify(infilename, outfilename)) { goto error; }
+    if(range) {
+        if(iso || digest_selected) { goto usage; }
+        if(encode) {
+            //
+            // A shard of an encode needs its output named
+            //
+            if(argc != 3) { goto usage; }
+            if(encode_partial(infilename, outfilename, range_start, range_length)) { goto error; }
+        } else {
+            if(extract_range(infilename, outfilename, range_start, range_length)) { goto error; }
+        }
+    } else if(iso) {
+        if(extract_iso(infilename, outfilename)) { goto error; }
+    } else if(recoding) {
+        if(recode(infilename, outfilename)) { goto error; }
+    } else if(encode) {
+        if(ecmify(infilename, outfilename, partials, partial_count, NULL, cue.track_count ? &cue : NULL, container)) { goto error; }
     } else {
         if(unecmify(infilename, outfilename)) { goto error; }
     }
 
+    perf_report();
+
     //
     // Success
     //
@@ -1126,6 +10993,57 @@ usage:
         "To decode:\n"
         "    ecm2bin ecmfile\n"
         "    ecm2bin ecmfile cdimagefile\n"
+        "\n"
+        "To encode a cue sheet and all its files into one ECM file, and decode it:\n"
+        "    bin2ecm cuefile\n"
+        "    ecm2bin ecmfile cuefile\n"
+        "\n"
+        "To encode on several machines: check a slice of the image on each, then\n"
+        "merge what they found into an ECM file (LEN may be left out):\n"
+        "    bin2ecm --range=START:LEN cdimagefile partialfile\n"
+        "    bin2ecm --merge cdimagefile ecmfile partialfile...\n"
+        "\n"
+        "To encode an ECM file again (with --v1 or --store=DIR, say) without\n"
+        "decoding it to disk:\n"
+        "    bin2ecm --recode ecmfile newecmfile\n"
+        "\n"
+        "To check raw images for bad sectors without encoding:\n"
+        "    bin2ecm --scan cdimagefile...\n"
+        "\n"
+        "To estimate how well and how quickly raw images would encode, from a sample:\n"
+        "    bin2ecm --estimate cdimagefile...\n"
+        "\n"
+        "To verify ECM files without writing any output:\n"
+        "    ecm2bin --test ecmfile...\n"
+        "\n"
+        "To show the size and sector counts of ECM files without decoding:\n"
+        "    ecm2bin --info ecmfile...\n"
+        "\n"
+        "To decode only part of the image (LEN may be left out):\n"
+        "    ecm2bin --range=START:LEN ecmfile cdimagefile\n"
+        "\n"
+        "To write only the 2048-byte user data of each sector, as an ISO image:\n"
+        "    ecm2bin --iso ecmfile isofile\n"
+        "\n"
+        "To check a shared store, and that the ECM files' sectors are in it:\n"
+        "    ecm2bin --check-store --store=DIR ecmfile...\n"
+        "\n"
+        "Options:\n"
+        "    --verify      Check that every encoded sector decodes back to the input\n"
+        "    --v1          Write the original single-stream format, without blocks\n"
+        "    --store=DIR   Keep sector data in a store shared between ECM files\n"
+        "    --cue=FILE    Take track boundaries and modes from the cue sheet FILE, and\n"
+        "                  check for sectors only where it says they start\n"
+        "    --base=FILE   Encode as a delta against FILE, an ECM file of another\n"
+        "                  revision (needed to decode too)\n"
+        "    --hash[=LIST] Print the CRC-32, MD5, SHA-1 and SHA-256 of the image (or\n"
+        "                  those in LIST, such as crc32,sha1) as a DAT file line\n"
+        "    --trace=FILE  Write a Chrome trace-event timeline to FILE\n"
+        "    --perf-counters  Report hardware performance counters for detection, ECC,\n"
+        "                  EDC, encoding, decoding and I/O\n"
+        "    --threads=N   Number of worker threads (default: one per CPU)\n"
+        "    --resume      Checkpoint an encode or decode as it goes, and carry on\n"
+        "                  from the last checkpoint if it was stopped\n"
     );
 
 error:
@@ -1133,8 +11051,16 @@ error:
     goto done;
 
 done:
+    store_close(shared_store);
+    shared_store = NULL;
+    base_close();
+    cue_free(&cue);
+    perf_close();
+    trace_close();
     if(tempfilename) { free(tempfilename); }
     return returncode;
 }
 
+#endif
+
 ////////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,107 @@
+#ifndef __ECM_H__
+#define __ECM_H__
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Random-access reading of ECM files
+//
+// Build ecm.c with ECM_NO_MAIN defined (or "make libecm.a") to use these from
+// another program.  A handle is not safe to share between threads without
+// locking; open one per thread instead.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+// The library is built with 64-bit file offsets; callers must agree
+#ifndef _FILE_OFFSET_BITS
+#define _FILE_OFFSET_BITS 64
+#endif
+
+#include <stdint.h>
+#include <sys/types.h>
+
+typedef struct ecm_file ecm_file;
+
+//
+// Open an ECM file (either version) for reading
+//
+// The run index is loaded from filename + ".idx" if that exists and matches
+// the file; otherwise it's built by reading the record headers.
+//
+// Returns NULL on error, with errno set
+//
+ecm_file* ecm_open(const char* filename);
+
+void ecm_close(ecm_file* f);
+
+//
+// Size of the decoded image, in bytes, including any subchannel data
+//
+off_t ecm_size(const ecm_file* f);
+
+//
+// Read size bytes of the decoded image starting at offset
+//
+// Only the sectors covering the range are reconstructed.  Data read this way
+// isn't checked against the file's EDC; use "ecm2bin --test" for that.
+//
+// Returns nonzero on error, including a range that runs past the end
+//
+int ecm_read(ecm_file* f, off_t offset, void* buffer, size_t size);
+
+//
+// Read one 2352-byte sector of a raw image (for an image with 2448-byte
+// sectors, the sector without its subchannel data)
+//
+// Returns nonzero on error
+//
+int ecm_read_sector(ecm_file* f, uint32_t lba, uint8_t* sector);
+
+//
+// Write the run index to filename + ".idx", so later opens can skip the scan
+//
+// Returns nonzero on error
+//
+int ecm_save_index(ecm_file* f);
+
+//
+// Use the shared sector store in the given directory (see "bin2ecm
+// --store=DIR") for files whose sectors are kept there
+//
+// The store is shared by all handles, and its entries are read through a
+// memory mapping, so it's safe to use from several threads.  Reads of stored
+// sectors fail with errno ENOENT if there's no store, or it doesn't have them.
+//
+// Returns nonzero on error, with errno set
+//
+int ecm_open_store(const char* directory);
+
+void ecm_close_store(void);
+
+//
+// Use the given ECM file as the base image for files encoded as a delta
+// against it (see "bin2ecm --base=FILE")
+//
+// Like the store, the base is shared by all handles.  Reads of sectors taken
+// from the base fail with errno ENXIO if there's no base open, or it isn't
+// the one the file was encoded against.
+//
+// Returns nonzero on error, with errno set
+//
+int ecm_open_base(const char* filename);
+
+void ecm_close_base(void);
+
+#endif